@@ -0,0 +1,236 @@
+#include "kernel/acpi.h"
+#include "kernel/mm.h"
+
+#define ACPI_BIOS_START 0xE0000
+#define ACPI_BIOS_END 0x100000
+#define ACPI_EBDA_POINTER 0x40E
+
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_SOURCE_OVERRIDE 2
+#define MADT_LAPIC_OVERRIDE 5
+#define MADT_PCAT_COMPAT 0x1
+#define MADT_CPU_ENABLED 0x1
+#define MADT_CPU_ONLINE_CAPABLE 0x2
+
+/* MPS INTI flags in source overrides: polarity in bits 0-1, trigger mode in bits 2-3. */
+#define MPS_POLARITY_MASK 0x3
+#define MPS_POLARITY_LOW 0x3
+#define MPS_TRIGGER_MASK 0xC
+#define MPS_TRIGGER_LEVEL 0xC
+
+typedef struct {
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt;
+  uint32_t length;
+  uint64_t xsdt;
+  uint8_t ext_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_t;
+
+typedef struct {
+  acpi_sdt_t header;
+  uint32_t lapic_base;
+  uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed)) madt_entry_t;
+
+typedef struct {
+  madt_entry_t header;
+  uint8_t processor_id;
+  uint8_t apic_id;
+  uint32_t flags;
+} __attribute__((packed)) madt_local_apic_t;
+
+typedef struct {
+  madt_entry_t header;
+  uint8_t id;
+  uint8_t reserved;
+  uint32_t address;
+  uint32_t gsi_base;
+} __attribute__((packed)) madt_io_apic_t;
+
+typedef struct {
+  madt_entry_t header;
+  uint8_t bus;
+  uint8_t source;
+  uint32_t gsi;
+  uint16_t flags;
+} __attribute__((packed)) madt_source_override_t;
+
+typedef struct {
+  madt_entry_t header;
+  uint16_t reserved;
+  uint64_t address;
+} __attribute__((packed)) madt_lapic_override_t;
+
+static acpi_info_t info;
+
+static int acpi_checksum_ok(const void *data, uint32_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < length; ++i) {
+    sum = (uint8_t)(sum + bytes[i]);
+  }
+  return sum == 0;
+}
+
+static int acpi_signature_is(const char *signature, const char *expected, uint32_t length) {
+  for (uint32_t i = 0; i < length; ++i) {
+    if (signature[i] != expected[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static const acpi_rsdp_t *acpi_scan_rsdp(uint64_t start, uint64_t end) {
+  for (uint64_t addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+    const acpi_rsdp_t *rsdp = (const acpi_rsdp_t *)mm_phys_to_virt(addr);
+    if (acpi_signature_is(rsdp->signature, "RSD PTR ", 8) && acpi_checksum_ok(rsdp, 20)) {
+      return rsdp;
+    }
+  }
+  return 0;
+}
+
+/* Without a bootloader copy, look where the BIOS leaves it: the first KiB of the EBDA, then 0xE0000-0xFFFFF. */
+static const acpi_rsdp_t *acpi_find_rsdp(const boot_info_t *boot) {
+  if (boot && boot->rsdp) {
+    const acpi_rsdp_t *rsdp = (const acpi_rsdp_t *)mm_phys_to_virt(boot->rsdp);
+    if (acpi_checksum_ok(rsdp, 20)) {
+      return rsdp;
+    }
+  }
+  /* The BIOS data area holds the EBDA segment; the empty asm hides the constant address from -Warray-bounds. */
+  uint64_t bda = ACPI_EBDA_POINTER;
+  __asm__("" : "+r"(bda));
+  uint64_t ebda = (uint64_t)*(const uint16_t *)mm_phys_to_virt(bda) << 4;
+  if (ebda >= 0x80000 && ebda < 0xA0000) {
+    const acpi_rsdp_t *rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    if (rsdp) {
+      return rsdp;
+    }
+  }
+  return acpi_scan_rsdp(ACPI_BIOS_START, ACPI_BIOS_END);
+}
+
+/* Maps a table (header first, then its full length) and checks its checksum. */
+static const acpi_sdt_t *acpi_map_table(uint64_t phys) {
+  const acpi_sdt_t *header = (const acpi_sdt_t *)mm_map_mmio(phys, sizeof(acpi_sdt_t));
+  if (!header || header->length < sizeof(acpi_sdt_t)) {
+    return 0;
+  }
+  const acpi_sdt_t *table = (const acpi_sdt_t *)mm_map_mmio(phys, header->length);
+  if (!table || !acpi_checksum_ok(table, table->length)) {
+    return 0;
+  }
+  return table;
+}
+
+static const acpi_sdt_t *acpi_find_table(const acpi_rsdp_t *rsdp, const char *signature) {
+  uint8_t wide = rsdp->revision >= 2 && rsdp->xsdt && acpi_checksum_ok(rsdp, rsdp->length);
+  const acpi_sdt_t *root = acpi_map_table(wide ? rsdp->xsdt : rsdp->rsdt);
+  if (!root) {
+    return 0;
+  }
+  uint32_t entry_size = wide ? 8 : 4;
+  uint32_t count = (root->length - (uint32_t)sizeof(acpi_sdt_t)) / entry_size;
+  const uint8_t *entries = (const uint8_t *)root + sizeof(acpi_sdt_t);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint64_t phys = wide ? *(const uint64_t *)(entries + i * 8) : *(const uint32_t *)(entries + i * 4);
+    const acpi_sdt_t *table = acpi_map_table(phys);
+    if (table && acpi_signature_is(table->signature, signature, 4)) {
+      return table;
+    }
+  }
+  return 0;
+}
+
+static void acpi_parse_madt(const acpi_madt_t *madt) {
+  info.lapic_base = madt->lapic_base;
+  info.legacy_pic = (madt->flags & MADT_PCAT_COMPAT) ? 1 : 0;
+  const uint8_t *cursor = (const uint8_t *)madt + sizeof(acpi_madt_t);
+  const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+  while (cursor + sizeof(madt_entry_t) <= end) {
+    const madt_entry_t *entry = (const madt_entry_t *)cursor;
+    if (entry->length < sizeof(madt_entry_t) || cursor + entry->length > end) {
+      break;
+    }
+    if (entry->type == MADT_LOCAL_APIC) {
+      const madt_local_apic_t *cpu = (const madt_local_apic_t *)entry;
+      if ((cpu->flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)) && info.cpu_count < ACPI_MAX_CPUS) {
+        info.cpu_apic_ids[info.cpu_count++] = cpu->apic_id;
+      }
+    } else if (entry->type == MADT_IO_APIC) {
+      /* Legacy IRQs live on the IO-APIC whose GSI range starts at 0; keep that one. */
+      const madt_io_apic_t *ioapic = (const madt_io_apic_t *)entry;
+      if (!info.ioapic_base || ioapic->gsi_base == 0) {
+        info.ioapic_base = ioapic->address;
+        info.ioapic_id = ioapic->id;
+        info.ioapic_gsi_base = ioapic->gsi_base;
+      }
+    } else if (entry->type == MADT_SOURCE_OVERRIDE) {
+      const madt_source_override_t *override = (const madt_source_override_t *)entry;
+      if (override->bus == 0 && override->source < ACPI_ISA_IRQS) {
+        acpi_irq_route_t *route = &info.isa[override->source];
+        route->gsi = override->gsi;
+        route->active_low = (override->flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW;
+        route->level = (override->flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL;
+      }
+    } else if (entry->type == MADT_LAPIC_OVERRIDE) {
+      info.lapic_base = ((const madt_lapic_override_t *)entry)->address;
+    }
+    cursor += entry->length;
+  }
+}
+
+/* Returns 0 once the MADT has been read, -1 without an RSDP and -2 without a MADT. */
+int acpi_init(const boot_info_t *boot) {
+  info.present = 0;
+  info.legacy_pic = 1;
+  info.lapic_base = 0;
+  info.cpu_count = 0;
+  info.ioapic_base = 0;
+  info.ioapic_id = 0;
+  info.ioapic_gsi_base = 0;
+  for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; ++irq) {
+    info.isa[irq].gsi = irq;
+    info.isa[irq].active_low = 0;
+    info.isa[irq].level = 0;
+  }
+  const acpi_rsdp_t *rsdp = acpi_find_rsdp(boot);
+  if (!rsdp) {
+    return -1;
+  }
+  const acpi_sdt_t *madt = acpi_find_table(rsdp, "APIC");
+  if (!madt) {
+    return -2;
+  }
+  acpi_parse_madt((const acpi_madt_t *)madt);
+  info.present = 1;
+  return 0;
+}
+
+const acpi_info_t *acpi_info(void) {
+  return &info;
+}
@@ -0,0 +1,280 @@
+#include "kernel/apic.h"
+#include "kernel/acpi.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/mm.h"
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE 0x800
+#define IA32_TSC_DEADLINE_MSR 0x6E0
+#define CPUID_FEATURE_APIC (1u << 9)
+#define CPUID_FEATURE_TSC_DEADLINE (1u << 24)
+
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_SVR 0xF0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+#define LAPIC_DIVIDE_16 0x3
+#define LAPIC_MMIO_SIZE 0x1000
+#define ICR_FIXED 0x000
+#define ICR_INIT 0x500
+#define ICR_STARTUP 0x600
+#define ICR_PENDING 0x1000
+#define ICR_ASSERT 0x4000
+#define ICR_ALL_BUT_SELF 0xC0000
+
+#define IOAPIC_REGSEL 0
+#define IOAPIC_WINDOW 4
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDIRECT 0x10
+#define IOAPIC_ACTIVE_LOW 0x2000
+#define IOAPIC_LEVEL 0x8000
+#define IOAPIC_MASKED 0x10000
+#define IOAPIC_MMIO_SIZE 0x20
+
+#define CALIBRATION_MS 10
+
+volatile uint32_t *apic_lapic = 0;
+static volatile uint32_t *ioapic = 0;
+static uint32_t ioapic_entries = 0;
+static uint8_t active = 0;
+static apic_timer_mode_t timer_mode = APIC_TIMER_NONE;
+static uint64_t timer_hz = 0;
+/* LAPIC timer counts per TSC cycle in 32.32 fixed point, for one-shot mode. */
+static uint64_t counts_per_cycle = 0;
+
+static uint32_t lapic_read(uint32_t reg) {
+  return apic_lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+  apic_lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(uint8_t reg) {
+  ioapic[IOAPIC_REGSEL] = reg;
+  return ioapic[IOAPIC_WINDOW];
+}
+
+static void ioapic_write(uint8_t reg, uint32_t value) {
+  ioapic[IOAPIC_REGSEL] = reg;
+  ioapic[IOAPIC_WINDOW] = value;
+}
+
+/* Enables the local APIC of the calling CPU with every local interrupt source masked. */
+static void lapic_enable(void) {
+  wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_ENABLE);
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+static void ioapic_set_entry(uint32_t index, uint32_t low, uint32_t high) {
+  /* Write the destination first so the entry is never live with a stale one. */
+  ioapic_write((uint8_t)(IOAPIC_REDIRECT + index * 2 + 1), high);
+  ioapic_write((uint8_t)(IOAPIC_REDIRECT + index * 2), low);
+}
+
+/*
+ * Enables the local APIC of this CPU and masks every IO-APIC input.
+ * Returns 0 on success and -1 if ACPI found no APIC or the CPU lacks one,
+ * in which case the caller stays on the 8259 PIC.
+ */
+int apic_init(void) {
+  const acpi_info_t *acpi = acpi_info();
+  active = 0;
+  if (!acpi->present || !acpi->lapic_base || !acpi->ioapic_base) {
+    return -1;
+  }
+  cpuid_regs_t regs;
+  cpuid(1, 0, &regs);
+  if (!(regs.edx & CPUID_FEATURE_APIC)) {
+    return -1;
+  }
+  apic_lapic = (volatile uint32_t *)mm_map_mmio(acpi->lapic_base, LAPIC_MMIO_SIZE);
+  ioapic = (volatile uint32_t *)mm_map_mmio(acpi->ioapic_base, IOAPIC_MMIO_SIZE);
+  if (!apic_lapic || !ioapic) {
+    return -1;
+  }
+  lapic_enable();
+
+  ioapic_entries = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+  for (uint32_t i = 0; i < ioapic_entries; ++i) {
+    ioapic_set_entry(i, IOAPIC_MASKED, 0);
+  }
+  active = 1;
+  return 0;
+}
+
+/* Application processors: the LAPIC sits at the same address on every CPU, so only enabling is left. */
+void apic_init_ap(void) {
+  if (active) {
+    lapic_enable();
+  }
+}
+
+int apic_active(void) {
+  return active;
+}
+
+uint32_t apic_id(void) {
+  return active ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+/* Routes an ISA IRQ to this CPU through the IO-APIC, honouring MADT source overrides. */
+int apic_route_irq(uint8_t irq, uint8_t vector) {
+  if (!active || irq >= ACPI_ISA_IRQS) {
+    return -1;
+  }
+  const acpi_info_t *acpi = acpi_info();
+  const acpi_irq_route_t *route = &acpi->isa[irq];
+  if (route->gsi < acpi->ioapic_gsi_base || route->gsi - acpi->ioapic_gsi_base >= ioapic_entries) {
+    return -1;
+  }
+  uint32_t low = vector;
+  if (route->active_low) {
+    low |= IOAPIC_ACTIVE_LOW;
+  }
+  if (route->level) {
+    low |= IOAPIC_LEVEL;
+  }
+  ioapic_set_entry(route->gsi - acpi->ioapic_gsi_base, low, apic_id() << 24);
+  return 0;
+}
+
+/*
+ * Sets up the LAPIC timer to fire once per apic_timer_arm() call on the
+ * given vector. TSC-deadline mode is used when the CPU has it; otherwise the
+ * timer runs one-shot from its count register, calibrated against the TSC.
+ */
+int apic_timer_init(uint8_t vector, uint64_t tsc_hz) {
+  if (!active || !tsc_hz) {
+    return -1;
+  }
+  cpuid_regs_t regs;
+  cpuid(1, 0, &regs);
+  if (regs.ecx & CPUID_FEATURE_TSC_DEADLINE) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | vector);
+    /* The LVT write must land before the first deadline write. */
+    __asm__ volatile("mfence" : : : "memory");
+    timer_mode = APIC_TIMER_TSC_DEADLINE;
+    timer_hz = tsc_hz;
+    return 0;
+  }
+
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | vector);
+  uint64_t wait = tsc_hz / (1000 / CALIBRATION_MS);
+  uint64_t start = rdtsc();
+  lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFFu);
+  while (rdtsc() - start < wait) {
+    cpu_relax();
+  }
+  uint32_t elapsed = 0xFFFFFFFFu - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+  if (!elapsed) {
+    return -1;
+  }
+  timer_hz = (uint64_t)elapsed * (1000 / CALIBRATION_MS);
+  counts_per_cycle = (timer_hz << 32) / tsc_hz;
+  lapic_write(LAPIC_LVT_TIMER, vector);
+  timer_mode = APIC_TIMER_ONESHOT;
+  return 0;
+}
+
+/* Puts an application processor's LAPIC timer in the mode the bootstrap processor chose, reusing its calibration. */
+int apic_timer_init_ap(uint8_t vector) {
+  if (timer_mode == APIC_TIMER_TSC_DEADLINE) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | vector);
+    __asm__ volatile("mfence" : : : "memory");
+    return 0;
+  }
+  if (timer_mode == APIC_TIMER_ONESHOT) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, vector);
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * ICR writes are two registers, so they run with interrupts off; an IPI
+ * sent from an interrupt handler in between would clobber the destination.
+ */
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+  uint64_t flags = interrupts_save();
+  while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+    cpu_relax();
+  }
+  lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+  lapic_write(LAPIC_ICR_LOW, command);
+  while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+    cpu_relax();
+  }
+  interrupts_restore(flags);
+}
+
+void apic_send_ipi(uint32_t apic_id, uint8_t vector) {
+  if (active) {
+    lapic_send(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+  }
+}
+
+/* One IPI to every other processor in the system, started or not. */
+void apic_send_ipi_others(uint8_t vector) {
+  if (active) {
+    lapic_send(0, ICR_FIXED | ICR_ASSERT | ICR_ALL_BUT_SELF | vector);
+  }
+}
+
+void apic_send_init(uint32_t apic_id) {
+  lapic_send(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+/* The AP starts executing in real mode at page * 4096. */
+void apic_send_startup(uint32_t apic_id, uint8_t page) {
+  lapic_send(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+}
+
+/* Programs the next (and only) timer interrupt for the given absolute TSC value. */
+void apic_timer_arm(uint64_t tsc_deadline) {
+  if (timer_mode == APIC_TIMER_TSC_DEADLINE) {
+    wrmsr(IA32_TSC_DEADLINE_MSR, tsc_deadline);
+    return;
+  }
+  if (timer_mode != APIC_TIMER_ONESHOT) {
+    return;
+  }
+  uint64_t now = rdtsc();
+  uint64_t cycles = tsc_deadline > now ? tsc_deadline - now : 0;
+  uint64_t counts = (uint64_t)(((unsigned __int128)cycles * counts_per_cycle) >> 32);
+  if (counts == 0) {
+    counts = 1;
+  }
+  if (counts > 0xFFFFFFFFu) {
+    counts = 0xFFFFFFFFu;
+  }
+  lapic_write(LAPIC_TIMER_INITIAL, (uint32_t)counts);
+}
+
+apic_timer_mode_t apic_timer_mode(void) {
+  return timer_mode;
+}
+
+uint64_t apic_timer_hz(void) {
+  return timer_hz;
+}
@@ -9,7 +9,12 @@
 .set EFER_MSR, 0xC0000080
 .set EFER_LME, 0x100
 
-.section .multiboot
+/* Must match KERNEL_VMA in linker.ld and MM_KERNEL_BASE in mm.h. */
+.set KERNEL_VMA, 0xFFFFFFFF80000000
+/* PML4 slot of the direct map at MM_DIRECT_BASE. */
+.set DIRECT_MAP_SLOT, 256
+
+.section .multiboot, "a"
 .align 8
 mb2_header:
   .long MB2_MAGIC
@@ -21,12 +26,18 @@ mb2_header:
   .long 8
 mb2_header_end:
 
-.section .text
+/*
+ * Runs at the physical load address with paging off, so symbols linked in
+ * the higher half are reached through their load address (sym - KERNEL_VMA).
+ */
+.section .boot, "ax"
 .global _start
 .code32
 _start:
   cli
-  mov $stack_top, %esp
+  mov $(stack_top - KERNEL_VMA), %esp
+  mov %eax, (mb2_magic - KERNEL_VMA)
+  mov %ebx, (mb2_info - KERNEL_VMA)
 
   call setup_paging
   lgdt gdt64_ptr
@@ -40,17 +51,22 @@ _start:
   or $CR4_PAE, %eax
   mov %eax, %cr4
 
-  mov $pml4, %eax
+  mov $(pml4 - KERNEL_VMA), %eax
   mov %eax, %cr3
 
   mov %cr0, %eax
   or $(CR0_PG | CR0_PE), %eax
   mov %eax, %cr0
 
-  ljmp $GDT64_CODE, $long_mode_entry
+  ljmp $GDT64_CODE, $long_mode_low
 
+/*
+ * Maps the first 1 GiB three times with 2 MiB pages: identity for the jump
+ * into long mode, at MM_DIRECT_BASE for the direct map and at KERNEL_VMA
+ * for the kernel image. mm_vm_init() replaces these tables.
+ */
 setup_paging:
-  mov $pd, %edi
+  mov $(pd - KERNEL_VMA), %edi
   xor %ebx, %ebx
   mov $512, %ecx
 1:
@@ -62,33 +78,33 @@ setup_paging:
   add $8, %edi
   loop 1b
 
-  mov $pd, %eax
+  mov $(pd - KERNEL_VMA), %eax
+  or $0x3, %eax
+  movl %eax, (pdpt_low - KERNEL_VMA)
+  movl $0, (pdpt_low - KERNEL_VMA + 4)
+  movl %eax, (pdpt_high - KERNEL_VMA + 510 * 8)
+  movl $0, (pdpt_high - KERNEL_VMA + 510 * 8 + 4)
+
+  mov $(pdpt_low - KERNEL_VMA), %eax
   or $0x3, %eax
-  movl %eax, pdpt
-  movl $0, pdpt+4
+  movl %eax, (pml4 - KERNEL_VMA)
+  movl $0, (pml4 - KERNEL_VMA + 4)
+  movl %eax, (pml4 - KERNEL_VMA + DIRECT_MAP_SLOT * 8)
+  movl $0, (pml4 - KERNEL_VMA + DIRECT_MAP_SLOT * 8 + 4)
 
-  mov $pdpt, %eax
+  mov $(pdpt_high - KERNEL_VMA), %eax
   or $0x3, %eax
-  movl %eax, pml4
-  movl $0, pml4+4
+  movl %eax, (pml4 - KERNEL_VMA + 511 * 8)
+  movl $0, (pml4 - KERNEL_VMA + 511 * 8 + 4)
 
   ret
 
+/* Still at the identity-mapped load address; the absolute jump enters the higher half. */
 .code64
-long_mode_entry:
-  mov $GDT64_DATA, %ax
-  mov %ax, %ds
-  mov %ax, %es
-  mov %ax, %ss
-
-  mov $stack_top, %rsp
-  call kernel_main
-
-.hang:
-  hlt
-  jmp .hang
+long_mode_low:
+  movabs $long_mode_entry, %rax
+  jmp *%rax
 
-.section .rodata
 .align 8
 gdt64:
   .quad 0x0000000000000000
@@ -104,11 +120,35 @@ gdt64_ptr_end:
 .set GDT64_CODE, 0x08
 .set GDT64_DATA, 0x10
 
+.section .text
+long_mode_entry:
+  mov $GDT64_DATA, %ax
+  mov %ax, %ds
+  mov %ax, %es
+  mov %ax, %ss
+
+  mov $stack_top, %rsp
+  mov mb2_magic(%rip), %edi
+  mov mb2_info(%rip), %esi
+  call kernel_main
+
+.hang:
+  hlt
+  jmp .hang
+
 .section .bss
+.align 4
+mb2_magic:
+  .skip 4
+mb2_info:
+  .skip 4
+
 .align 4096
 pml4:
   .skip 4096
-pdpt:
+pdpt_low:
+  .skip 4096
+pdpt_high:
   .skip 4096
 pd:
   .skip 4096
@@ -1,15 +1,28 @@
 .section .text
 .global irq0_stub
+.global irq1_stub
+.global irq4_stub
+.global yield_stub
+.global reschedule_stub
+.global tlb_flush_stub
+.global spurious_stub
 .global isr_stub
 .extern irq0_handler
+.extern irq1_handler
+.extern irq4_handler
+.extern scheduler_yield_handler
+.extern scheduler_ipi_handler
+.extern smp_tlb_flush_handler
+.extern scheduler_finish_switch
+.extern interrupts_irq_enter
+.extern interrupts_irq_exit
 
-isr_stub:
-  cli
-.hang:
-  hlt
-  jmp .hang
-
-irq0_stub:
+/*
+ * Register save area shared with interrupt_frame_t in kernel/interrupts.h.
+ * Handlers get the saved frame in %rdi and return the stack pointer of the
+ * frame to resume, which lets them switch to another thread's stack.
+ */
+.macro SAVE_REGS
   pushq %rax
   pushq %rbx
   pushq %rcx
@@ -25,9 +38,9 @@ irq0_stub:
   pushq %r13
   pushq %r14
   pushq %r15
+.endm
 
-  call irq0_handler
-
+.macro RESTORE_REGS
   popq %r15
   popq %r14
   popq %r13
@@ -43,5 +56,40 @@ irq0_stub:
   popq %rcx
   popq %rbx
   popq %rax
+.endm
+
+/*
+ * Entry for an interrupt whose C handler may switch threads. Once on the
+ * new stack, scheduler_finish_switch() releases the previous thread, which
+ * another CPU may then resume on the stack this code just left. The
+ * interrupts_irq_* calls time how long interrupts stay off.
+ */
+.macro SWITCH_STUB name, handler
+\name:
+  SAVE_REGS
+  call interrupts_irq_enter
+  mov %rsp, %rdi
+  call \handler
+  mov %rax, %rsp
+  call scheduler_finish_switch
+  mov %rsp, %rdi
+  call interrupts_irq_exit
+  RESTORE_REGS
+  iretq
+.endm
+
+isr_stub:
+  cli
+.hang:
+  hlt
+  jmp .hang
 
+spurious_stub:
   iretq
+
+SWITCH_STUB irq0_stub, irq0_handler
+SWITCH_STUB irq1_stub, irq1_handler
+SWITCH_STUB irq4_stub, irq4_handler
+SWITCH_STUB yield_stub, scheduler_yield_handler
+SWITCH_STUB reschedule_stub, scheduler_ipi_handler
+SWITCH_STUB tlb_flush_stub, smp_tlb_flush_handler
@@ -0,0 +1,100 @@
+/*
+ * Application processor start-up code. smp_init() copies everything
+ * between smp_trampoline_start and smp_trampoline_end to TRAMPOLINE_BASE
+ * and points the SIPI vector at it, so every address below is computed
+ * relative to that copy. The AP starts in real mode, switches to protected
+ * mode and then to long mode on the kernel's page tables, and calls
+ * smp_trampoline_entry(smp_trampoline_cpu) on smp_trampoline_stack.
+ * smp_init() identity-maps the copy while APs start, since paging is
+ * switched on underneath it.
+ */
+.set TRAMPOLINE_BASE, 0x8000
+.set CR0_PE, 0x1
+.set CR0_WP, 0x10000
+.set CR0_PG, 0x80000000
+.set CR4_PAE, 0x20
+.set EFER_MSR, 0xC0000080
+
+.set TRAMP_CODE32, 0x08
+.set TRAMP_DATA, 0x10
+.set TRAMP_CODE64, 0x18
+
+.section .rodata
+.global smp_trampoline_start
+.global smp_trampoline_end
+.global smp_trampoline_cr3
+.global smp_trampoline_efer
+.global smp_trampoline_stack
+.global smp_trampoline_cpu
+.global smp_trampoline_entry
+
+.code16
+smp_trampoline_start:
+  cli
+  cld
+  xor %ax, %ax
+  mov %ax, %ds
+  lgdtl (tramp_gdt_ptr - smp_trampoline_start + TRAMPOLINE_BASE)
+  mov %cr0, %eax
+  or $CR0_PE, %eax
+  mov %eax, %cr0
+  ljmpl $TRAMP_CODE32, $(tramp_protected - smp_trampoline_start + TRAMPOLINE_BASE)
+
+.code32
+tramp_protected:
+  mov $TRAMP_DATA, %ax
+  mov %ax, %ds
+  mov %ax, %es
+  mov %ax, %ss
+
+  mov %cr4, %eax
+  or $CR4_PAE, %eax
+  mov %eax, %cr4
+
+  mov (smp_trampoline_cr3 - smp_trampoline_start + TRAMPOLINE_BASE), %eax
+  mov %eax, %cr3
+
+  mov $EFER_MSR, %ecx
+  rdmsr
+  or (smp_trampoline_efer - smp_trampoline_start + TRAMPOLINE_BASE), %eax
+  wrmsr
+
+  mov %cr0, %eax
+  or $(CR0_PG | CR0_WP), %eax
+  mov %eax, %cr0
+
+  ljmp $TRAMP_CODE64, $(tramp_long - smp_trampoline_start + TRAMPOLINE_BASE)
+
+.code64
+tramp_long:
+  mov (smp_trampoline_stack - smp_trampoline_start + TRAMPOLINE_BASE), %rsp
+  mov (smp_trampoline_cpu - smp_trampoline_start + TRAMPOLINE_BASE), %rdi
+  mov (smp_trampoline_entry - smp_trampoline_start + TRAMPOLINE_BASE), %rax
+  call *%rax
+1:
+  hlt
+  jmp 1b
+
+.align 8
+tramp_gdt:
+  .quad 0x0000000000000000
+  .quad 0x00CF9A000000FFFF
+  .quad 0x00CF92000000FFFF
+  .quad 0x00209A0000000000
+tramp_gdt_ptr:
+  .word tramp_gdt_ptr - tramp_gdt - 1
+  .long tramp_gdt - smp_trampoline_start + TRAMPOLINE_BASE
+
+.align 8
+smp_trampoline_cr3:
+  .quad 0
+/* EFER bits to set: LME, plus NXE when the kernel page tables use NX. */
+smp_trampoline_efer:
+  .quad 0
+smp_trampoline_stack:
+  .quad 0
+smp_trampoline_cpu:
+  .quad 0
+smp_trampoline_entry:
+  .quad 0
+smp_trampoline_end:
@@ -1,71 +1,310 @@
 #include "kernel/console.h"
+#include "kernel/interrupts.h"
+#include "kernel/scheduler.h"
+#include "kernel/spinlock.h"
 #include "kernel/vga.h"
 
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
+/* Lines kept in the RAM scrollback ring; a power of two so line numbers wrap with a mask. */
+#define CONSOLE_HISTORY 256
+#define CONSOLE_HISTORY_MASK (CONSOLE_HISTORY - 1)
+#define CONSOLE_CLEAN_LO VGA_WIDTH
+#define CONSOLE_INPUT_SIZE 128
+#define CONSOLE_INPUT_MASK (CONSOLE_INPUT_SIZE - 1)
 
-static uint8_t console_row = 0;
+/*
+ * Text lives in history, indexed by an ever-growing line number; text
+ * memory is only ever written. screen_top is the line shown in the first
+ * screen row when the view follows the output, scroll_back how many lines
+ * the user has paged above that. Each screen row remembers the column span
+ * changed since the last flush. console_lock serialises writers from all
+ * CPUs and is taken before any sink's own lock.
+ */
+static spinlock_t console_lock = SPINLOCK_INIT("console");
+static uint16_t history[CONSOLE_HISTORY][VGA_WIDTH];
+static uint32_t cursor_line = 0;
+static uint32_t screen_top = 0;
+static uint32_t scroll_back = 0;
 static uint8_t console_col = 0;
 static uint8_t console_color = 0x1F;
+/* First VRAM row of the visible window; advancing it is a hardware scroll. */
+static uint16_t origin_row = 0;
+static uint8_t dirty_lo[VGA_HEIGHT];
+static uint8_t dirty_hi[VGA_HEIGHT];
 
-static void console_newline(void) {
-  console_col = 0;
-  if (console_row + 1 < VGA_HEIGHT) {
-    console_row++;
-    return;
+static console_sink_fn sinks[CONSOLE_SINK_MAX];
+static uint32_t sink_count = 0;
+
+/*
+ * Input from every device (keyboard, serial) lands here. Producers are IRQ
+ * handlers, possibly on different CPUs, so they share input_lock with the
+ * shell, the only consumer; the indices run freely and are masked on access.
+ */
+static spinlock_t input_lock = SPINLOCK_INIT("console-input");
+static char input[CONSOLE_INPUT_SIZE];
+static volatile uint32_t input_head = 0;
+static volatile uint32_t input_tail = 0;
+static volatile uint64_t input_dropped = 0;
+static task_t *volatile input_waiter = 0;
+
+static uint16_t *line_cells(uint32_t line) {
+  return history[line & CONSOLE_HISTORY_MASK];
+}
+
+static void mark_dirty(uint32_t row, uint8_t lo, uint8_t hi) {
+  if (lo < dirty_lo[row]) {
+    dirty_lo[row] = lo;
+  }
+  if (hi > dirty_hi[row]) {
+    dirty_hi[row] = hi;
   }
-  for (uint8_t row = 1; row < VGA_HEIGHT; ++row) {
-    for (uint8_t col = 0; col < VGA_WIDTH; ++col) {
-      char c = vga_read_at(row, col);
-      vga_putc_at(c, console_color, row - 1, col);
+}
+
+static void mark_all_dirty(void) {
+  for (uint32_t row = 0; row < VGA_HEIGHT; ++row) {
+    dirty_lo[row] = 0;
+    dirty_hi[row] = VGA_WIDTH - 1;
+  }
+}
+
+static void clear_line(uint32_t line) {
+  uint16_t *cells = line_cells(line);
+  uint16_t blank = vga_cell(' ', console_color);
+  for (uint32_t col = 0; col < VGA_WIDTH; ++col) {
+    cells[col] = blank;
+  }
+}
+
+/* Writes the dirty spans of the visible rows to text memory and places the hardware cursor. */
+static void console_flush(void) {
+  uint32_t view_top = screen_top - scroll_back;
+  for (uint32_t row = 0; row < VGA_HEIGHT; ++row) {
+    if (dirty_lo[row] > dirty_hi[row]) {
+      continue;
     }
+    uint8_t lo = dirty_lo[row];
+    uint16_t offset = (uint16_t)((origin_row + row) * VGA_WIDTH + lo);
+    vga_write_cells(offset, line_cells(view_top + row) + lo, (uint16_t)(dirty_hi[row] - lo + 1));
+    dirty_lo[row] = CONSOLE_CLEAN_LO;
+    dirty_hi[row] = 0;
   }
-  for (uint8_t col = 0; col < VGA_WIDTH; ++col) {
-    vga_putc_at(' ', console_color, VGA_HEIGHT - 1, col);
+  uint32_t cursor_row = cursor_line - screen_top;
+  vga_set_cursor((uint16_t)((origin_row + cursor_row) * VGA_WIDTH + console_col));
+}
+
+/* Returns the view to the live output before anything new is drawn. */
+static void follow_output(void) {
+  if (scroll_back) {
+    scroll_back = 0;
+    mark_all_dirty();
   }
 }
 
-void console_init(uint8_t color) {
-  console_row = 0;
-  console_col = 0;
-  console_color = color;
-  vga_clear(color);
+/*
+ * Scrolls by moving the CRTC start address one row down text memory; only
+ * the new bottom row has to be drawn. When the window reaches the end of
+ * text memory it jumps back to row 0 and the screen is redrawn once.
+ */
+static void hardware_scroll(void) {
+  console_flush();
+  screen_top++;
+  if (origin_row + VGA_HEIGHT < VGA_VRAM_ROWS) {
+    origin_row++;
+  } else {
+    origin_row = 0;
+    mark_all_dirty();
+  }
+  vga_set_origin((uint16_t)(origin_row * VGA_WIDTH));
+  mark_dirty(VGA_HEIGHT - 1, 0, VGA_WIDTH - 1);
 }
 
-void console_clear(void) {
-  console_row = 0;
+static void console_newline(void) {
   console_col = 0;
-  vga_clear(console_color);
+  cursor_line++;
+  clear_line(cursor_line);
+  if (cursor_line - screen_top < VGA_HEIGHT) {
+    mark_dirty(cursor_line - screen_top, 0, VGA_WIDTH - 1);
+    return;
+  }
+  hardware_scroll();
 }
 
-void console_putc(char c) {
+static void console_emit(char c) {
   if (c == '\n') {
     console_newline();
     return;
   }
+  uint32_t row = cursor_line - screen_top;
   if (c == '\b') {
     if (console_col > 0) {
       console_col--;
-      vga_putc_at(' ', console_color, console_row, console_col);
+      line_cells(cursor_line)[console_col] = vga_cell(' ', console_color);
+      mark_dirty(row, console_col, console_col);
     }
     return;
   }
-  vga_putc_at(c, console_color, console_row, console_col);
+  line_cells(cursor_line)[console_col] = vga_cell(c, console_color);
+  mark_dirty(row, console_col, console_col);
   console_col++;
   if (console_col >= VGA_WIDTH) {
     console_newline();
   }
 }
 
-void console_write(const char *text) {
-  while (*text) {
-    console_putc(*text++);
+/* The VGA screen is the first sink: text goes to the shadow first and dirty spans are flushed once per write. */
+static void vga_sink_write(const char *text, uint32_t length) {
+  follow_output();
+  for (uint32_t i = 0; i < length; ++i) {
+    console_emit(text[i]);
   }
+  console_flush();
 }
 
+/* Caller holds console_lock. */
+static void fan_out_locked(const char *text, uint32_t length) {
+  for (uint32_t i = 0; i < sink_count; ++i) {
+    sinks[i](text, length);
+  }
+}
+
+static uint32_t text_length(const char *text) {
+  uint32_t length = 0;
+  while (text[length]) {
+    length++;
+  }
+  return length;
+}
+
+static void console_fan_out(const char *text, uint32_t length) {
+  uint64_t flags = spin_lock_irqsave(&console_lock);
+  fan_out_locked(text, length);
+  spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void console_init(uint8_t color) {
+  console_color = color;
+  cursor_line = 0;
+  screen_top = 0;
+  scroll_back = 0;
+  console_col = 0;
+  origin_row = 0;
+  for (uint32_t line = 0; line < VGA_HEIGHT; ++line) {
+    clear_line(line);
+  }
+  for (uint32_t row = 0; row < VGA_HEIGHT; ++row) {
+    dirty_lo[row] = CONSOLE_CLEAN_LO;
+    dirty_hi[row] = 0;
+  }
+  vga_clear(color);
+  vga_set_cursor(0);
+  sink_count = 0;
+  input_head = 0;
+  input_tail = 0;
+  input_dropped = 0;
+  input_waiter = 0;
+  console_add_sink(vga_sink_write);
+}
+
+/* Starts a blank screen below the current output; earlier lines stay in the scrollback. */
+void console_clear(void) {
+  uint64_t flags = spin_lock_irqsave(&console_lock);
+  scroll_back = 0;
+  cursor_line++;
+  screen_top = cursor_line;
+  console_col = 0;
+  for (uint32_t row = 0; row < VGA_HEIGHT; ++row) {
+    clear_line(screen_top + row);
+  }
+  mark_all_dirty();
+  console_flush();
+  spin_unlock_irqrestore(&console_lock, flags);
+}
+
+int console_add_sink(console_sink_fn sink) {
+  if (!sink || sink_count >= CONSOLE_SINK_MAX) {
+    return -1;
+  }
+  sinks[sink_count++] = sink;
+  return 0;
+}
+
+void console_putc(char c) {
+  console_fan_out(&c, 1);
+}
+
+void console_write(const char *text) {
+  console_fan_out(text, text_length(text));
+}
+
+/* One lock hold, so a line from another CPU cannot land between the text and its newline. */
 void console_write_line(const char *text) {
-  console_write(text);
-  console_putc('\n');
+  uint64_t flags = spin_lock_irqsave(&console_lock);
+  fan_out_locked(text, text_length(text));
+  fan_out_locked("\n", 1);
+  spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Called from IRQ handlers; wakes the shell if it is waiting for input. */
+void console_input_push(char c) {
+  uint64_t flags = spin_lock_irqsave(&input_lock);
+  uint32_t head = input_head;
+  if (head - input_tail == CONSOLE_INPUT_SIZE) {
+    input_dropped++;
+    spin_unlock_irqrestore(&input_lock, flags);
+    return;
+  }
+  input[head & CONSOLE_INPUT_MASK] = c;
+  input_head = head + 1;
+  task_t *task = input_waiter;
+  input_waiter = 0;
+  spin_unlock_irqrestore(&input_lock, flags);
+  if (task) {
+    scheduler_wake(task);
+  }
+}
+
+/* Blocks until a key arrives from any input device; the CPU idles in the meantime. */
+char console_getchar(void) {
+  for (;;) {
+    uint64_t flags = spin_lock_irqsave(&input_lock);
+    uint32_t tail = input_tail;
+    if (tail != input_head) {
+      char c = input[tail & CONSOLE_INPUT_MASK];
+      input_tail = tail + 1;
+      spin_unlock_irqrestore(&input_lock, flags);
+      return c;
+    }
+    input_waiter = scheduler_self();
+    spin_unlock(&input_lock);
+    /* A push between the unlock and the block leaves a pending wake-up, so it is not lost. */
+    scheduler_block();
+    interrupts_restore(flags);
+  }
+}
+
+uint64_t console_input_dropped(void) {
+  return input_dropped;
+}
+
+/* Pages the view through the scrollback; positive lines move towards older output. */
+void console_scroll(int lines) {
+  uint64_t flags = spin_lock_irqsave(&console_lock);
+  /* Lines down to the bottom screen row are in use, so only the CONSOLE_HISTORY lines before that survive. */
+  uint32_t newest = screen_top + VGA_HEIGHT - 1;
+  uint32_t oldest = newest >= CONSOLE_HISTORY - 1 ? newest - (CONSOLE_HISTORY - 1) : 0;
+  uint32_t max_back = screen_top - oldest;
+  int64_t target = (int64_t)scroll_back + lines;
+  if (target < 0) {
+    target = 0;
+  }
+  if (target > (int64_t)max_back) {
+    target = max_back;
+  }
+  if ((uint32_t)target != scroll_back) {
+    scroll_back = (uint32_t)target;
+    mark_all_dirty();
+    console_flush();
+  }
+  spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void console_prompt(void) {
@@ -0,0 +1,337 @@
+#include "kernel/heap.h"
+#include "kernel/mm.h"
+#include "kernel/spinlock.h"
+
+#define HEAP_SLAB_MAGIC 0x534C4142u
+#define HEAP_LARGE_MAGIC 0x4C415247u
+#define HEAP_MIN_OBJECTS 8
+#define HEAP_KMALLOC_MIN_OBJECTS 1
+#define HEAP_EMPTY_KEEP 1
+#define HEAP_ALIGN 16
+
+/*
+ * Every slab is a naturally aligned buddy block with this header at its start,
+ * so the owning slab of an object is found by masking the object address.
+ */
+typedef struct heap_slab {
+  uint32_t magic;
+  uint16_t in_use;
+  uint16_t capacity;
+  kmem_cache_t *cache;
+  struct heap_slab *next;
+  struct heap_slab *prev;
+  void *free_list;
+} heap_slab_t;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t order;
+} heap_large_t;
+
+typedef struct {
+  heap_slab_t *head;
+} heap_slab_list_t;
+
+/* lock guards the slab lists and counters; slab pages come from mm under it. */
+struct kmem_cache {
+  const char *name;
+  spinlock_t lock;
+  uint32_t object_size;
+  uint32_t object_offset;
+  uint16_t per_slab;
+  uint8_t slab_order;
+  heap_slab_list_t partial;
+  heap_slab_list_t full;
+  heap_slab_list_t empty;
+  uint32_t empty_count;
+  uint32_t slabs;
+  uint32_t in_use;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+static const uint32_t heap_size_classes[] = {16, 32, 64, 128, 256, 512, 1024};
+#define HEAP_SIZE_CLASS_COUNT (sizeof(heap_size_classes) / sizeof(heap_size_classes[0]))
+
+static const char *const heap_size_names[HEAP_SIZE_CLASS_COUNT] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+/* heap_lock only covers creating caches; allocation takes the cache's own lock. */
+static spinlock_t heap_lock = SPINLOCK_INIT("heap");
+static kmem_cache_t heap_caches[HEAP_CACHE_MAX];
+static uint32_t heap_cache_used = 0;
+static kmem_cache_t *heap_kmalloc_caches[HEAP_SIZE_CLASS_COUNT];
+static uint64_t heap_large_page_count = 0;
+
+static uint32_t heap_align(uint32_t value, uint32_t align) {
+  return (value + align - 1) & ~(align - 1);
+}
+
+static void heap_list_push(heap_slab_list_t *list, heap_slab_t *slab) {
+  slab->prev = 0;
+  slab->next = list->head;
+  if (list->head) {
+    list->head->prev = slab;
+  }
+  list->head = slab;
+}
+
+static void heap_list_remove(heap_slab_list_t *list, heap_slab_t *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    list->head = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = 0;
+  slab->prev = 0;
+}
+
+static heap_slab_t *heap_slab_new(kmem_cache_t *cache) {
+  uint64_t phys = mm_alloc_pages(cache->slab_order);
+  if (!phys) {
+    return 0;
+  }
+  heap_slab_t *slab = (heap_slab_t *)mm_phys_to_virt(phys);
+  slab->magic = HEAP_SLAB_MAGIC;
+  slab->in_use = 0;
+  slab->capacity = cache->per_slab;
+  slab->cache = cache;
+  slab->next = 0;
+  slab->prev = 0;
+  slab->free_list = 0;
+  uint8_t *base = (uint8_t *)slab + cache->object_offset;
+  for (uint16_t i = cache->per_slab; i > 0; --i) {
+    void **object = (void **)(base + (uint32_t)(i - 1) * cache->object_size);
+    *object = slab->free_list;
+    slab->free_list = object;
+  }
+  cache->slabs++;
+  return slab;
+}
+
+static void heap_slab_release(kmem_cache_t *cache, heap_slab_t *slab) {
+  slab->magic = 0;
+  cache->slabs--;
+  mm_free_pages(mm_virt_to_phys(slab), cache->slab_order);
+}
+
+static heap_slab_t *heap_slab_of(const void *ptr, uint8_t order) {
+  uint64_t mask = ((uint64_t)MM_PAGE_SIZE << order) - 1;
+  return (heap_slab_t *)((uint64_t)ptr & ~mask);
+}
+
+/* kmalloc caches keep one-page slabs so kfree() can find the header from any object. */
+static kmem_cache_t *heap_cache_setup(const char *name, uint32_t object_size,
+                                      uint32_t min_objects) {
+  if (object_size == 0 || heap_cache_used >= HEAP_CACHE_MAX) {
+    return 0;
+  }
+  if (object_size < sizeof(void *)) {
+    object_size = sizeof(void *);
+  }
+  object_size = heap_align(object_size, object_size >= HEAP_ALIGN ? HEAP_ALIGN : sizeof(void *));
+  uint32_t offset = heap_align(sizeof(heap_slab_t), HEAP_ALIGN);
+  uint8_t order = 0;
+  while (order < MM_MAX_ORDER &&
+         ((uint32_t)MM_PAGE_SIZE << order) - offset < object_size * min_objects) {
+    order++;
+  }
+  uint32_t per_slab = (((uint32_t)MM_PAGE_SIZE << order) - offset) / object_size;
+  if (per_slab == 0 || per_slab > 0xFFFF) {
+    return 0;
+  }
+  kmem_cache_t *cache = &heap_caches[heap_cache_used];
+  cache->name = name;
+  spin_lock_init(&cache->lock, name);
+  cache->object_size = object_size;
+  cache->object_offset = offset;
+  cache->per_slab = (uint16_t)per_slab;
+  cache->slab_order = order;
+  cache->partial.head = 0;
+  cache->full.head = 0;
+  cache->empty.head = 0;
+  cache->empty_count = 0;
+  cache->slabs = 0;
+  cache->in_use = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  __atomic_store_n(&heap_cache_used, heap_cache_used + 1, __ATOMIC_RELEASE);
+  return cache;
+}
+
+void heap_init(void) {
+  heap_cache_used = 0;
+  heap_large_page_count = 0;
+  for (uint32_t i = 0; i < HEAP_SIZE_CLASS_COUNT; ++i) {
+    heap_kmalloc_caches[i] = heap_cache_setup(heap_size_names[i], heap_size_classes[i],
+                                              HEAP_KMALLOC_MIN_OBJECTS);
+  }
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t object_size) {
+  uint64_t flags = spin_lock_irqsave(&heap_lock);
+  kmem_cache_t *cache = heap_cache_setup(name, object_size, HEAP_MIN_OBJECTS);
+  spin_unlock_irqrestore(&heap_lock, flags);
+  return cache;
+}
+
+static void *cache_alloc_locked(kmem_cache_t *cache) {
+  heap_slab_t *slab = cache->partial.head;
+  if (slab) {
+    cache->hits++;
+  } else if (cache->empty.head) {
+    slab = cache->empty.head;
+    heap_list_remove(&cache->empty, slab);
+    cache->empty_count--;
+    heap_list_push(&cache->partial, slab);
+    cache->hits++;
+  } else {
+    slab = heap_slab_new(cache);
+    if (!slab) {
+      return 0;
+    }
+    heap_list_push(&cache->partial, slab);
+    cache->misses++;
+  }
+  void **object = (void **)slab->free_list;
+  slab->free_list = *object;
+  slab->in_use++;
+  cache->in_use++;
+  if (slab->in_use == slab->capacity) {
+    heap_list_remove(&cache->partial, slab);
+    heap_list_push(&cache->full, slab);
+  }
+  return object;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  if (!cache) {
+    return 0;
+  }
+  uint64_t flags = spin_lock_irqsave(&cache->lock);
+  void *object = cache_alloc_locked(cache);
+  spin_unlock_irqrestore(&cache->lock, flags);
+  return object;
+}
+
+static void cache_free_locked(kmem_cache_t *cache, void *ptr) {
+  heap_slab_t *slab = heap_slab_of(ptr, cache->slab_order);
+  if (slab->magic != HEAP_SLAB_MAGIC || slab->cache != cache) {
+    return;
+  }
+  if (slab->in_use == slab->capacity) {
+    heap_list_remove(&cache->full, slab);
+    heap_list_push(&cache->partial, slab);
+  }
+  void **object = (void **)ptr;
+  *object = slab->free_list;
+  slab->free_list = object;
+  slab->in_use--;
+  cache->in_use--;
+  if (slab->in_use == 0) {
+    heap_list_remove(&cache->partial, slab);
+    if (cache->empty_count >= HEAP_EMPTY_KEEP) {
+      heap_slab_release(cache, slab);
+      return;
+    }
+    heap_list_push(&cache->empty, slab);
+    cache->empty_count++;
+  }
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *ptr) {
+  if (!cache || !ptr) {
+    return;
+  }
+  uint64_t flags = spin_lock_irqsave(&cache->lock);
+  cache_free_locked(cache, ptr);
+  spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void *kmalloc(size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < HEAP_SIZE_CLASS_COUNT; ++i) {
+    if (size <= heap_size_classes[i]) {
+      return kmem_cache_alloc(heap_kmalloc_caches[i]);
+    }
+  }
+  uint64_t total = size + HEAP_ALIGN;
+  uint8_t order = 0;
+  while (order < MM_MAX_ORDER && ((uint64_t)MM_PAGE_SIZE << order) < total) {
+    order++;
+  }
+  if (((uint64_t)MM_PAGE_SIZE << order) < total) {
+    return 0;
+  }
+  uint64_t phys = mm_alloc_pages(order);
+  if (!phys) {
+    return 0;
+  }
+  heap_large_t *large = (heap_large_t *)mm_phys_to_virt(phys);
+  large->magic = HEAP_LARGE_MAGIC;
+  large->order = order;
+  __atomic_fetch_add(&heap_large_page_count, 1ull << order, __ATOMIC_RELAXED);
+  return (uint8_t *)large + HEAP_ALIGN;
+}
+
+void *kzalloc(size_t size) {
+  uint8_t *ptr = (uint8_t *)kmalloc(size);
+  if (ptr) {
+    for (size_t i = 0; i < size; ++i) {
+      ptr[i] = 0;
+    }
+  }
+  return ptr;
+}
+
+void kfree(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  /* Objects never sit at the start of a page, so the page start holds the owning header. */
+  uint32_t *magic = (uint32_t *)((uint64_t)ptr & ~(uint64_t)(MM_PAGE_SIZE - 1));
+  if (*magic == HEAP_LARGE_MAGIC) {
+    heap_large_t *large = (heap_large_t *)magic;
+    uint8_t order = large->order;
+    large->magic = 0;
+    __atomic_fetch_sub(&heap_large_page_count, 1ull << order, __ATOMIC_RELAXED);
+    mm_free_pages(mm_virt_to_phys(large), order);
+    return;
+  }
+  if (*magic == HEAP_SLAB_MAGIC) {
+    heap_slab_t *slab = (heap_slab_t *)magic;
+    kmem_cache_free(slab->cache, ptr);
+  }
+}
+
+uint32_t heap_cache_count(void) {
+  return __atomic_load_n(&heap_cache_used, __ATOMIC_ACQUIRE);
+}
+
+int heap_cache_stats(uint32_t index, heap_cache_stats_t *out) {
+  if (index >= heap_cache_count() || !out) {
+    return -1;
+  }
+  kmem_cache_t *cache = &heap_caches[index];
+  uint64_t flags = spin_lock_irqsave(&cache->lock);
+  out->name = cache->name;
+  out->object_size = cache->object_size;
+  out->objects_in_use = cache->in_use;
+  out->objects_total = cache->slabs * cache->per_slab;
+  out->slabs = cache->slabs;
+  out->hits = cache->hits;
+  out->misses = cache->misses;
+  spin_unlock_irqrestore(&cache->lock, flags);
+  return 0;
+}
+
+uint64_t heap_large_pages(void) {
+  return heap_large_page_count;
+}
@@ -0,0 +1,33 @@
+#ifndef KERNEL_ACPI_H
+#define KERNEL_ACPI_H
+
+#include "kernel/bootinfo.h"
+#include "kernel/types.h"
+
+#define ACPI_MAX_CPUS 64
+#define ACPI_ISA_IRQS 16
+
+/* ISA IRQ routing from MADT interrupt source overrides; identity and bus defaults otherwise. */
+typedef struct {
+  uint32_t gsi;
+  uint8_t active_low;
+  uint8_t level;
+} acpi_irq_route_t;
+
+/* What the kernel needs from the MADT to bring up the APICs. */
+typedef struct {
+  uint8_t present;
+  uint8_t legacy_pic;
+  uint64_t lapic_base;
+  uint32_t cpu_count;
+  uint8_t cpu_apic_ids[ACPI_MAX_CPUS];
+  uint64_t ioapic_base;
+  uint8_t ioapic_id;
+  uint32_t ioapic_gsi_base;
+  acpi_irq_route_t isa[ACPI_ISA_IRQS];
+} acpi_info_t;
+
+int acpi_init(const boot_info_t *boot);
+const acpi_info_t *acpi_info(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef KERNEL_APIC_H
+#define KERNEL_APIC_H
+
+#include "kernel/types.h"
+
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+typedef enum {
+  APIC_TIMER_NONE = 0,
+  APIC_TIMER_ONESHOT,
+  APIC_TIMER_TSC_DEADLINE
+} apic_timer_mode_t;
+
+int apic_init(void);
+void apic_init_ap(void);
+int apic_active(void);
+uint32_t apic_id(void);
+int apic_route_irq(uint8_t irq, uint8_t vector);
+int apic_timer_init(uint8_t vector, uint64_t tsc_hz);
+int apic_timer_init_ap(uint8_t vector);
+void apic_timer_arm(uint64_t tsc_deadline);
+apic_timer_mode_t apic_timer_mode(void);
+void apic_send_ipi(uint32_t apic_id, uint8_t vector);
+void apic_send_ipi_others(uint8_t vector);
+void apic_send_init(uint32_t apic_id);
+void apic_send_startup(uint32_t apic_id, uint8_t page);
+uint64_t apic_timer_hz(void);
+
+extern volatile uint32_t *apic_lapic;
+
+/* End of interrupt: one register write, no port I/O. */
+static inline void apic_eoi(void) {
+  apic_lapic[0xB0 / 4] = 0;
+}
+
+#endif
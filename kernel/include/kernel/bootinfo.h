@@ -0,0 +1,34 @@
+#ifndef KERNEL_BOOTINFO_H
+#define KERNEL_BOOTINFO_H
+
+#include "kernel/types.h"
+
+#define BOOT_MEMORY_MAX 32
+
+typedef enum {
+  BOOT_MEMORY_AVAILABLE = 1,
+  BOOT_MEMORY_RESERVED = 2,
+  BOOT_MEMORY_ACPI = 3,
+  BOOT_MEMORY_NVS = 4,
+  BOOT_MEMORY_BAD = 5
+} boot_memory_type_t;
+
+typedef struct {
+  uint64_t base;
+  uint64_t length;
+  uint32_t type;
+} boot_memory_region_t;
+
+/* Bootloader-independent view of what the kernel gets at boot. */
+typedef struct {
+  boot_memory_region_t memory[BOOT_MEMORY_MAX];
+  uint32_t memory_count;
+  uint64_t info_start;
+  uint64_t info_end;
+  /* Physical address of the ACPI RSDP copy handed over by the bootloader, 0 if none. */
+  uint64_t rsdp;
+} boot_info_t;
+
+int multiboot2_parse(uint32_t magic, uint64_t info_addr, boot_info_t *out);
+
+#endif
@@ -3,11 +3,24 @@
 
 #include "kernel/types.h"
 
+/* Control codes console_getchar returns for keys without a character. */
+#define KEY_PAGE_UP '\x10'
+#define KEY_PAGE_DOWN '\x11'
+#define CONSOLE_SINK_MAX 4
+
+/* An output device; receives every byte written to the console. */
+typedef void (*console_sink_fn)(const char *text, uint32_t length);
+
 void console_init(uint8_t color);
 void console_putc(char c);
 void console_write(const char *text);
 void console_write_line(const char *text);
 void console_prompt(void);
 void console_clear(void);
+void console_scroll(int lines);
+int console_add_sink(console_sink_fn sink);
+void console_input_push(char c);
+char console_getchar(void);
+uint64_t console_input_dropped(void);
 
 #endif
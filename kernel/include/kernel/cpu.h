@@ -0,0 +1,41 @@
+#ifndef KERNEL_CPU_H
+#define KERNEL_CPU_H
+
+#include "kernel/types.h"
+
+typedef struct {
+  uint32_t eax;
+  uint32_t ebx;
+  uint32_t ecx;
+  uint32_t edx;
+} cpuid_regs_t;
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, cpuid_regs_t *out) {
+  __asm__ volatile("cpuid"
+                   : "=a"(out->eax), "=b"(out->ebx), "=c"(out->ecx), "=d"(out->edx)
+                   : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc(void) {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (uint64_t)high << 32 | low;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return (uint64_t)high << 32 | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline void cpu_relax(void) {
+  __asm__ volatile("pause" : : : "memory");
+}
+
+#endif
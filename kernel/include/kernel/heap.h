@@ -0,0 +1,36 @@
+#ifndef KERNEL_HEAP_H
+#define KERNEL_HEAP_H
+
+#include "kernel/types.h"
+
+#define HEAP_CACHE_MAX 32
+#define HEAP_SLAB_OBJECT_MAX 1024
+
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct {
+  const char *name;
+  uint32_t object_size;
+  uint32_t objects_in_use;
+  uint32_t objects_total;
+  uint32_t slabs;
+  uint64_t hits;
+  uint64_t misses;
+} heap_cache_stats_t;
+
+void heap_init(void);
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t object_size);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *ptr);
+
+/* kfree() only accepts kmalloc() memory; cache objects go back through kmem_cache_free(). */
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+uint32_t heap_cache_count(void);
+int heap_cache_stats(uint32_t index, heap_cache_stats_t *out);
+uint64_t heap_large_pages(void);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef KERNEL_INIT_H
 #define KERNEL_INIT_H
 
-void kernel_init(void);
+#include "kernel/bootinfo.h"
+
+void kernel_init(const boot_info_t *boot);
 
 #endif
@@ -1,11 +1,86 @@
 #ifndef KERNEL_INTERRUPTS_H
 #define KERNEL_INTERRUPTS_H
 
+#include "kernel/cpu.h"
+#include "kernel/smp.h"
 #include "kernel/types.h"
 
+#define IRQ_VECTOR_BASE 0x20
+#define YIELD_VECTOR 0x81
+#define RFLAGS_IF 0x200
+
+/* Layout pushed by the stubs in arch/x86_64/interrupts.s, lowest address first. */
+typedef struct {
+  uint64_t r15;
+  uint64_t r14;
+  uint64_t r13;
+  uint64_t r12;
+  uint64_t r11;
+  uint64_t r10;
+  uint64_t r9;
+  uint64_t r8;
+  uint64_t rbp;
+  uint64_t rdi;
+  uint64_t rsi;
+  uint64_t rdx;
+  uint64_t rcx;
+  uint64_t rbx;
+  uint64_t rax;
+  uint64_t rip;
+  uint64_t cs;
+  uint64_t rflags;
+  uint64_t rsp;
+  uint64_t ss;
+} interrupt_frame_t;
+
 void interrupts_init(void);
+void interrupts_init_ap(void);
 void interrupts_enable(void);
 void interrupts_disable(void);
-void pic_send_eoi(uint8_t irq);
+void interrupts_eoi(uint8_t irq);
+void interrupts_irq_enter(void);
+void interrupts_irq_exit(uint64_t rsp);
+
+/*
+ * Bracket every stretch with interrupts off on this CPU, whether a handler
+ * or a section under interrupts_save(), to keep the worst case in
+ * cpu_t.irqoff_max. Only called once interrupts have been on, which is
+ * after smp_early_init() has set up the per-CPU area.
+ */
+static inline void interrupts_off_begin(void) {
+  cpu_t *cpu = cpu_self();
+  if (!cpu->irqoff_since) {
+    cpu->irqoff_since = rdtsc();
+  }
+}
+
+static inline void interrupts_off_end(void) {
+  cpu_t *cpu = cpu_self();
+  uint64_t since = cpu->irqoff_since;
+  if (since) {
+    uint64_t span = rdtsc() - since;
+    if (span > cpu->irqoff_max) {
+      cpu->irqoff_max = span;
+    }
+    cpu->irqoff_since = 0;
+  }
+}
+
+/* Disables interrupts and returns the previous RFLAGS for interrupts_restore(). */
+static inline uint64_t interrupts_save(void) {
+  uint64_t flags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+  if (flags & RFLAGS_IF) {
+    interrupts_off_begin();
+  }
+  return flags;
+}
+
+static inline void interrupts_restore(uint64_t flags) {
+  if (flags & RFLAGS_IF) {
+    interrupts_off_end();
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
 
 #endif
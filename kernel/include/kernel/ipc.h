@@ -1,6 +1,95 @@
 #ifndef KERNEL_IPC_H
 #define KERNEL_IPC_H
 
+#include "kernel/types.h"
+
+/* Exactly one sending thread, or any number of them; there is always a single receiver. */
+#define IPC_CHANNEL_SPSC 0
+#define IPC_CHANNEL_MPSC 1
+#define IPC_CHANNEL_MAX_SLOTS 4096
+/* ipc_grant_map() flags. */
+#define IPC_GRANT_WRITE 0x1
+
+/* A fixed-size message: a tag the receiver dispatches on and three words of payload. */
+typedef struct {
+  uint64_t tag;
+  uint64_t data[3];
+} ipc_msg_t;
+
+typedef struct ipc_channel ipc_channel_t;
+typedef struct ipc_endpoint ipc_endpoint_t;
+
+typedef struct {
+  uint8_t kind;
+  uint32_t slots;
+  uint32_t queued;
+  uint64_t sent;
+  uint64_t received;
+  uint64_t full;
+  uint64_t rx_waits;
+  uint64_t tx_waits;
+} ipc_channel_stats_t;
+
+typedef struct {
+  uint64_t calls;
+  uint64_t direct;
+  uint64_t queued;
+} ipc_endpoint_stats_t;
+
+typedef struct {
+  uint32_t messages;
+  uint32_t producers;
+  uint64_t cycles;
+  uint64_t rx_waits;
+  uint64_t tx_waits;
+} ipc_bench_stream_t;
+
+typedef struct {
+  uint32_t rounds;
+  uint64_t total_cycles;
+  uint64_t min_cycles;
+  uint64_t max_cycles;
+  uint64_t direct;
+} ipc_bench_rtt_t;
+
+typedef struct {
+  uint64_t bytes;
+  uint32_t rounds;
+  uint64_t cycles;
+} ipc_bench_grant_t;
+
 void ipc_init(void);
+ipc_channel_t *ipc_channel_create(uint8_t kind, uint32_t slots);
+void ipc_channel_destroy(ipc_channel_t *ch);
+uint32_t ipc_channel_count(void);
+int ipc_channel_stats(const ipc_channel_t *ch, ipc_channel_stats_t *out);
+const char *ipc_channel_kind_name(uint8_t kind);
+
+int ipc_send(ipc_channel_t *ch, const ipc_msg_t *msg);
+uint32_t ipc_send_batch(ipc_channel_t *ch, const ipc_msg_t *msgs, uint32_t count);
+uint32_t ipc_send_wait(ipc_channel_t *ch, const ipc_msg_t *msgs, uint32_t count);
+int ipc_recv(ipc_channel_t *ch, ipc_msg_t *out);
+uint32_t ipc_recv_batch(ipc_channel_t *ch, ipc_msg_t *out, uint32_t max);
+uint32_t ipc_recv_wait(ipc_channel_t *ch, ipc_msg_t *out, uint32_t max);
+
+ipc_endpoint_t *ipc_endpoint_create(void);
+void ipc_endpoint_destroy(ipc_endpoint_t *ep);
+int ipc_endpoint_stats(const ipc_endpoint_t *ep, ipc_endpoint_stats_t *out);
+int ipc_call(ipc_endpoint_t *ep, ipc_msg_t *msg);
+int ipc_receive(ipc_endpoint_t *ep, ipc_msg_t *msg);
+int ipc_reply(ipc_endpoint_t *ep, const ipc_msg_t *msg);
+int ipc_reply_wait(ipc_endpoint_t *ep, ipc_msg_t *msg);
+
+int ipc_grant_create(uint32_t pages);
+uint64_t ipc_grant_size(int id);
+void *ipc_grant_map(int id, uint32_t flags);
+int ipc_grant_unmap(int id, void *addr);
+int ipc_grant_release(int id);
+int ipc_grant_revoke(int id);
+
+int ipc_bench_stream(uint8_t kind, uint32_t producers, uint32_t messages, ipc_bench_stream_t *out);
+int ipc_bench_rtt(uint32_t rounds, ipc_bench_rtt_t *out);
+int ipc_bench_call(uint32_t rounds, ipc_bench_rtt_t *out);
+int ipc_bench_grant(uint32_t pages, uint32_t rounds, ipc_bench_grant_t *out);
 
 #endif
@@ -2,6 +2,5 @@
 #define KERNEL_KEYBOARD_H
 
 void keyboard_init(void);
-char keyboard_getchar(void);
 
 #endif
@@ -0,0 +1,72 @@
+#ifndef KERNEL_LOCK_H
+#define KERNEL_LOCK_H
+
+#include "kernel/cpu.h"
+#include "kernel/types.h"
+
+#define LOCK_KIND_SPIN 0
+#define LOCK_KIND_RW 1
+
+/*
+ * Counters every lock carries. They are updated by the holder after it has
+ * the lock, so they need no atomics of their own (shared readers of an
+ * rwlock are the exception). A named lock joins the registry the first time
+ * it is taken and stays there, so named locks must never be freed;
+ * anonymous ones keep their counters but are not listed.
+ */
+typedef struct lock_stats {
+  const char *name;
+  uint64_t acquired;
+  uint64_t contended;
+  uint64_t max_hold;
+  struct lock_stats *next;
+  uint8_t kind;
+  volatile uint8_t registered;
+} lock_stats_t;
+
+#define LOCK_STATS_INIT(name, kind) {(name), 0, 0, 0, 0, (kind), 0}
+
+typedef struct {
+  const char *name;
+  uint8_t kind;
+  uint64_t acquired;
+  uint64_t contended;
+  uint64_t max_hold_cycles;
+} lock_info_t;
+
+void lock_register(lock_stats_t *stats);
+uint32_t lock_count(void);
+uint32_t lock_top(lock_info_t *out, uint32_t max);
+void lock_stats_reset(void);
+const char *lock_kind_name(uint8_t kind);
+
+static inline void lock_stats_init(lock_stats_t *stats, const char *name, uint8_t kind) {
+  stats->name = name;
+  stats->acquired = 0;
+  stats->contended = 0;
+  stats->max_hold = 0;
+  stats->next = 0;
+  stats->kind = kind;
+  stats->registered = 0;
+}
+
+/* Called by the new holder; returns the TSC the hold time is measured from. */
+static inline uint64_t lock_acquired(lock_stats_t *stats, int contended) {
+  if (!stats->registered && stats->name) {
+    lock_register(stats);
+  }
+  stats->acquired++;
+  if (contended) {
+    stats->contended++;
+  }
+  return rdtsc();
+}
+
+static inline void lock_released(lock_stats_t *stats, uint64_t held_since) {
+  uint64_t held = rdtsc() - held_since;
+  if (held > stats->max_hold) {
+    stats->max_hold = held;
+  }
+}
+
+#endif
@@ -1,6 +1,122 @@
 #ifndef KERNEL_MM_H
 #define KERNEL_MM_H
 
-void mm_init(void);
+#include "kernel/bootinfo.h"
+#include "kernel/types.h"
+
+#define MM_PAGE_SIZE 4096
+#define MM_PAGE_SHIFT 12
+#define MM_MAX_ORDER 10
+
+/* The kernel image is linked here (see linker.ld); RAM and firmware memory are mapped at MM_DIRECT_BASE. */
+#define MM_KERNEL_BASE 0xFFFFFFFF80000000ull
+#define MM_DIRECT_BASE 0xFFFF800000000000ull
+/* Addresses from here up belong to the kernel half shared by every address space. */
+#define MM_KERNEL_HALF 0xFFFF800000000000ull
+
+/* mm_map() and mm_space_map() flags; without any of them a mapping is read-only, kernel-only and not executable. */
+#define MM_MAP_WRITE 0x1
+#define MM_MAP_EXEC 0x2
+#define MM_MAP_USER 0x4
+#define MM_MAP_UNCACHED 0x8
+
+/* Invalidations a batch keeps one by one; past either limit it flushes the whole TLB instead. */
+#define MM_TLB_BATCH_RANGES 16
+#define MM_TLB_FLUSH_CEILING 33
+
+/*
+ * A set of page tables; the kernel half of every space is the kernel's
+ * own. pcid tags its TLB entries when the CPU has PCIDs. active has a bit
+ * for each CPU running on the space, stale one for each CPU that may
+ * still cache entries changed since it last ran there.
+ */
+typedef struct {
+  uint64_t pml4;
+  uint16_t pcid;
+  uint32_t active;
+  uint32_t stale;
+} mm_space_t;
+
+/*
+ * TLB invalidations collected by deferred unmaps and protection changes,
+ * applied on every CPU that needs them by one mm_tlb_batch_flush().
+ * Adjacent pages of the same size are merged into one range.
+ */
+typedef struct {
+  mm_space_t *space;
+  uint32_t count;
+  uint32_t pages;
+  uint8_t full;
+  uint8_t user;
+  uint8_t global;
+  struct mm_tlb_range {
+    uint64_t start;
+    uint64_t end;
+    uint8_t shift;
+  } ranges[MM_TLB_BATCH_RANGES];
+} mm_tlb_batch_t;
+
+typedef struct {
+  uint64_t direct_bytes;
+  uint64_t direct_page;
+  uint32_t kernel_pages;
+  uint8_t nx;
+  uint8_t gbpages;
+  uint8_t global;
+  uint8_t pcid;
+  uint8_t invpcid;
+} mm_vm_info_t;
+
+/* Totals over all CPUs since boot. */
+typedef struct {
+  uint64_t flushes;
+  uint64_t full;
+  uint64_t pages;
+  uint64_t shootdowns;
+  uint64_t ipis;
+  uint64_t switches;
+  uint64_t kept;
+} mm_tlb_stats_t;
+
+static inline void *mm_phys_to_virt(uint64_t phys) {
+  return (void *)(phys + MM_DIRECT_BASE);
+}
+
+/* Works for direct-map addresses and for addresses inside the kernel image. */
+static inline uint64_t mm_virt_to_phys(const void *virt) {
+  uint64_t addr = (uint64_t)virt;
+  return addr >= MM_KERNEL_BASE ? addr - MM_KERNEL_BASE : addr - MM_DIRECT_BASE;
+}
+
+void mm_init(const boot_info_t *boot);
+uint64_t mm_alloc_pages(uint8_t order);
+int mm_free_pages(uint64_t phys, uint8_t order);
+uint64_t mm_alloc_page(void);
+int mm_free_page(uint64_t phys);
+
+uint64_t mm_total_frames(void);
+uint64_t mm_free_frames(void);
+uint32_t mm_order_free_blocks(uint8_t order);
+uint32_t mm_order_used_blocks(uint8_t order);
+
+void mm_vm_init(const boot_info_t *boot);
+void mm_vm_init_ap(void);
+void mm_vm_info(mm_vm_info_t *out);
+mm_space_t *mm_kernel_space(void);
+int mm_space_init(mm_space_t *space);
+void mm_space_destroy(mm_space_t *space);
+void mm_space_switch(mm_space_t *space);
+int mm_space_map(mm_space_t *space, uint64_t virt, uint64_t phys, uint64_t size, uint32_t flags);
+int mm_space_unmap(mm_space_t *space, uint64_t virt, uint64_t size);
+int mm_space_protect(mm_space_t *space, uint64_t virt, uint64_t size, uint32_t flags);
+
+void mm_tlb_batch_init(mm_tlb_batch_t *batch, mm_space_t *space);
+int mm_space_unmap_deferred(mm_tlb_batch_t *batch, uint64_t virt, uint64_t size);
+void mm_tlb_batch_flush(mm_tlb_batch_t *batch);
+void mm_tlb_stats(mm_tlb_stats_t *out);
+
+void *mm_map_mmio(uint64_t phys, uint64_t size);
+int mm_map(uint64_t virt, uint64_t phys, uint64_t size, uint32_t flags);
+void mm_unmap(uint64_t virt, uint64_t size);
 
 #endif
@@ -0,0 +1,98 @@
+#ifndef KERNEL_RWLOCK_H
+#define KERNEL_RWLOCK_H
+
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/lock.h"
+#include "kernel/types.h"
+
+#define RWLOCK_WRITER 0x80000000u
+#define RWLOCK_WAITING 0x40000000u
+
+/*
+ * Reader-writer spinlock. The low bits of state count readers; RWLOCK_WRITER
+ * is set while a writer holds the lock and RWLOCK_WAITING while one waits
+ * for it, which keeps new readers out so a writer cannot be starved.
+ * Readers overlap, so the maximum hold time covers the write side only.
+ * Not recursive: a reader taking it again behind a waiting writer deadlocks.
+ */
+typedef struct {
+  volatile uint32_t state;
+  uint64_t held_since;
+  lock_stats_t stats;
+} rwlock_t;
+
+#define RWLOCK_INIT(name) {0, 0, LOCK_STATS_INIT(name, LOCK_KIND_RW)}
+
+static inline void read_lock(rwlock_t *lock) {
+  int contended = 0;
+  for (;;) {
+    uint32_t state = lock->state;
+    if (!(state & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+        __atomic_compare_exchange_n(&lock->state, &state, state + 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+    contended = 1;
+    cpu_relax();
+  }
+  if (!lock->stats.registered && lock->stats.name) {
+    lock_register(&lock->stats);
+  }
+  __atomic_fetch_add(&lock->stats.acquired, 1, __ATOMIC_RELAXED);
+  if (contended) {
+    __atomic_fetch_add(&lock->stats.contended, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static inline void read_unlock(rwlock_t *lock) {
+  __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock_t *lock) {
+  int contended = 0;
+  for (;;) {
+    uint32_t state = lock->state;
+    if (!(state & ~RWLOCK_WAITING) &&
+        __atomic_compare_exchange_n(&lock->state, &state, RWLOCK_WRITER, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+    contended = 1;
+    if (!(state & RWLOCK_WAITING)) {
+      __atomic_fetch_or(&lock->state, RWLOCK_WAITING, __ATOMIC_RELAXED);
+    }
+    cpu_relax();
+  }
+  lock->held_since = lock_acquired(&lock->stats, contended);
+}
+
+/* Leaves RWLOCK_WAITING alone: another writer may have set it meanwhile. */
+static inline void write_unlock(rwlock_t *lock) {
+  lock_released(&lock->stats, lock->held_since);
+  __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t read_lock_irqsave(rwlock_t *lock) {
+  uint64_t flags = interrupts_save();
+  read_lock(lock);
+  return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *lock, uint64_t flags) {
+  read_unlock(lock);
+  interrupts_restore(flags);
+}
+
+static inline uint64_t write_lock_irqsave(rwlock_t *lock) {
+  uint64_t flags = interrupts_save();
+  write_lock(lock);
+  return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *lock, uint64_t flags) {
+  write_unlock(lock);
+  interrupts_restore(flags);
+}
+
+#endif
@@ -3,12 +3,67 @@
 
 #include "kernel/types.h"
 
-typedef void (*task_fn_t)(void);
+#define SCHED_PRIORITIES 32
+/* Kernel service threads (the timer thread) run above everything else. */
+#define SCHED_PRIORITY_KERNEL 2
+#define SCHED_PRIORITY_HIGH 8
+#define SCHED_PRIORITY_DEFAULT 16
+#define SCHED_PRIORITY_LOW 24
+/* Reserved for the idle thread; ordinary tasks never decay this far. */
+#define SCHED_PRIORITY_IDLE (SCHED_PRIORITIES - 1)
+
+typedef void (*task_fn_t)(void *arg);
+typedef struct task task_t;
+
+typedef struct {
+  uint32_t id;
+  const char *name;
+  uint8_t state;
+  uint8_t priority;
+  uint8_t base_priority;
+  uint32_t cpu;
+  uint64_t ticks;
+} scheduler_task_info_t;
+
+typedef struct {
+  uint32_t current_id;
+  const char *current_name;
+  uint32_t ready;
+  uint64_t switches;
+  uint64_t steals;
+  uint64_t handoffs;
+  uint64_t idle_ticks;
+} scheduler_cpu_info_t;
 
 void scheduler_init(void);
-int scheduler_add_task(task_fn_t task);
-void scheduler_tick(void);
-uint8_t scheduler_count(void);
-uint8_t scheduler_current(void);
+int scheduler_prepare_cpu(uint32_t cpu);
+void scheduler_start_cpu(void) __attribute__((noreturn));
+int scheduler_cpu_online(uint32_t cpu);
+int scheduler_spawn(const char *name, task_fn_t task, void *arg, uint8_t priority);
+int scheduler_spawn_on(const char *name, task_fn_t task, void *arg, uint8_t priority,
+                       uint32_t cpu);
+int scheduler_spawn_system(const char *name, task_fn_t task, void *arg, uint32_t cpu);
+int scheduler_add_task(const char *name, task_fn_t task, void *arg);
+int scheduler_kill(uint32_t id);
+void scheduler_exit(void) __attribute__((noreturn));
+void scheduler_reap(void);
+uint64_t scheduler_tick(uint64_t rsp);
+uint64_t scheduler_preempt(uint64_t rsp);
+void scheduler_finish_switch(void);
+void scheduler_yield(void);
+task_t *scheduler_self(void);
+void scheduler_block(void);
+void scheduler_wake(task_t *task);
+void scheduler_handoff(task_t *to);
+void scheduler_sleep(uint64_t ticks);
+uint32_t scheduler_count(void);
+uint32_t scheduler_current(void);
+uint64_t scheduler_switches(void);
+uint64_t scheduler_idle_ticks(void);
+uint8_t scheduler_idle_percent(void);
+uint32_t scheduler_idle_wakeups(void);
+int scheduler_task_info(uint32_t index, scheduler_task_info_t *out);
+int scheduler_cpu_info(uint32_t cpu, scheduler_cpu_info_t *out);
+const char *scheduler_state_name(uint8_t state);
 
 #endif
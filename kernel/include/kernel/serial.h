@@ -0,0 +1,17 @@
+#ifndef KERNEL_SERIAL_H
+#define KERNEL_SERIAL_H
+
+#include "kernel/types.h"
+
+typedef struct {
+  uint8_t present;
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t dropped;
+} serial_stats_t;
+
+int serial_init(void);
+void serial_write(const char *text, uint32_t length);
+void serial_stats(serial_stats_t *out);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+#include "kernel/types.h"
+
+#define SMP_MAX_CPUS 16
+#define RESCHEDULE_VECTOR 0xF0
+#define TLB_FLUSH_VECTOR 0xF1
+
+typedef struct {
+  uint32_t reserved0;
+  uint64_t rsp[3];
+  uint64_t reserved1;
+  uint64_t ist[7];
+  uint64_t reserved2;
+  uint16_t reserved3;
+  uint16_t iomap_base;
+} __attribute__((packed)) tss_t;
+
+/*
+ * Per-CPU area, reached through the GS base: self must stay the first
+ * field so cpu_self() is a single gs-relative load. Index 0 is the
+ * bootstrap processor; the others are numbered in MADT order. irqoff_since
+ * is the TSC at which interrupts were last turned off (0 while they are
+ * on) and irqoff_max the longest such stretch so far, in cycles.
+ */
+typedef struct cpu {
+  struct cpu *self;
+  uint32_t index;
+  uint32_t apic_id;
+  volatile uint8_t online;
+  uint64_t stack;
+  uint64_t irqoff_since;
+  uint64_t irqoff_max;
+  uint64_t gdt[5];
+  tss_t tss;
+} __attribute__((aligned(64))) cpu_t;
+
+void smp_early_init(void);
+void smp_init(void);
+uint32_t smp_cpu_count(void);
+cpu_t *smp_cpu(uint32_t index);
+void smp_send_reschedule(uint32_t index);
+uint32_t smp_tlb_shootdown(uint32_t mask, void (*flush)(void *), void *arg);
+uint64_t smp_tlb_flush_handler(uint64_t rsp);
+
+static inline cpu_t *cpu_self(void) {
+  cpu_t *cpu;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+/* Only stable while the caller cannot migrate, i.e. with interrupts off. */
+static inline uint32_t smp_cpu_index(void) {
+  return cpu_self()->index;
+}
+
+#endif
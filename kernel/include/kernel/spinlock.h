@@ -0,0 +1,60 @@
+#ifndef KERNEL_SPINLOCK_H
+#define KERNEL_SPINLOCK_H
+
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/lock.h"
+#include "kernel/types.h"
+
+/*
+ * Ticket lock: each CPU takes the next ticket and spins until owner reaches
+ * it, so waiters get the lock in arrival order and none can be starved.
+ * Waiters only read owner, which stays shared in their caches until the
+ * holder bumps it. Every lock that an interrupt handler can take must be
+ * held with interrupts off, which is what the _irqsave variants are for;
+ * holding one with interrupts on also lets the holder be preempted while
+ * others spin.
+ */
+typedef struct {
+  volatile uint16_t owner;
+  volatile uint16_t next;
+  uint64_t held_since;
+  lock_stats_t stats;
+} spinlock_t;
+
+#define SPINLOCK_INIT(name) {0, 0, 0, LOCK_STATS_INIT(name, LOCK_KIND_SPIN)}
+
+static inline void spin_lock_init(spinlock_t *lock, const char *name) {
+  lock->owner = 0;
+  lock->next = 0;
+  lock->held_since = 0;
+  lock_stats_init(&lock->stats, name, LOCK_KIND_SPIN);
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+  uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+  int contended = 0;
+  while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+    contended = 1;
+    cpu_relax();
+  }
+  lock->held_since = lock_acquired(&lock->stats, contended);
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+  lock_released(&lock->stats, lock->held_since);
+  __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+  uint64_t flags = interrupts_save();
+  spin_lock(lock);
+  return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+  spin_unlock(lock);
+  interrupts_restore(flags);
+}
+
+#endif
@@ -4,6 +4,17 @@
 #include "kernel/types.h"
 
 void timer_init(uint32_t frequency);
+void timer_init_ap(void);
 uint64_t timer_ticks(void);
+uint64_t timer_cycles(void);
+uint64_t timer_ns(void);
+uint64_t timer_cycles_to_ns(uint64_t cycles);
+uint64_t timer_tsc_hz(void);
+int timer_tsc_invariant(void);
+int timer_drift_ppm(int64_t *ppm);
+const char *timer_source(void);
+int timer_idle_enter(uint64_t next_tick);
+void timer_idle_exit(void);
+int timer_nohz(void);
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef KERNEL_TIMER_WHEEL_H
+#define KERNEL_TIMER_WHEEL_H
+
+#include "kernel/types.h"
+
+typedef void (*timer_fn_t)(void *arg);
+/* Handle of an armed timer; 0 is never a valid handle. */
+typedef uint32_t timer_id_t;
+
+typedef struct {
+  uint32_t pending;
+  uint32_t capacity;
+  uint64_t fired;
+  uint64_t cascaded;
+  uint64_t next_expiry;
+} timer_wheel_stats_t;
+
+void timer_wheel_init(void);
+timer_id_t timer_add(uint64_t deadline, timer_fn_t callback, void *arg);
+timer_id_t timer_add_periodic(uint64_t deadline, uint64_t period, timer_fn_t callback, void *arg);
+int timer_cancel(timer_id_t id);
+uint64_t timer_wheel_next(void);
+void timer_wheel_poll(uint64_t now);
+void timer_wheel_stats(timer_wheel_stats_t *out);
+
+#endif
@@ -3,15 +3,42 @@
 
 #include "kernel/types.h"
 
+#define VFS_O_READ 0x01
+#define VFS_O_WRITE 0x02
+#define VFS_O_CREATE 0x04
+#define VFS_O_TRUNC 0x08
+#define VFS_O_APPEND 0x10
+
+#define VFS_SEEK_SET 0
+#define VFS_SEEK_CUR 1
+#define VFS_SEEK_END 2
+
+/* Readdir position; removing the entry the cursor points at ends the walk early. */
+typedef struct {
+  int dir;
+  int next;
+} vfs_dir_cursor_t;
+
+typedef struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t negative_hits;
+  uint64_t misses;
+  uint64_t uncached;
+  uint64_t invalidations;
+} vfs_dcache_stats_t;
+
 void vfs_init(void);
 void vfs_sanitize(void);
 int vfs_write(const char *name, const char *data);
-const char *vfs_read(const char *name);
+int vfs_read(const char *name, uint32_t offset, char *buf, uint32_t size);
 int vfs_remove(const char *name);
 int vfs_size(const char *name);
-uint8_t vfs_count(void);
-const char *vfs_name_at(uint8_t index);
-uint8_t vfs_capacity(void);
+uint32_t vfs_count(void);
+uint32_t vfs_file_count(void);
+uint32_t vfs_dir_count(void);
+const char *vfs_name_at(uint32_t index);
+uint32_t vfs_capacity(void);
 
 int vfs_root(void);
 int vfs_is_dir(int index);
@@ -20,12 +47,22 @@ int vfs_parent(int index);
 int vfs_node_size(int index);
 int vfs_resolve(const char *path, int start_dir);
 int vfs_resolve_parent(const char *path, int start_dir, char *out_name, uint16_t out_size);
+void vfs_dcache_stats(vfs_dcache_stats_t *out);
 int vfs_mkdir_at(int parent, const char *name);
 int vfs_rmdir_at(int parent, const char *name);
 int vfs_write_at(int parent, const char *name, const char *data);
-const char *vfs_read_at(int parent, const char *name);
+int vfs_read_at(int parent, const char *name, uint32_t offset, char *buf, uint32_t size);
 int vfs_remove_at(int parent, const char *name);
-uint8_t vfs_list_count(int parent);
-int vfs_list_at(int parent, uint8_t index);
+int vfs_open(const char *path, int start_dir, uint32_t flags);
+int vfs_close(int fd);
+int vfs_fread(int fd, void *buf, uint32_t size);
+int vfs_fwrite(int fd, const void *buf, uint32_t size);
+int vfs_pread(int fd, void *buf, uint32_t size, uint32_t offset);
+int vfs_pwrite(int fd, const void *buf, uint32_t size, uint32_t offset);
+int64_t vfs_seek(int fd, int64_t offset, int whence);
+uint32_t vfs_list_count(int parent);
+int vfs_list_at(int parent, uint32_t index);
+int vfs_opendir(int dir, vfs_dir_cursor_t *cursor);
+int vfs_readdir(vfs_dir_cursor_t *cursor);
 
 #endif
@@ -3,9 +3,20 @@
 
 #include "kernel/types.h"
 
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+/* Rows of text memory behind 0xB8000 (32 KiB); the visible window can start at any of them. */
+#define VGA_VRAM_ROWS 204
+
+static inline uint16_t vga_cell(char c, uint8_t color) {
+  return (uint16_t)((uint16_t)color << 8 | (uint8_t)c);
+}
+
 void vga_clear(uint8_t color);
 void vga_write_at(const char *text, uint8_t color, uint8_t row, uint8_t col);
 void vga_putc_at(char c, uint8_t color, uint8_t row, uint8_t col);
-char vga_read_at(uint8_t row, uint8_t col);
+void vga_write_cells(uint16_t offset, const uint16_t *cells, uint16_t count);
+void vga_set_origin(uint16_t offset);
+void vga_set_cursor(uint16_t offset);
 
 #endif
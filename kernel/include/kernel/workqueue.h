@@ -0,0 +1,35 @@
+#ifndef KERNEL_WORKQUEUE_H
+#define KERNEL_WORKQUEUE_H
+
+#include "kernel/types.h"
+
+typedef void (*work_fn_t)(void *arg);
+
+/*
+ * A deferred call, usually embedded in its owner; it must stay valid while
+ * pending. pending is cleared just before fn runs, so fn may queue its own
+ * item again.
+ */
+typedef struct work {
+  struct work *next;
+  work_fn_t fn;
+  void *arg;
+  uint64_t queued_at;
+  volatile uint8_t pending;
+} work_t;
+
+#define WORK_INIT(fn, arg) {0, (fn), (arg), 0, 0}
+
+typedef struct {
+  uint64_t queued;
+  uint64_t executed;
+  uint64_t max_delay_cycles;
+} workqueue_stats_t;
+
+void workqueue_init(void);
+void work_init(work_t *work, work_fn_t fn, void *arg);
+int work_queue(work_t *work);
+int work_queue_on(uint32_t cpu, work_t *work);
+int workqueue_stats(uint32_t cpu, workqueue_stats_t *out);
+
+#endif
@@ -1,19 +1,31 @@
 #include "kernel/init.h"
+#include "kernel/acpi.h"
+#include "kernel/heap.h"
 #include "kernel/interrupts.h"
 #include "kernel/ipc.h"
 #include "kernel/mm.h"
 #include "kernel/process.h"
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
 #include "kernel/timer.h"
+#include "kernel/timer_wheel.h"
 #include "kernel/vfs.h"
+#include "kernel/workqueue.h"
 
-void kernel_init(void) {
-  mm_init();
+void kernel_init(const boot_info_t *boot) {
+  smp_early_init();
+  mm_init(boot);
+  mm_vm_init(boot);
+  heap_init();
+  acpi_init(boot);
   scheduler_init();
+  timer_wheel_init();
   process_init();
   ipc_init();
   vfs_init();
   interrupts_init();
   timer_init(100);
-  // interrupts_enable();
+  interrupts_enable();
+  smp_init();
+  workqueue_init();
 }
@@ -1,5 +1,7 @@
 #include "kernel/interrupts.h"
+#include "kernel/apic.h"
 #include "kernel/io.h"
+#include "kernel/smp.h"
 
 #define PIC1_COMMAND 0x20
 #define PIC1_DATA 0x21
@@ -25,8 +27,15 @@ struct idt_ptr {
 } __attribute__((packed));
 
 static struct idt_entry idt[256];
+static struct idt_ptr idt_desc;
 
 extern void irq0_stub(void);
+extern void irq1_stub(void);
+extern void irq4_stub(void);
+extern void yield_stub(void);
+extern void reschedule_stub(void);
+extern void tlb_flush_stub(void);
+extern void spurious_stub(void);
 extern void isr_stub(void);
 
 static void idt_set_gate(uint8_t vector, void (*handler)(void)) {
@@ -61,7 +70,12 @@ static void pic_remap(void) {
   outb(PIC2_DATA, a2);
 }
 
-void pic_send_eoi(uint8_t irq) {
+/* Acknowledges an interrupt: one LAPIC register write when the APIC is up, PIC port I/O otherwise. */
+void interrupts_eoi(uint8_t irq) {
+  if (apic_active()) {
+    apic_eoi();
+    return;
+  }
   if (irq >= 8) {
     outb(PIC2_COMMAND, PIC_EOI);
   }
@@ -81,22 +95,57 @@ void interrupts_init(void) {
   for (uint8_t vec = 0; vec < 32; ++vec) {
     idt_set_gate(vec, isr_stub);
   }
-  idt_set_gate(0x20, irq0_stub);
-
-  struct idt_ptr desc;
-  desc.limit = (uint16_t)(sizeof(idt) - 1);
-  desc.base = (uint64_t)idt;
-  idt_load(&desc);
-
+  idt_set_gate(IRQ_VECTOR_BASE, irq0_stub);
+  idt_set_gate(IRQ_VECTOR_BASE + 1, irq1_stub);
+  idt_set_gate(IRQ_VECTOR_BASE + 4, irq4_stub);
+  idt_set_gate(IRQ_VECTOR_BASE + 7, spurious_stub);
+  idt_set_gate(YIELD_VECTOR, yield_stub);
+  idt_set_gate(RESCHEDULE_VECTOR, reschedule_stub);
+  idt_set_gate(TLB_FLUSH_VECTOR, tlb_flush_stub);
+  idt_set_gate(APIC_SPURIOUS_VECTOR, spurious_stub);
+
+  idt_desc.limit = (uint16_t)(sizeof(idt) - 1);
+  idt_desc.base = (uint64_t)idt;
+  idt_load(&idt_desc);
+
+  /* Remapped even when unused, so a stray 8259 interrupt cannot hit an exception vector. */
   pic_remap();
-  outb(PIC1_DATA, 0xFE);
+  if (apic_init() == 0) {
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    apic_route_irq(1, IRQ_VECTOR_BASE + 1);
+    apic_route_irq(4, IRQ_VECTOR_BASE + 4);
+    return;
+  }
+  /* IRQ0 (PIT), IRQ1 (keyboard) and IRQ4 (COM1). */
+  outb(PIC1_DATA, 0xEC);
   outb(PIC2_DATA, 0xFF);
 }
 
+/* Application processors share the bootstrap processor's IDT. */
+void interrupts_init_ap(void) {
+  idt_load(&idt_desc);
+}
+
 void interrupts_enable(void) {
-  __asm__ volatile("sti");
+  interrupts_off_end();
+  __asm__ volatile("sti" : : : "memory");
 }
 
 void interrupts_disable(void) {
-  __asm__ volatile("cli");
+  __asm__ volatile("cli" : : : "memory");
+  interrupts_off_begin();
+}
+
+/* Called by the stubs before the handler: the CPU turned interrupts off on entry. */
+void interrupts_irq_enter(void) {
+  interrupts_off_begin();
+}
+
+/* Called by the stubs on the frame about to be resumed: iretq turns interrupts back on if it had them on. */
+void interrupts_irq_exit(uint64_t rsp) {
+  const interrupt_frame_t *frame = (const interrupt_frame_t *)rsp;
+  if (frame->rflags & RFLAGS_IF) {
+    interrupts_off_end();
+  }
 }
@@ -1,4 +1,1129 @@
 #include "kernel/ipc.h"
+#include "kernel/cpu.h"
+#include "kernel/heap.h"
+#include "kernel/interrupts.h"
+#include "kernel/mm.h"
+#include "kernel/scheduler.h"
+#include "kernel/spinlock.h"
+
+/* Grants are mapped into this window of the kernel half, well above the direct map. */
+#define IPC_GRANT_WINDOW_BASE 0xFFFFC00000000000ull
+#define IPC_GRANT_WINDOW_PAGES 65536
+#define IPC_GRANT_MAX 64
+#define IPC_GRANT_MAPS 8
+#define IPC_GRANT_INDEX_BITS 8
+
+#define IPC_BENCH_BATCH 16
+#define IPC_BENCH_SLOTS 256
+#define IPC_BENCH_MAX_PRODUCERS 4
+#define IPC_BENCH_STOP 0xFFFFFFFFFFFFFFFFull
+
+/*
+ * In an MPSC channel a producer first claims a run of slots by moving tail
+ * forward and then fills them in, so the consumer cannot tell a claimed slot
+ * from a written one by the indices alone: seq is set to position + 1 once
+ * the message is in place. An SPSC channel publishes whole batches with one
+ * store to tail and leaves seq alone.
+ */
+typedef struct {
+  uint64_t seq;
+  ipc_msg_t msg;
+} ipc_slot_t;
+
+/* Lives on the waiting thread's stack between ipc_wait_prepare() and ipc_wait_finish(). */
+typedef struct ipc_waiter {
+  struct ipc_waiter *next;
+  task_t *task;
+} ipc_waiter_t;
+
+typedef struct {
+  spinlock_t lock;
+  ipc_waiter_t *head;
+} __attribute__((aligned(64))) ipc_waitq_t;
+
+/*
+ * head and tail are free-running positions, slot = position & mask. Each
+ * side's indices and counters sit on their own cache line, so the producer
+ * and the consumer only touch each other's line to refresh their cached
+ * view of the other index, which for SPSC happens once per ring's worth of
+ * messages rather than once per message.
+ */
+struct ipc_channel {
+  uint32_t mask;
+  uint8_t kind;
+  uint8_t order;
+  struct {
+    uint64_t tail;
+    uint64_t head_cache;
+    uint64_t full;
+    uint64_t waits;
+  } __attribute__((aligned(64))) tx;
+  struct {
+    uint64_t head;
+    uint64_t tail_cache;
+    uint64_t waits;
+  } __attribute__((aligned(64))) rx;
+  ipc_waitq_t rx_wait;
+  ipc_waitq_t tx_wait;
+  ipc_slot_t slots[];
+};
+
+/*
+ * Synchronous endpoints. A caller's request and reply buffer lives in an
+ * ipc_call_t on its own stack; done is set once the reply is in place.
+ */
+typedef struct ipc_call {
+  struct ipc_call *next;
+  task_t *task;
+  ipc_msg_t *msg;
+  volatile uint8_t done;
+} ipc_call_t;
+
+/*
+ * One server per endpoint. While it waits for a request, server and
+ * server_buf say where to put the next one; callers that find no server
+ * waiting queue up in callers. current is the call being served.
+ */
+struct ipc_endpoint {
+  spinlock_t lock;
+  task_t *server;
+  ipc_msg_t *server_buf;
+  ipc_call_t *callers;
+  ipc_call_t *callers_tail;
+  ipc_call_t *current;
+  uint64_t calls;
+  uint64_t direct;
+  uint64_t queued;
+};
+
+/*
+ * A grant is one buddy block of frames shared by reference: its creator
+ * holds one reference until it releases or revokes the grant, and every
+ * mapping holds another. The frames go back to the allocator when the last
+ * reference is dropped. Ids carry a generation, so a stale id no longer
+ * matches once its slot is reused.
+ */
+typedef struct {
+  uint64_t phys;
+  uint32_t pages;
+  uint32_t refs;
+  uint16_t generation;
+  uint8_t order;
+  uint8_t used;
+  uint8_t owned;
+  uint8_t revoked;
+  uint64_t maps[IPC_GRANT_MAPS];
+} ipc_grant_t;
+
+static uint32_t channel_count = 0;
+/* Guards the grant table and the window bitmap; taken before the page table lock. */
+static spinlock_t grant_lock = SPINLOCK_INIT("ipc-grant");
+static ipc_grant_t grants[IPC_GRANT_MAX];
+static uint64_t grant_window[IPC_GRANT_WINDOW_PAGES / 64];
 
 void ipc_init(void) {
+  channel_count = 0;
+  for (uint32_t i = 0; i < IPC_GRANT_MAX; ++i) {
+    grants[i].used = 0;
+    grants[i].generation = 0;
+  }
+  for (uint32_t i = 0; i < IPC_GRANT_WINDOW_PAGES / 64; ++i) {
+    grant_window[i] = 0;
+  }
+}
+
+/*
+ * Waiting: the thread queues itself, then re-checks its condition before
+ * blocking. The fence pairs with the one in ipc_wake_all(), so either the
+ * waiter sees the new message (or free slot), or the waker sees the waiter.
+ * Wakers hold the queue lock while waking, so a woken thread cannot leave
+ * ipc_wait_finish() and drop its waiter while the waker still uses it.
+ */
+static void ipc_wait_prepare(ipc_waitq_t *wq, ipc_waiter_t *waiter) {
+  waiter->task = scheduler_self();
+  spin_lock(&wq->lock);
+  waiter->next = wq->head;
+  wq->head = waiter;
+  spin_unlock(&wq->lock);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void ipc_wait_finish(ipc_waitq_t *wq, ipc_waiter_t *waiter) {
+  spin_lock(&wq->lock);
+  if (waiter->task) {
+    ipc_waiter_t **link = &wq->head;
+    while (*link && *link != waiter) {
+      link = &(*link)->next;
+    }
+    if (*link) {
+      *link = waiter->next;
+    }
+  }
+  spin_unlock(&wq->lock);
+}
+
+static void ipc_wake_all(ipc_waitq_t *wq) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&wq->head, __ATOMIC_RELAXED)) {
+    return;
+  }
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+  ipc_waiter_t *waiter = wq->head;
+  wq->head = 0;
+  while (waiter) {
+    /* The waiter lives on its task's stack; a killed task is freed by the wake, so touch it first. */
+    ipc_waiter_t *next = waiter->next;
+    task_t *task = waiter->task;
+    waiter->task = 0;
+    scheduler_wake(task);
+    waiter = next;
+  }
+  spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+static void ipc_waitq_init(ipc_waitq_t *wq) {
+  spin_lock_init(&wq->lock, 0);
+  wq->head = 0;
+}
+
+/*
+ * Creates a channel with room for slots messages, rounded up to a power of
+ * two. The channel and its ring share one block of pages, so the per-side
+ * cache lines really are cache lines. Returns 0 for a bad kind or size or
+ * when memory runs out.
+ */
+ipc_channel_t *ipc_channel_create(uint8_t kind, uint32_t slots) {
+  if (kind != IPC_CHANNEL_SPSC && kind != IPC_CHANNEL_MPSC) {
+    return 0;
+  }
+  if (slots < 2 || slots > IPC_CHANNEL_MAX_SLOTS) {
+    return 0;
+  }
+  uint32_t capacity = 2;
+  while (capacity < slots) {
+    capacity <<= 1;
+  }
+  uint64_t size = sizeof(ipc_channel_t) + (uint64_t)capacity * sizeof(ipc_slot_t);
+  uint8_t order = 0;
+  while (((uint64_t)MM_PAGE_SIZE << order) < size) {
+    order++;
+  }
+  uint64_t phys = mm_alloc_pages(order);
+  if (!phys) {
+    return 0;
+  }
+  ipc_channel_t *ch = (ipc_channel_t *)mm_phys_to_virt(phys);
+  ch->mask = capacity - 1;
+  ch->kind = kind;
+  ch->order = order;
+  ch->tx.tail = 0;
+  ch->tx.head_cache = 0;
+  ch->tx.full = 0;
+  ch->tx.waits = 0;
+  ch->rx.head = 0;
+  ch->rx.tail_cache = 0;
+  ch->rx.waits = 0;
+  ipc_waitq_init(&ch->rx_wait);
+  ipc_waitq_init(&ch->tx_wait);
+  for (uint32_t i = 0; i < capacity; ++i) {
+    ch->slots[i].seq = 0;
+  }
+  __atomic_fetch_add(&channel_count, 1, __ATOMIC_RELAXED);
+  return ch;
+}
+
+/* Nobody may be using or waiting on the channel any more. */
+void ipc_channel_destroy(ipc_channel_t *ch) {
+  if (!ch) {
+    return;
+  }
+  mm_free_pages(mm_virt_to_phys(ch), ch->order);
+  __atomic_fetch_sub(&channel_count, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t ipc_channel_count(void) {
+  return channel_count;
+}
+
+static uint32_t spsc_send(ipc_channel_t *ch, const ipc_msg_t *msgs, uint32_t count) {
+  uint64_t capacity = (uint64_t)ch->mask + 1;
+  uint64_t tail = ch->tx.tail;
+  uint64_t room = capacity - (tail - ch->tx.head_cache);
+  if (room < count) {
+    ch->tx.head_cache = __atomic_load_n(&ch->rx.head, __ATOMIC_ACQUIRE);
+    room = capacity - (tail - ch->tx.head_cache);
+  }
+  uint32_t n = room < count ? (uint32_t)room : count;
+  for (uint32_t i = 0; i < n; ++i) {
+    ch->slots[(tail + i) & ch->mask].msg = msgs[i];
+  }
+  if (n) {
+    __atomic_store_n(&ch->tx.tail, tail + n, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static uint32_t mpsc_send(ipc_channel_t *ch, const ipc_msg_t *msgs, uint32_t count) {
+  uint64_t capacity = (uint64_t)ch->mask + 1;
+  uint64_t tail = __atomic_load_n(&ch->tx.tail, __ATOMIC_RELAXED);
+  uint32_t n;
+  for (;;) {
+    uint64_t head = __atomic_load_n(&ch->rx.head, __ATOMIC_ACQUIRE);
+    if ((int64_t)(tail - head) < 0) {
+      /* Our tail is older than the consumer's head; catch up first. */
+      tail = __atomic_load_n(&ch->tx.tail, __ATOMIC_RELAXED);
+      continue;
+    }
+    uint64_t room = capacity - (tail - head);
+    n = room < count ? (uint32_t)room : count;
+    if (!n) {
+      return 0;
+    }
+    if (__atomic_compare_exchange_n(&ch->tx.tail, &tail, tail + n, 1, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    ipc_slot_t *slot = &ch->slots[(tail + i) & ch->mask];
+    slot->msg = msgs[i];
+    __atomic_store_n(&slot->seq, tail + i + 1, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+/*
+ * Queues up to count messages without blocking and returns how many went
+ * in, which is less than count only when the ring filled up. Safe from
+ * interrupt handlers, but not while holding the scheduler lock, since
+ * waking the receiver takes it.
+ */
+uint32_t ipc_send_batch(ipc_channel_t *ch, const ipc_msg_t *msgs, uint32_t count) {
+  if (!ch || !msgs || !count) {
+    return 0;
+  }
+  uint32_t n = ch->kind == IPC_CHANNEL_SPSC ? spsc_send(ch, msgs, count)
+                                            : mpsc_send(ch, msgs, count);
+  if (n < count) {
+    __atomic_fetch_add(&ch->tx.full, 1, __ATOMIC_RELAXED);
+  }
+  if (n) {
+    ipc_wake_all(&ch->rx_wait);
+  }
+  return n;
+}
+
+/* Returns 0, or -1 if the ring is full. */
+int ipc_send(ipc_channel_t *ch, const ipc_msg_t *msg) {
+  return ipc_send_batch(ch, msg, 1) == 1 ? 0 : -1;
+}
+
+static uint32_t spsc_recv(ipc_channel_t *ch, ipc_msg_t *out, uint32_t max) {
+  uint64_t head = ch->rx.head;
+  uint64_t ready = ch->rx.tail_cache - head;
+  if (ready < max) {
+    ch->rx.tail_cache = __atomic_load_n(&ch->tx.tail, __ATOMIC_ACQUIRE);
+    ready = ch->rx.tail_cache - head;
+  }
+  uint32_t n = ready < max ? (uint32_t)ready : max;
+  for (uint32_t i = 0; i < n; ++i) {
+    out[i] = ch->slots[(head + i) & ch->mask].msg;
+  }
+  if (n) {
+    __atomic_store_n(&ch->rx.head, head + n, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+/* Stops at the first slot that is claimed but not yet written, so messages come out in tail order. */
+static uint32_t mpsc_recv(ipc_channel_t *ch, ipc_msg_t *out, uint32_t max) {
+  uint64_t head = ch->rx.head;
+  uint32_t n = 0;
+  while (n < max) {
+    const ipc_slot_t *slot = &ch->slots[(head + n) & ch->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + n + 1) {
+      break;
+    }
+    out[n++] = slot->msg;
+  }
+  if (n) {
+    __atomic_store_n(&ch->rx.head, head + n, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+/* Takes up to max messages without blocking; only the channel's one receiver may call this. */
+uint32_t ipc_recv_batch(ipc_channel_t *ch, ipc_msg_t *out, uint32_t max) {
+  if (!ch || !out || !max) {
+    return 0;
+  }
+  uint32_t n = ch->kind == IPC_CHANNEL_SPSC ? spsc_recv(ch, out, max) : mpsc_recv(ch, out, max);
+  if (n) {
+    ipc_wake_all(&ch->tx_wait);
+  }
+  return n;
+}
+
+/* Returns 0, or -1 if nothing is waiting. */
+int ipc_recv(ipc_channel_t *ch, ipc_msg_t *out) {
+  return ipc_recv_batch(ch, out, 1) == 1 ? 0 : -1;
+}
+
+static int ipc_readable(ipc_channel_t *ch) {
+  uint64_t head = ch->rx.head;
+  if (ch->kind == IPC_CHANNEL_SPSC) {
+    return __atomic_load_n(&ch->tx.tail, __ATOMIC_ACQUIRE) != head;
+  }
+  return __atomic_load_n(&ch->slots[head & ch->mask].seq, __ATOMIC_ACQUIRE) == head + 1;
+}
+
+static int ipc_writable(ipc_channel_t *ch) {
+  uint64_t tail = __atomic_load_n(&ch->tx.tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&ch->rx.head, __ATOMIC_ACQUIRE);
+  return tail - head <= ch->mask;
+}
+
+/* Like ipc_recv_batch(), but parks the receiver until at least one message arrives. */
+uint32_t ipc_recv_wait(ipc_channel_t *ch, ipc_msg_t *out, uint32_t max) {
+  if (!ch || !out || !max) {
+    return 0;
+  }
+  for (;;) {
+    uint32_t n = ipc_recv_batch(ch, out, max);
+    if (n) {
+      return n;
+    }
+    ipc_waiter_t waiter;
+    uint64_t flags = interrupts_save();
+    ipc_wait_prepare(&ch->rx_wait, &waiter);
+    if (!ipc_readable(ch)) {
+      ch->rx.waits++;
+      scheduler_block();
+    }
+    ipc_wait_finish(&ch->rx_wait, &waiter);
+    interrupts_restore(flags);
+  }
+}
+
+/* Sends all count messages, parking the sender whenever the ring is full. */
+uint32_t ipc_send_wait(ipc_channel_t *ch, const ipc_msg_t *msgs, uint32_t count) {
+  if (!ch || !msgs) {
+    return 0;
+  }
+  uint32_t sent = 0;
+  while (sent < count) {
+    uint32_t n = ipc_send_batch(ch, msgs + sent, count - sent);
+    sent += n;
+    if (n) {
+      continue;
+    }
+    ipc_waiter_t waiter;
+    uint64_t flags = interrupts_save();
+    ipc_wait_prepare(&ch->tx_wait, &waiter);
+    if (!ipc_writable(ch)) {
+      __atomic_fetch_add(&ch->tx.waits, 1, __ATOMIC_RELAXED);
+      scheduler_block();
+    }
+    ipc_wait_finish(&ch->tx_wait, &waiter);
+    interrupts_restore(flags);
+  }
+  return sent;
+}
+
+int ipc_channel_stats(const ipc_channel_t *ch, ipc_channel_stats_t *out) {
+  if (!ch || !out) {
+    return -1;
+  }
+  out->kind = ch->kind;
+  out->slots = ch->mask + 1;
+  out->sent = __atomic_load_n(&ch->tx.tail, __ATOMIC_RELAXED);
+  out->received = __atomic_load_n(&ch->rx.head, __ATOMIC_RELAXED);
+  out->queued = (uint32_t)(out->sent - out->received);
+  out->full = ch->tx.full;
+  out->rx_waits = ch->rx.waits;
+  out->tx_waits = ch->tx.waits;
+  return 0;
+}
+
+const char *ipc_channel_kind_name(uint8_t kind) {
+  return kind == IPC_CHANNEL_SPSC ? "spsc" : "mpsc";
+}
+
+ipc_endpoint_t *ipc_endpoint_create(void) {
+  ipc_endpoint_t *ep = (ipc_endpoint_t *)kmalloc(sizeof(ipc_endpoint_t));
+  if (!ep) {
+    return 0;
+  }
+  spin_lock_init(&ep->lock, 0);
+  ep->server = 0;
+  ep->server_buf = 0;
+  ep->callers = 0;
+  ep->callers_tail = 0;
+  ep->current = 0;
+  ep->calls = 0;
+  ep->direct = 0;
+  ep->queued = 0;
+  return ep;
+}
+
+/* Nobody may be calling, serving or waiting on the endpoint any more. */
+void ipc_endpoint_destroy(ipc_endpoint_t *ep) {
+  kfree(ep);
+}
+
+int ipc_endpoint_stats(const ipc_endpoint_t *ep, ipc_endpoint_stats_t *out) {
+  if (!ep || !out) {
+    return -1;
+  }
+  out->calls = ep->calls;
+  out->direct = ep->direct;
+  out->queued = ep->queued;
+  return 0;
+}
+
+/*
+ * Sends msg to the endpoint's server and waits for the reply, which
+ * overwrites msg. If the server is already waiting, the request is copied
+ * straight into its buffer and this CPU switches to it without a trip
+ * through the run queues; its reply comes back the same way. Returns 0,
+ * or -1 for bad arguments.
+ */
+int ipc_call(ipc_endpoint_t *ep, ipc_msg_t *msg) {
+  if (!ep || !msg) {
+    return -1;
+  }
+  ipc_call_t call;
+  call.next = 0;
+  call.task = scheduler_self();
+  call.msg = msg;
+  call.done = 0;
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  ep->calls++;
+  task_t *server = ep->server;
+  if (server) {
+    ep->server = 0;
+    *ep->server_buf = *msg;
+    ep->current = &call;
+    ep->direct++;
+    spin_unlock(&ep->lock);
+    scheduler_handoff(server);
+  } else {
+    if (ep->callers_tail) {
+      ep->callers_tail->next = &call;
+    } else {
+      ep->callers = &call;
+    }
+    ep->callers_tail = &call;
+    ep->queued++;
+    spin_unlock(&ep->lock);
+  }
+  while (!__atomic_load_n(&call.done, __ATOMIC_ACQUIRE)) {
+    scheduler_block();
+  }
+  interrupts_restore(flags);
+  return 0;
+}
+
+/*
+ * Called with ep->lock held and interrupts off; returns with the lock
+ * dropped once the next request is in msg. replied is the caller just
+ * answered, if any: when a request is already queued it is merely woken,
+ * otherwise the server parks and hands this CPU straight back to it.
+ */
+static void endpoint_next(ipc_endpoint_t *ep, ipc_msg_t *msg, task_t *replied) {
+  ipc_call_t *call = ep->callers;
+  if (call) {
+    ep->callers = call->next;
+    if (!ep->callers) {
+      ep->callers_tail = 0;
+    }
+    *msg = *call->msg;
+    ep->current = call;
+    spin_unlock(&ep->lock);
+    scheduler_wake(replied);
+    return;
+  }
+  task_t *self = scheduler_self();
+  ep->server = self;
+  ep->server_buf = msg;
+  spin_unlock(&ep->lock);
+  if (replied) {
+    scheduler_handoff(replied);
+  } else {
+    scheduler_block();
+  }
+  for (;;) {
+    spin_lock(&ep->lock);
+    int delivered = ep->server != self;
+    spin_unlock(&ep->lock);
+    if (delivered) {
+      return;
+    }
+    scheduler_block();
+  }
+}
+
+/* Waits for the first request on the endpoint; only its server may call this. */
+int ipc_receive(ipc_endpoint_t *ep, ipc_msg_t *msg) {
+  if (!ep || !msg) {
+    return -1;
+  }
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  endpoint_next(ep, msg, 0);
+  interrupts_restore(flags);
+  return 0;
+}
+
+/* Detaches the call being served and puts reply in its buffer; the caller still has to be woken. */
+static task_t *endpoint_answer(ipc_endpoint_t *ep, const ipc_msg_t *reply) {
+  ipc_call_t *call = ep->current;
+  if (!call) {
+    return 0;
+  }
+  ep->current = 0;
+  task_t *caller = call->task;
+  *call->msg = *reply;
+  __atomic_store_n(&call->done, 1, __ATOMIC_RELEASE);
+  return caller;
+}
+
+/* Answers the call being served without waiting for the next one. Returns 0, or -1 if there is none. */
+int ipc_reply(ipc_endpoint_t *ep, const ipc_msg_t *msg) {
+  if (!ep || !msg) {
+    return -1;
+  }
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  task_t *caller = endpoint_answer(ep, msg);
+  spin_unlock_irqrestore(&ep->lock, flags);
+  if (!caller) {
+    return -1;
+  }
+  scheduler_wake(caller);
+  return 0;
+}
+
+/* The server's loop step: answers the current call with msg, then waits for the next request in msg. */
+int ipc_reply_wait(ipc_endpoint_t *ep, ipc_msg_t *msg) {
+  if (!ep || !msg) {
+    return -1;
+  }
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  task_t *caller = endpoint_answer(ep, msg);
+  endpoint_next(ep, msg, caller);
+  interrupts_restore(flags);
+  return 0;
+}
+
+/* First fit over the window bitmap; returns the first page of a free run, or -1. */
+static int32_t window_alloc(uint32_t pages) {
+  uint32_t run = 0;
+  for (uint32_t page = 0; page < IPC_GRANT_WINDOW_PAGES; ++page) {
+    uint64_t word = grant_window[page / 64];
+    if (run == 0 && page % 64 == 0 && word == ~0ull) {
+      page += 63;
+      continue;
+    }
+    if (word & (1ull << (page % 64))) {
+      run = 0;
+      continue;
+    }
+    if (++run == pages) {
+      uint32_t start = page + 1 - pages;
+      for (uint32_t i = start; i <= page; ++i) {
+        grant_window[i / 64] |= 1ull << (i % 64);
+      }
+      return (int32_t)start;
+    }
+  }
+  return -1;
+}
+
+static void window_free(uint64_t va, uint32_t pages) {
+  uint32_t start = (uint32_t)((va - IPC_GRANT_WINDOW_BASE) >> MM_PAGE_SHIFT);
+  for (uint32_t i = start; i < start + pages; ++i) {
+    grant_window[i / 64] &= ~(1ull << (i % 64));
+  }
+}
+
+static ipc_grant_t *grant_lookup(int id) {
+  if (id < 0) {
+    return 0;
+  }
+  uint32_t index = (uint32_t)id & ((1u << IPC_GRANT_INDEX_BITS) - 1);
+  if (index >= IPC_GRANT_MAX) {
+    return 0;
+  }
+  ipc_grant_t *grant = &grants[index];
+  if (!grant->used || grant->generation != (uint16_t)((uint32_t)id >> IPC_GRANT_INDEX_BITS)) {
+    return 0;
+  }
+  return grant;
+}
+
+/* Drops one reference under grant_lock, freeing the frames and the slot with the last one. */
+static void grant_put(ipc_grant_t *grant) {
+  if (--grant->refs) {
+    return;
+  }
+  mm_free_pages(grant->phys, grant->order);
+  grant->used = 0;
+  grant->generation++;
+}
+
+/*
+ * Allocates a grant of at least pages pages (rounded up to a power of two,
+ * at most 2^MM_MAX_ORDER). The frames are not cleared. Returns the grant
+ * id, -1 for a bad size, -2 if no slot or memory is left.
+ */
+int ipc_grant_create(uint32_t pages) {
+  if (!pages || pages > (1u << MM_MAX_ORDER)) {
+    return -1;
+  }
+  uint8_t order = 0;
+  while ((1u << order) < pages) {
+    order++;
+  }
+  uint64_t phys = mm_alloc_pages(order);
+  if (!phys) {
+    return -2;
+  }
+  uint64_t flags = spin_lock_irqsave(&grant_lock);
+  for (uint32_t i = 0; i < IPC_GRANT_MAX; ++i) {
+    ipc_grant_t *grant = &grants[i];
+    if (grant->used) {
+      continue;
+    }
+    grant->phys = phys;
+    grant->pages = 1u << order;
+    grant->order = order;
+    grant->refs = 1;
+    grant->used = 1;
+    grant->owned = 1;
+    grant->revoked = 0;
+    for (uint32_t m = 0; m < IPC_GRANT_MAPS; ++m) {
+      grant->maps[m] = 0;
+    }
+    int id = (int)(((uint32_t)grant->generation << IPC_GRANT_INDEX_BITS) | i);
+    spin_unlock_irqrestore(&grant_lock, flags);
+    return id;
+  }
+  spin_unlock_irqrestore(&grant_lock, flags);
+  mm_free_pages(phys, order);
+  return -2;
+}
+
+/* Size of a grant in bytes, or 0 for an unknown id. */
+uint64_t ipc_grant_size(int id) {
+  uint64_t flags = spin_lock_irqsave(&grant_lock);
+  const ipc_grant_t *grant = grant_lookup(id);
+  uint64_t size = grant ? (uint64_t)grant->pages << MM_PAGE_SHIFT : 0;
+  spin_unlock_irqrestore(&grant_lock, flags);
+  return size;
+}
+
+/*
+ * Maps a grant's frames at a fresh address in the grant window, writable
+ * if flags has IPC_GRANT_WRITE, and takes a reference for the mapping.
+ * Only page table entries are written; no byte of the payload is copied.
+ * The lock is held across the mapping so a concurrent revoke either sees
+ * it complete or prevents it. Returns 0 for an unknown or revoked grant,
+ * or when the window, the mapping slots or page table memory run out.
+ */
+void *ipc_grant_map(int id, uint32_t flags) {
+  uint64_t irq = spin_lock_irqsave(&grant_lock);
+  ipc_grant_t *grant = grant_lookup(id);
+  if (!grant || grant->revoked) {
+    spin_unlock_irqrestore(&grant_lock, irq);
+    return 0;
+  }
+  uint32_t slot = 0;
+  while (slot < IPC_GRANT_MAPS && grant->maps[slot]) {
+    slot++;
+  }
+  int32_t page = slot < IPC_GRANT_MAPS ? window_alloc(grant->pages) : -1;
+  if (page < 0) {
+    spin_unlock_irqrestore(&grant_lock, irq);
+    return 0;
+  }
+  uint64_t va = IPC_GRANT_WINDOW_BASE + ((uint64_t)page << MM_PAGE_SHIFT);
+  uint64_t size = (uint64_t)grant->pages << MM_PAGE_SHIFT;
+  if (mm_map(va, grant->phys, size, (flags & IPC_GRANT_WRITE) ? MM_MAP_WRITE : 0) != 0) {
+    window_free(va, grant->pages);
+    spin_unlock_irqrestore(&grant_lock, irq);
+    return 0;
+  }
+  grant->maps[slot] = va;
+  grant->refs++;
+  spin_unlock_irqrestore(&grant_lock, irq);
+  return (void *)va;
+}
+
+/*
+ * Gives back the window range and the reference of a mapping that is off
+ * the page tables and every TLB. Called with grant_lock released.
+ */
+static void grant_unmapped(ipc_grant_t *grant, uint64_t va, uint32_t pages) {
+  uint64_t flags = spin_lock_irqsave(&grant_lock);
+  window_free(va, pages);
+  grant_put(grant);
+  spin_unlock_irqrestore(&grant_lock, flags);
+}
+
+/* Returns 0, or -1 if addr is not a live mapping of grant id (it may have been revoked). */
+int ipc_grant_unmap(int id, void *addr) {
+  uint64_t flags = spin_lock_irqsave(&grant_lock);
+  ipc_grant_t *grant = grant_lookup(id);
+  uint32_t slot = 0;
+  while (grant && slot < IPC_GRANT_MAPS && grant->maps[slot] != (uint64_t)addr) {
+    slot++;
+  }
+  if (!grant || !addr || slot == IPC_GRANT_MAPS) {
+    spin_unlock_irqrestore(&grant_lock, flags);
+    return -1;
+  }
+  grant->maps[slot] = 0;
+  uint32_t pages = grant->pages;
+  spin_unlock_irqrestore(&grant_lock, flags);
+  mm_unmap((uint64_t)addr, (uint64_t)pages << MM_PAGE_SHIFT);
+  grant_unmapped(grant, (uint64_t)addr, pages);
+  return 0;
+}
+
+/*
+ * The creator gives up its reference while mappings stay valid: this is
+ * how a grant is transferred, the frames living on until the receiver
+ * unmaps them. Returns 0, or -1 for an unknown or already released grant.
+ */
+int ipc_grant_release(int id) {
+  uint64_t flags = spin_lock_irqsave(&grant_lock);
+  ipc_grant_t *grant = grant_lookup(id);
+  if (!grant || !grant->owned) {
+    spin_unlock_irqrestore(&grant_lock, flags);
+    return -1;
+  }
+  grant->owned = 0;
+  grant_put(grant);
+  spin_unlock_irqrestore(&grant_lock, flags);
+  return 0;
+}
+
+/*
+ * Withdraws a grant: no new mappings are allowed, every existing one is
+ * removed and shot down, and the creator's reference is dropped, so the
+ * frames are free once this returns. A holder's later ipc_grant_unmap()
+ * fails harmlessly. Returns the number of mappings removed, or -1 for an
+ * unknown or released grant. Must not be called with a spinlock held.
+ */
+int ipc_grant_revoke(int id) {
+  uint64_t flags = spin_lock_irqsave(&grant_lock);
+  ipc_grant_t *grant = grant_lookup(id);
+  if (!grant || !grant->owned) {
+    spin_unlock_irqrestore(&grant_lock, flags);
+    return -1;
+  }
+  grant->revoked = 1;
+  uint64_t maps[IPC_GRANT_MAPS];
+  int count = 0;
+  for (uint32_t slot = 0; slot < IPC_GRANT_MAPS; ++slot) {
+    if (grant->maps[slot]) {
+      maps[count++] = grant->maps[slot];
+      grant->maps[slot] = 0;
+    }
+  }
+  /* The mappings' references keep the slot alive until they are dropped below. */
+  uint32_t pages = grant->pages;
+  grant->owned = 0;
+  grant_put(grant);
+  spin_unlock_irqrestore(&grant_lock, flags);
+  /* All mappings leave the TLBs in one shootdown round. */
+  mm_tlb_batch_t batch;
+  mm_tlb_batch_init(&batch, mm_kernel_space());
+  for (int i = 0; i < count; ++i) {
+    mm_space_unmap_deferred(&batch, maps[i], (uint64_t)pages << MM_PAGE_SHIFT);
+  }
+  mm_tlb_batch_flush(&batch);
+  for (int i = 0; i < count; ++i) {
+    grant_unmapped(grant, maps[i], pages);
+  }
+  return count;
+}
+
+/*
+ * Benchmarks. The calling thread is the receiver; the other side runs in
+ * kernel threads that bump done as the very last thing they do with the
+ * channels, so the caller knows when it may free them.
+ */
+typedef struct {
+  ipc_channel_t *ch;
+  ipc_channel_t *reply;
+  ipc_endpoint_t *ep;
+  uint32_t messages;
+  volatile uint32_t done;
+} ipc_bench_t;
+
+static void bench_producer(void *arg) {
+  ipc_bench_t *bench = (ipc_bench_t *)arg;
+  ipc_msg_t batch[IPC_BENCH_BATCH];
+  uint32_t sent = 0;
+  while (sent < bench->messages) {
+    uint32_t n = bench->messages - sent;
+    if (n > IPC_BENCH_BATCH) {
+      n = IPC_BENCH_BATCH;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+      batch[i].tag = sent + i;
+      batch[i].data[0] = 0;
+      batch[i].data[1] = 0;
+      batch[i].data[2] = 0;
+    }
+    sent += ipc_send_wait(bench->ch, batch, n);
+  }
+  __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_echo(void *arg) {
+  ipc_bench_t *bench = (ipc_bench_t *)arg;
+  ipc_msg_t msg;
+  for (;;) {
+    ipc_recv_wait(bench->ch, &msg, 1);
+    if (msg.tag == IPC_BENCH_STOP) {
+      break;
+    }
+    ipc_send_wait(bench->reply, &msg, 1);
+  }
+  __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_server(void *arg) {
+  ipc_bench_t *bench = (ipc_bench_t *)arg;
+  ipc_msg_t msg;
+  ipc_receive(bench->ep, &msg);
+  while (msg.tag != IPC_BENCH_STOP) {
+    msg.data[0]++;
+    ipc_reply_wait(bench->ep, &msg);
+  }
+  ipc_reply(bench->ep, &msg);
+  __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+/* Maps each granted buffer it is sent, reads its first and last word and answers with their sum. */
+static void bench_grant_server(void *arg) {
+  ipc_bench_t *bench = (ipc_bench_t *)arg;
+  ipc_msg_t msg;
+  ipc_receive(bench->ep, &msg);
+  while (msg.tag != IPC_BENCH_STOP) {
+    int id = (int)msg.data[0];
+    const uint64_t *data = (const uint64_t *)ipc_grant_map(id, 0);
+    msg.data[1] = 0;
+    if (data) {
+      uint64_t words = ipc_grant_size(id) / sizeof(uint64_t);
+      msg.data[1] = data[0] + data[words - 1];
+      ipc_grant_unmap(id, (void *)data);
+    }
+    ipc_reply_wait(bench->ep, &msg);
+  }
+  ipc_reply(bench->ep, &msg);
+  __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_join(ipc_bench_t *bench, uint32_t threads) {
+  while (__atomic_load_n(&bench->done, __ATOMIC_ACQUIRE) < threads) {
+    scheduler_sleep(1);
+  }
+}
+
+/*
+ * Each of producers threads streams messages in batches to the caller, over
+ * one channel of the given kind. Returns 0, -1 for bad arguments and -2 if the
+ * channel or the threads could not be created.
+ */
+int ipc_bench_stream(uint8_t kind, uint32_t producers, uint32_t messages, ipc_bench_stream_t *out) {
+  if (!out || !messages || !producers || producers > IPC_BENCH_MAX_PRODUCERS ||
+      (kind == IPC_CHANNEL_SPSC && producers != 1)) {
+    return -1;
+  }
+  ipc_bench_t bench;
+  bench.ch = ipc_channel_create(kind, IPC_BENCH_SLOTS);
+  bench.reply = 0;
+  bench.ep = 0;
+  bench.messages = messages;
+  bench.done = 0;
+  if (!bench.ch) {
+    return -2;
+  }
+  uint64_t start = rdtsc();
+  uint32_t started = 0;
+  for (uint32_t i = 0; i < producers; ++i) {
+    if (scheduler_spawn("ipc-tx", bench_producer, &bench, SCHED_PRIORITY_HIGH) >= 0) {
+      started++;
+    }
+  }
+  uint64_t total = (uint64_t)started * messages;
+  uint64_t received = 0;
+  ipc_msg_t batch[IPC_BENCH_BATCH];
+  while (received < total) {
+    received += ipc_recv_wait(bench.ch, batch, IPC_BENCH_BATCH);
+  }
+  uint64_t cycles = rdtsc() - start;
+  bench_join(&bench, started);
+  ipc_channel_stats_t stats;
+  ipc_channel_stats(bench.ch, &stats);
+  ipc_channel_destroy(bench.ch);
+  if (!started) {
+    return -2;
+  }
+  out->messages = (uint32_t)total;
+  out->producers = started;
+  out->cycles = cycles;
+  out->rx_waits = stats.rx_waits;
+  out->tx_waits = stats.tx_waits;
+  return 0;
+}
+
+static void bench_account(ipc_bench_rtt_t *out, uint64_t cycles) {
+  out->total_cycles += cycles;
+  if (cycles < out->min_cycles) {
+    out->min_cycles = cycles;
+  }
+  if (cycles > out->max_cycles) {
+    out->max_cycles = cycles;
+  }
+}
+
+/*
+ * Ping-pong between the caller and an echo thread over a pair of SPSC
+ * channels, one message each way per round. Returns 0, -1 for bad
+ * arguments and -2 if the channels or the thread could not be created.
+ */
+int ipc_bench_rtt(uint32_t rounds, ipc_bench_rtt_t *out) {
+  if (!out || !rounds) {
+    return -1;
+  }
+  ipc_bench_t bench;
+  bench.ch = ipc_channel_create(IPC_CHANNEL_SPSC, 2);
+  bench.reply = ipc_channel_create(IPC_CHANNEL_SPSC, 2);
+  bench.ep = 0;
+  bench.messages = rounds;
+  bench.done = 0;
+  if (!bench.ch || !bench.reply ||
+      scheduler_spawn("ipc-echo", bench_echo, &bench, SCHED_PRIORITY_HIGH) < 0) {
+    ipc_channel_destroy(bench.ch);
+    ipc_channel_destroy(bench.reply);
+    return -2;
+  }
+  out->rounds = rounds;
+  out->total_cycles = 0;
+  out->min_cycles = ~0ull;
+  out->max_cycles = 0;
+  out->direct = 0;
+  ipc_msg_t msg = {0, {0, 0, 0}};
+  for (uint32_t i = 0; i < rounds; ++i) {
+    msg.tag = i;
+    uint64_t start = rdtsc();
+    ipc_send_wait(bench.ch, &msg, 1);
+    ipc_recv_wait(bench.reply, &msg, 1);
+    bench_account(out, rdtsc() - start);
+  }
+  msg.tag = IPC_BENCH_STOP;
+  ipc_send_wait(bench.ch, &msg, 1);
+  bench_join(&bench, 1);
+  ipc_channel_destroy(bench.ch);
+  ipc_channel_destroy(bench.reply);
+  return 0;
+}
+
+/*
+ * Round trips through ipc_call() to a server thread that answers with
+ * ipc_reply_wait(). direct counts the calls that found the server waiting
+ * and took the handoff path. Returns 0, -1 for bad arguments and -2 if the
+ * endpoint or the thread could not be created.
+ */
+int ipc_bench_call(uint32_t rounds, ipc_bench_rtt_t *out) {
+  if (!out || !rounds) {
+    return -1;
+  }
+  ipc_bench_t bench;
+  bench.ch = 0;
+  bench.reply = 0;
+  bench.ep = ipc_endpoint_create();
+  bench.messages = rounds;
+  bench.done = 0;
+  if (!bench.ep || scheduler_spawn("ipc-server", bench_server, &bench, SCHED_PRIORITY_HIGH) < 0) {
+    ipc_endpoint_destroy(bench.ep);
+    return -2;
+  }
+  out->rounds = rounds;
+  out->total_cycles = 0;
+  out->min_cycles = ~0ull;
+  out->max_cycles = 0;
+  ipc_msg_t msg = {0, {0, 0, 0}};
+  for (uint32_t i = 0; i < rounds; ++i) {
+    msg.tag = i;
+    uint64_t start = rdtsc();
+    ipc_call(bench.ep, &msg);
+    bench_account(out, rdtsc() - start);
+  }
+  msg.tag = IPC_BENCH_STOP;
+  ipc_call(bench.ep, &msg);
+  bench_join(&bench, 1);
+  out->direct = bench.ep->direct;
+  ipc_endpoint_destroy(bench.ep);
+  return 0;
+}
+
+/*
+ * Moves a pages-page buffer to a server thread rounds times: create the
+ * grant, map it and write its first and last word, unmap it, pass the id
+ * with ipc_call(), and release it once the server has mapped and read it.
+ * No payload byte is copied, so the cost per round grows with the number
+ * of page table entries only. Returns 0, -1 for bad arguments, -2 if the
+ * endpoint, the thread or a grant could not be created and -3 if the
+ * server read back the wrong data.
+ */
+int ipc_bench_grant(uint32_t pages, uint32_t rounds, ipc_bench_grant_t *out) {
+  if (!out || !rounds || !pages || pages > (1u << MM_MAX_ORDER)) {
+    return -1;
+  }
+  ipc_bench_t bench;
+  bench.ch = 0;
+  bench.reply = 0;
+  bench.ep = ipc_endpoint_create();
+  bench.messages = rounds;
+  bench.done = 0;
+  if (!bench.ep ||
+      scheduler_spawn("ipc-server", bench_grant_server, &bench, SCHED_PRIORITY_HIGH) < 0) {
+    ipc_endpoint_destroy(bench.ep);
+    return -2;
+  }
+  int result = 0;
+  uint64_t start = rdtsc();
+  for (uint32_t i = 0; i < rounds && !result; ++i) {
+    int id = ipc_grant_create(pages);
+    uint64_t *data = id >= 0 ? (uint64_t *)ipc_grant_map(id, IPC_GRANT_WRITE) : 0;
+    if (!data) {
+      if (id >= 0) {
+        ipc_grant_release(id);
+      }
+      result = -2;
+      break;
+    }
+    uint64_t words = ipc_grant_size(id) / sizeof(uint64_t);
+    data[0] = i;
+    data[words - 1] = i;
+    ipc_grant_unmap(id, data);
+    ipc_msg_t msg = {0, {(uint64_t)id, 0, 0}};
+    ipc_call(bench.ep, &msg);
+    ipc_grant_release(id);
+    if (msg.data[1] != 2ull * i) {
+      result = -3;
+    }
+  }
+  out->cycles = rdtsc() - start;
+  out->bytes = (uint64_t)pages << MM_PAGE_SHIFT;
+  out->rounds = rounds;
+  ipc_msg_t stop = {IPC_BENCH_STOP, {0, 0, 0}};
+  ipc_call(bench.ep, &stop);
+  bench_join(&bench, 1);
+  ipc_endpoint_destroy(bench.ep);
+  return result;
 }
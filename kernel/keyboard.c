@@ -1,8 +1,13 @@
 #include "kernel/keyboard.h"
+#include "kernel/console.h"
+#include "kernel/interrupts.h"
 #include "kernel/io.h"
+#include "kernel/scheduler.h"
 
 #define PS2_STATUS 0x64
 #define PS2_DATA 0x60
+#define SCANCODE_PAGE_UP 0x49
+#define SCANCODE_PAGE_DOWN 0x51
 
 static const char keymap[128] = {
   0,  27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
@@ -28,29 +33,41 @@ static const char keymap_shift[128] = {
 
 static uint8_t shift_pressed = 0;
 
+static char decode(uint8_t scancode) {
+  if (scancode == 0x2A || scancode == 0x36) {
+    shift_pressed = 1;
+    return 0;
+  }
+  if (scancode == 0xAA || scancode == 0xB6) {
+    shift_pressed = 0;
+    return 0;
+  }
+  if (scancode & 0x80) {
+    return 0;
+  }
+  /* The E0-prefixed and keypad variants share these codes; the prefix byte itself decodes to nothing. */
+  if (scancode == SCANCODE_PAGE_UP) {
+    return KEY_PAGE_UP;
+  }
+  if (scancode == SCANCODE_PAGE_DOWN) {
+    return KEY_PAGE_DOWN;
+  }
+  return shift_pressed ? keymap_shift[scancode] : keymap[scancode];
+}
+
 void keyboard_init(void) {
-  (void)inb(PS2_STATUS);
+  while (inb(PS2_STATUS) & 0x01) {
+    (void)inb(PS2_DATA);
+  }
 }
 
-char keyboard_getchar(void) {
-  for (;;) {
-    if (inb(PS2_STATUS) & 0x01) {
-      uint8_t scancode = inb(PS2_DATA);
-      if (scancode == 0x2A || scancode == 0x36) {
-        shift_pressed = 1;
-        continue;
-      }
-      if (scancode == 0xAA || scancode == 0xB6) {
-        shift_pressed = 0;
-        continue;
-      }
-      if (scancode & 0x80) {
-        continue;
-      }
-      char c = shift_pressed ? keymap_shift[scancode] : keymap[scancode];
-      if (c != 0) {
-        return c;
-      }
+uint64_t irq1_handler(uint64_t rsp) {
+  while (inb(PS2_STATUS) & 0x01) {
+    char c = decode(inb(PS2_DATA));
+    if (c != 0) {
+      console_input_push(c);
     }
   }
+  interrupts_eoi(1);
+  return scheduler_preempt(rsp);
 }
@@ -0,0 +1,84 @@
+#include "kernel/lock.h"
+
+/*
+ * Every named lock that has been taken at least once. Locks are only ever
+ * pushed at the head and never removed, so walkers need no lock: a
+ * concurrent registration is either seen or not.
+ */
+static lock_stats_t *lock_list = 0;
+
+void lock_register(lock_stats_t *stats) {
+  if (__atomic_exchange_n(&stats->registered, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  lock_stats_t *head = __atomic_load_n(&lock_list, __ATOMIC_ACQUIRE);
+  do {
+    stats->next = head;
+  } while (!__atomic_compare_exchange_n(&lock_list, &head, stats, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_ACQUIRE));
+}
+
+uint32_t lock_count(void) {
+  uint32_t count = 0;
+  for (const lock_stats_t *stats = __atomic_load_n(&lock_list, __ATOMIC_ACQUIRE); stats;
+       stats = stats->next) {
+    count++;
+  }
+  return count;
+}
+
+static int lock_hotter(const lock_info_t *a, const lock_info_t *b) {
+  if (a->contended != b->contended) {
+    return a->contended > b->contended;
+  }
+  return a->acquired > b->acquired;
+}
+
+/*
+ * Copies the counters of the max most contended locks (ties broken by
+ * acquisitions) into out, hottest first, and returns how many it filled.
+ * The counters are read without the locks, so each one is a snapshot.
+ */
+uint32_t lock_top(lock_info_t *out, uint32_t max) {
+  if (!out || !max) {
+    return 0;
+  }
+  uint32_t filled = 0;
+  for (const lock_stats_t *stats = __atomic_load_n(&lock_list, __ATOMIC_ACQUIRE); stats;
+       stats = stats->next) {
+    lock_info_t info;
+    info.name = stats->name;
+    info.kind = stats->kind;
+    info.acquired = stats->acquired;
+    info.contended = stats->contended;
+    info.max_hold_cycles = stats->max_hold;
+    uint32_t pos = filled < max ? filled : max;
+    while (pos > 0 && lock_hotter(&info, &out[pos - 1])) {
+      if (pos < max) {
+        out[pos] = out[pos - 1];
+      }
+      pos--;
+    }
+    if (pos < max) {
+      out[pos] = info;
+      if (filled < max) {
+        filled++;
+      }
+    }
+  }
+  return filled;
+}
+
+/* Zeroes every registered lock's counters; a lock held right now may report a partial hold. */
+void lock_stats_reset(void) {
+  for (lock_stats_t *stats = __atomic_load_n(&lock_list, __ATOMIC_ACQUIRE); stats;
+       stats = stats->next) {
+    stats->acquired = 0;
+    stats->contended = 0;
+    stats->max_hold = 0;
+  }
+}
+
+const char *lock_kind_name(uint8_t kind) {
+  return kind == LOCK_KIND_RW ? "rw" : "spin";
+}
@@ -1,22 +1,67 @@
+#include "kernel/acpi.h"
+#include "kernel/apic.h"
 #include "kernel/console.h"
+#include "kernel/heap.h"
 #include "kernel/init.h"
+#include "kernel/ipc.h"
 #include "kernel/keyboard.h"
+#include "kernel/lock.h"
+#include "kernel/mm.h"
 #include "kernel/scheduler.h"
+#include "kernel/serial.h"
+#include "kernel/smp.h"
 #include "kernel/timer.h"
+#include "kernel/timer_wheel.h"
 #include "kernel/vfs.h"
+#include "kernel/workqueue.h"
 
 #define COMMAND_MAX 64
 #define PATH_MAX 64
+#define CAT_CHUNK 64
+#define SCROLL_PAGE 12
+/* How many of the most contended locks "locks" lists. */
+#define LOCKS_SHOWN 10
+/* Workload of "ipcbench": messages streamed per run, producers in the MPSC run and ping-pong rounds. */
+#define IPCBENCH_MESSAGES 100000
+#define IPCBENCH_PRODUCERS 2
+#define IPCBENCH_ROUNDS 1000
+/* Grant payloads "ipcbench" moves, in pages (4 KiB to 4 MiB), and how many times each. */
+#define IPCBENCH_GRANT_ROUNDS 100
+/* "tick" is printed once per this many ticks (one second at 100 Hz). */
+#define TICK_REPORT_PERIOD 100
 
 static volatile uint64_t task_a_runs = 0;
 static volatile uint64_t task_b_runs = 0;
 
-static void task_a(void) {
-  task_a_runs++;
+static void report_tick(void *arg) {
+  (void)arg;
+  console_write_line("tick");
 }
 
-static void task_b(void) {
-  task_b_runs++;
+static void task_a(void *arg) {
+  (void)arg;
+  for (;;) {
+    task_a_runs++;
+    scheduler_sleep(1);
+  }
+}
+
+static void task_b(void *arg) {
+  (void)arg;
+  for (;;) {
+    task_b_runs++;
+    scheduler_sleep(1);
+  }
+}
+
+static volatile uint64_t spin_runs = 0;
+
+/* CPU hog for exercising priority decay: never yields, only preempted. */
+static void task_spin(void *arg) {
+  (void)arg;
+  for (;;) {
+    spin_runs++;
+  }
 }
 
 static int streq(const char *a, const char *b) {
@@ -69,18 +114,21 @@ static void handle_cat(const char *arg, int current_dir) {
     console_write_line("Uzycie: cat <plik>");
     return;
   }
-  char name[PATH_MAX];
-  int parent = vfs_resolve_parent(arg, current_dir, name, PATH_MAX);
-  if (parent < 0) {
+  int fd = vfs_open(arg, current_dir, VFS_O_READ);
+  if (fd < 0) {
     console_write_line("Brak takiego pliku");
     return;
   }
-  const char *data = vfs_read_at(parent, name);
-  if (!data) {
-    console_write_line("Brak takiego pliku");
-    return;
+  char chunk[CAT_CHUNK];
+  int read = vfs_fread(fd, chunk, CAT_CHUNK);
+  while (read > 0) {
+    for (int i = 0; i < read; ++i) {
+      console_putc(chunk[i]);
+    }
+    read = vfs_fread(fd, chunk, CAT_CHUNK);
   }
-  console_write_line(data);
+  vfs_close(fd);
+  console_putc('\n');
 }
 
 static void handle_touch(const char *arg, int current_dir) {
@@ -88,15 +136,12 @@ static void handle_touch(const char *arg, int current_dir) {
     console_write_line("Uzycie: touch <plik>");
     return;
   }
-  char name[PATH_MAX];
-  int parent = vfs_resolve_parent(arg, current_dir, name, PATH_MAX);
-  if (parent < 0) {
+  int fd = vfs_open(arg, current_dir, VFS_O_WRITE | VFS_O_CREATE);
+  if (fd < 0) {
     console_write_line("Nie mozna utworzyc pliku");
     return;
   }
-  if (vfs_write_at(parent, name, "") != 0) {
-    console_write_line("Nie mozna utworzyc pliku");
-  }
+  vfs_close(fd);
 }
 
 static void handle_rm(const char *arg, int current_dir) {
@@ -110,15 +155,41 @@ static void handle_rm(const char *arg, int current_dir) {
     console_write_line("Brak takiego pliku");
     return;
   }
-  if (vfs_remove_at(parent, name) != 0) {
+  int result = vfs_remove_at(parent, name);
+  if (result == -2) {
+    console_write_line("Plik jest otwarty");
+  } else if (result != 0) {
     console_write_line("Brak takiego pliku");
   }
 }
 
+static uint16_t text_length(const char *s) {
+  uint16_t len = 0;
+  while (s[len]) {
+    len++;
+  }
+  return len;
+}
+
+static void append_line(const char *path, const char *text, int current_dir) {
+  int fd = vfs_open(path, current_dir, VFS_O_WRITE | VFS_O_CREATE | VFS_O_APPEND);
+  if (fd < 0) {
+    console_write_line("Nie mozna zapisac pliku");
+    return;
+  }
+  if (vfs_seek(fd, 0, VFS_SEEK_END) > 0) {
+    vfs_fwrite(fd, "\n", 1);
+  }
+  if (vfs_fwrite(fd, text, text_length(text)) < 0) {
+    console_write_line("Nie mozna zapisac pliku");
+  }
+  vfs_close(fd);
+}
+
 static void handle_echo(char *args, int current_dir) {
   char *rest = (char *)skip_spaces(args);
   if (!rest || !rest[0]) {
-    console_write_line("Uzycie: echo <tekst> [> <plik>]");
+    console_write_line("Uzycie: echo <tekst> [> | >> <plik>]");
     return;
   }
   char *gt = find_char(rest, '>');
@@ -126,14 +197,19 @@ static void handle_echo(char *args, int current_dir) {
     console_write_line(rest);
     return;
   }
+  uint8_t append = gt[1] == '>';
   *gt = '\0';
   trim_trailing_spaces(rest);
-  char *name = gt + 1;
+  char *name = gt + (append ? 2 : 1);
   name = (char *)skip_spaces(name);
   if (!name || !name[0]) {
     console_write_line("Uzycie: echo <tekst> > <plik>");
     return;
   }
+  if (append) {
+    append_line(name, rest, current_dir);
+    return;
+  }
   char filename[PATH_MAX];
   int parent = vfs_resolve_parent(name, current_dir, filename, PATH_MAX);
   if (parent < 0) {
@@ -177,6 +253,19 @@ static void console_write_uint64(uint64_t value) {
   }
 }
 
+static void console_write_hex64(uint64_t value) {
+  char buffer[17];
+  uint8_t pos = 0;
+  do {
+    uint8_t digit = (uint8_t)(value & 0xF);
+    buffer[pos++] = (char)(digit < 10 ? '0' + digit : 'a' + digit - 10);
+    value >>= 4;
+  } while (value > 0 && pos < 16);
+  while (pos > 0) {
+    console_putc(buffer[--pos]);
+  }
+}
+
 
 static uint16_t parse_u16(const char *text, uint16_t fallback) {
   const char *s = skip_spaces(text);
@@ -214,25 +303,115 @@ static void handle_stat(const char *arg, int current_dir) {
   }
   int size = vfs_node_size(node);
   console_write("size=");
-  console_write_uint16((uint16_t)size);
+  console_write_uint64((uint64_t)size);
   console_putc('\n');
 }
 
 static void handle_df(void) {
   console_write("files=");
-  console_write_uint16(vfs_count());
+  console_write_uint64(vfs_file_count());
+  console_write(" dirs=");
+  console_write_uint64(vfs_dir_count());
+  console_write(" nodes=");
+  console_write_uint64(vfs_count());
   console_write("/");
-  console_write_uint16(vfs_capacity());
+  console_write_uint64(vfs_capacity());
+  console_putc('\n');
+}
+
+static void handle_dcache(void) {
+  vfs_dcache_stats_t stats;
+  vfs_dcache_stats(&stats);
+  console_write("lookups=");
+  console_write_uint64(stats.lookups);
+  console_write(" hits=");
+  console_write_uint64(stats.hits);
+  console_write(" neg=");
+  console_write_uint64(stats.negative_hits);
+  console_write(" miss=");
+  console_write_uint64(stats.misses);
+  console_write(" uncached=");
+  console_write_uint64(stats.uncached);
+  console_putc('\n');
+  console_write("hit_rate=");
+  console_write_uint64(stats.lookups ? stats.hits * 100 / stats.lookups : 0);
+  console_write("% invalidations=");
+  console_write_uint64(stats.invalidations);
+  console_putc('\n');
+}
+
+static void handle_meminfo(void) {
+  uint64_t total = mm_total_frames();
+  uint64_t free = mm_free_frames();
+  console_write("frames=");
+  console_write_uint64(total);
+  console_write(" free=");
+  console_write_uint64(free);
+  console_write(" used=");
+  console_write_uint64(total - free);
+  console_putc('\n');
+  mm_vm_info_t vm;
+  mm_vm_info(&vm);
+  console_write("direct=");
+  console_write_uint64(vm.direct_bytes >> 20);
+  console_write("MiB page=");
+  console_write(vm.direct_page >= (1ull << 30) ? "1G" : "2M");
+  console_write(" kernel_pages=");
+  console_write_uint64(vm.kernel_pages);
+  console_write(" nx=");
+  console_write_uint16(vm.nx);
+  console_putc('\n');
+  for (uint8_t order = 0; order <= MM_MAX_ORDER; ++order) {
+    console_write("order=");
+    console_write_uint16(order);
+    console_write(" free=");
+    console_write_uint64(mm_order_free_blocks(order));
+    console_write(" used=");
+    console_write_uint64(mm_order_used_blocks(order));
+    console_putc('\n');
+  }
+}
+
+static void handle_slabinfo(void) {
+  heap_cache_stats_t stats;
+  for (uint32_t i = 0; heap_cache_stats(i, &stats) == 0; ++i) {
+    console_write(stats.name);
+    console_write(" size=");
+    console_write_uint64(stats.object_size);
+    console_write(" used=");
+    console_write_uint64(stats.objects_in_use);
+    console_putc('/');
+    console_write_uint64(stats.objects_total);
+    console_write(" slabs=");
+    console_write_uint64(stats.slabs);
+    console_write(" hit=");
+    console_write_uint64(stats.hits);
+    console_write(" miss=");
+    console_write_uint64(stats.misses);
+    console_putc('\n');
+  }
+  console_write("large pages=");
+  console_write_uint64(heap_large_pages());
   console_putc('\n');
 }
 
 static void handle_sched(void) {
   console_write("ticks=");
   console_write_uint64(timer_ticks());
+  console_write(" cpus=");
+  console_write_uint64(smp_cpu_count());
   console_write(" tasks=");
-  console_write_uint16(scheduler_count());
+  console_write_uint64(scheduler_count());
   console_write(" current=");
-  console_write_uint16(scheduler_current());
+  console_write_uint64(scheduler_current());
+  console_write(" switches=");
+  console_write_uint64(scheduler_switches());
+  console_write(" idle=");
+  console_write_uint16(scheduler_idle_percent());
+  console_write("% wakeups=");
+  console_write_uint64(scheduler_idle_wakeups());
+  console_write("/s nohz=");
+  console_write(timer_nohz() ? "on" : "off");
   console_write(" a=");
   console_write_uint64(task_a_runs);
   console_write(" b=");
@@ -240,11 +419,364 @@ static void handle_sched(void) {
   console_putc('\n');
 }
 
+static void handle_ps(void) {
+  scheduler_task_info_t info;
+  for (uint32_t i = 0; scheduler_task_info(i, &info) == 0; ++i) {
+    console_write("id=");
+    console_write_uint64(info.id);
+    console_write(" name=");
+    console_write(info.name);
+    console_write(" state=");
+    console_write(scheduler_state_name(info.state));
+    console_write(" prio=");
+    console_write_uint16(info.priority);
+    console_write("/");
+    console_write_uint16(info.base_priority);
+    console_write(" cpu=");
+    console_write_uint64(info.cpu);
+    console_write(" ticks=");
+    console_write_uint64(info.ticks);
+    console_putc('\n');
+  }
+}
+
+static void handle_cpus(void) {
+  scheduler_cpu_info_t info;
+  for (uint32_t i = 0; scheduler_cpu_info(i, &info) == 0; ++i) {
+    console_write("cpu=");
+    console_write_uint64(i);
+    console_write(" apic_id=");
+    console_write_uint64(smp_cpu(i)->apic_id);
+    console_write(" current=");
+    console_write_uint64(info.current_id);
+    console_putc('(');
+    console_write(info.current_name);
+    console_write(") ready=");
+    console_write_uint64(info.ready);
+    console_write(" switches=");
+    console_write_uint64(info.switches);
+    console_write(" steals=");
+    console_write_uint64(info.steals);
+    console_write(" handoffs=");
+    console_write_uint64(info.handoffs);
+    console_write(" idle=");
+    console_write_uint64(info.idle_ticks);
+    console_write(" irqoff_max=");
+    console_write_uint64(timer_cycles_to_ns(smp_cpu(i)->irqoff_max));
+    console_write_line("ns");
+  }
+}
+
+static uint64_t per_second(uint64_t count, uint64_t ns) {
+  return ns ? count * 1000000000ull / ns : 0;
+}
+
+/* TLB counters, with rates over the time since the previous "tlb" (or since boot). */
+static void handle_tlb(void) {
+  static mm_tlb_stats_t last;
+  static uint64_t last_ns;
+  mm_vm_info_t vm;
+  mm_vm_info(&vm);
+  mm_tlb_stats_t stats;
+  mm_tlb_stats(&stats);
+  uint64_t ns = timer_ns();
+  uint64_t elapsed = ns - last_ns;
+  console_write("pcid=");
+  console_write_uint16(vm.pcid);
+  console_write(" invpcid=");
+  console_write_uint16(vm.invpcid);
+  console_write(" global=");
+  console_write_uint16(vm.global);
+  console_putc('\n');
+  console_write("flushes=");
+  console_write_uint64(stats.flushes);
+  console_write(" full=");
+  console_write_uint64(stats.full);
+  console_write(" pages=");
+  console_write_uint64(stats.pages);
+  console_write(" shootdowns=");
+  console_write_uint64(stats.shootdowns);
+  console_write(" ipis=");
+  console_write_uint64(stats.ipis);
+  console_write(" switches=");
+  console_write_uint64(stats.switches);
+  console_write(" kept=");
+  console_write_uint64(stats.kept);
+  console_putc('\n');
+  console_write("flushes/s=");
+  console_write_uint64(per_second(stats.flushes - last.flushes, elapsed));
+  console_write(" shootdowns/s=");
+  console_write_uint64(per_second(stats.shootdowns - last.shootdowns, elapsed));
+  console_write(" interval=");
+  console_write_uint64(elapsed / 1000000);
+  console_write_line("ms");
+  last = stats;
+  last_ns = ns;
+}
+
+static void handle_work(void) {
+  workqueue_stats_t stats;
+  for (uint32_t i = 0; workqueue_stats(i, &stats) == 0; ++i) {
+    console_write("cpu=");
+    console_write_uint64(i);
+    console_write(" queued=");
+    console_write_uint64(stats.queued);
+    console_write(" executed=");
+    console_write_uint64(stats.executed);
+    console_write(" max_delay=");
+    console_write_uint64(timer_cycles_to_ns(stats.max_delay_cycles));
+    console_write_line("ns");
+  }
+}
+
+static void ipcbench_stream(uint8_t kind, uint32_t producers) {
+  ipc_bench_stream_t result;
+  if (ipc_bench_stream(kind, producers, IPCBENCH_MESSAGES / producers, &result) != 0) {
+    console_write_line("Nie mozna uruchomic testu IPC");
+    return;
+  }
+  uint64_t ns = timer_cycles_to_ns(result.cycles);
+  console_write(ipc_channel_kind_name(kind));
+  console_write(" producers=");
+  console_write_uint64(result.producers);
+  console_write(" msgs=");
+  console_write_uint64(result.messages);
+  console_write(" time=");
+  console_write_uint64(ns / 1000);
+  console_write("us rate=");
+  console_write_uint64(ns ? (uint64_t)result.messages * 1000000000ull / ns : 0);
+  console_write("/s rx_waits=");
+  console_write_uint64(result.rx_waits);
+  console_write(" tx_waits=");
+  console_write_uint64(result.tx_waits);
+  console_putc('\n');
+}
+
+static void ipcbench_rtt(const char *label, int rc, const ipc_bench_rtt_t *rtt, int show_direct) {
+  if (rc != 0) {
+    console_write_line("Nie mozna uruchomic testu IPC");
+    return;
+  }
+  uint64_t avg = rtt->total_cycles / rtt->rounds;
+  console_write(label);
+  console_write(" rounds=");
+  console_write_uint64(rtt->rounds);
+  console_write(" avg=");
+  console_write_uint64(avg);
+  console_write("cyc/");
+  console_write_uint64(timer_cycles_to_ns(avg));
+  console_write("ns min=");
+  console_write_uint64(rtt->min_cycles);
+  console_write("cyc max=");
+  console_write_uint64(rtt->max_cycles);
+  console_write("cyc");
+  if (show_direct) {
+    console_write(" direct=");
+    console_write_uint64(rtt->direct);
+  }
+  console_putc('\n');
+}
+
+static void ipcbench_grant(uint32_t pages) {
+  ipc_bench_grant_t result;
+  if (ipc_bench_grant(pages, IPCBENCH_GRANT_ROUNDS, &result) != 0) {
+    console_write_line("Nie mozna uruchomic testu IPC");
+    return;
+  }
+  uint64_t ns = timer_cycles_to_ns(result.cycles);
+  console_write("grant size=");
+  console_write_uint64(result.bytes / 1024);
+  console_write("KiB rounds=");
+  console_write_uint64(result.rounds);
+  console_write(" avg=");
+  console_write_uint64(result.cycles / result.rounds);
+  console_write("cyc rate=");
+  console_write_uint64(ns ? result.bytes * result.rounds * 1000 / ns : 0);
+  console_write_line("MB/s");
+}
+
+static void handle_ipcbench(void) {
+  ipcbench_stream(IPC_CHANNEL_SPSC, 1);
+  ipcbench_stream(IPC_CHANNEL_MPSC, IPCBENCH_PRODUCERS);
+  ipc_bench_rtt_t rtt;
+  int rc = ipc_bench_rtt(IPCBENCH_ROUNDS, &rtt);
+  ipcbench_rtt("rtt", rc, &rtt, 0);
+  rc = ipc_bench_call(IPCBENCH_ROUNDS, &rtt);
+  ipcbench_rtt("call", rc, &rtt, 1);
+  ipcbench_grant(1);
+  ipcbench_grant(16);
+  ipcbench_grant(256);
+  ipcbench_grant(1024);
+}
+
+static void handle_spin(void) {
+  int id = scheduler_add_task("spin", task_spin, 0);
+  if (id < 0) {
+    console_write_line("Nie mozna utworzyc zadania");
+    return;
+  }
+  console_write("id=");
+  console_write_uint64((uint64_t)id);
+  console_putc('\n');
+}
+
+static void handle_kill(const char *arg) {
+  uint16_t id = parse_u16(arg, 0);
+  int rc = scheduler_kill(id);
+  if (rc == -1) {
+    console_write_line("Brak takiego zadania");
+  } else if (rc < 0) {
+    console_write_line("Nie mozna zabic zadania");
+  }
+}
+
+static void console_write_int64(int64_t value) {
+  if (value < 0) {
+    console_putc('-');
+    console_write_uint64((uint64_t)-value);
+    return;
+  }
+  console_putc('+');
+  console_write_uint64((uint64_t)value);
+}
+
+static void handle_clock(void) {
+  uint64_t ns = timer_ns();
+  uint64_t ms = ns / 1000000;
+  console_write("uptime=");
+  console_write_uint64(ms / 1000);
+  console_putc('.');
+  uint64_t frac = ms % 1000;
+  console_putc((char)('0' + frac / 100));
+  console_putc((char)('0' + frac / 10 % 10));
+  console_putc((char)('0' + frac % 10));
+  console_write("s ticks=");
+  console_write_uint64(timer_ticks());
+  console_putc('\n');
+  if (!timer_tsc_hz()) {
+    console_write_line("Brak TSC, zegar ma rozdzielczosc tiku");
+    return;
+  }
+  console_write("tsc_hz=");
+  console_write_uint64(timer_tsc_hz());
+  console_write(" invariant=");
+  console_write(timer_tsc_invariant() ? "yes" : "no");
+  int64_t drift;
+  console_write(" drift_ppm=");
+  if (timer_drift_ppm(&drift) == 0) {
+    console_write_int64(drift);
+  } else {
+    console_write("n/a");
+  }
+  console_putc('\n');
+  uint64_t start = timer_cycles();
+  uint64_t end = timer_cycles();
+  console_write("read_cost_cycles=");
+  console_write_uint64(end - start);
+  console_putc('\n');
+}
+
+static void handle_apic(void) {
+  const acpi_info_t *acpi = acpi_info();
+  if (!acpi->present) {
+    console_write_line("Brak tablicy MADT (ACPI)");
+  } else {
+    console_write("cpus=");
+    console_write_uint64(acpi->cpu_count);
+    console_write(" lapic=0x");
+    console_write_hex64(acpi->lapic_base);
+    console_write(" ioapic=0x");
+    console_write_hex64(acpi->ioapic_base);
+    console_write(" irq0_gsi=");
+    console_write_uint64(acpi->isa[0].gsi);
+    console_write(" pic=");
+    console_write(acpi->legacy_pic ? "yes" : "no");
+    console_putc('\n');
+  }
+  console_write("mode=");
+  console_write(apic_active() ? "apic" : "pic");
+  console_write(" apic_id=");
+  console_write_uint64(apic_id());
+  console_write(" timer=");
+  console_write(timer_source());
+  if (apic_timer_hz()) {
+    console_write(" timer_hz=");
+    console_write_uint64(apic_timer_hz());
+  }
+  console_putc('\n');
+}
+
+static void handle_locks(const char *arg) {
+  if (streq(arg, "reset")) {
+    lock_stats_reset();
+    console_write_line("Statystyki blokad wyzerowane");
+    return;
+  }
+  lock_info_t top[LOCKS_SHOWN];
+  uint32_t shown = lock_top(top, LOCKS_SHOWN);
+  console_write("locks=");
+  console_write_uint64(lock_count());
+  console_putc('\n');
+  for (uint32_t i = 0; i < shown; ++i) {
+    console_write(top[i].name);
+    console_write(" kind=");
+    console_write(lock_kind_name(top[i].kind));
+    console_write(" acquired=");
+    console_write_uint64(top[i].acquired);
+    console_write(" contended=");
+    console_write_uint64(top[i].contended);
+    console_write(" max_hold=");
+    console_write_uint64(top[i].max_hold_cycles);
+    console_write("cyc/");
+    console_write_uint64(timer_cycles_to_ns(top[i].max_hold_cycles));
+    console_write_line("ns");
+  }
+}
+
+static void handle_timers(void) {
+  timer_wheel_stats_t stats;
+  timer_wheel_stats(&stats);
+  console_write("pending=");
+  console_write_uint64(stats.pending);
+  console_putc('/');
+  console_write_uint64(stats.capacity);
+  console_write(" fired=");
+  console_write_uint64(stats.fired);
+  console_write(" cascaded=");
+  console_write_uint64(stats.cascaded);
+  console_write(" next=");
+  if (stats.next_expiry == UINT64_MAX) {
+    console_write("none");
+  } else {
+    console_write_uint64(stats.next_expiry);
+  }
+  console_write(" now=");
+  console_write_uint64(timer_ticks());
+  console_putc('\n');
+}
+
+static void handle_serial(void) {
+  serial_stats_t stats;
+  serial_stats(&stats);
+  if (!stats.present) {
+    console_write_line("Brak portu COM1");
+    return;
+  }
+  console_write("tx=");
+  console_write_uint64(stats.tx_bytes);
+  console_write(" rx=");
+  console_write_uint64(stats.rx_bytes);
+  console_write(" dropped=");
+  console_write_uint64(stats.dropped);
+  console_write(" input_dropped=");
+  console_write_uint64(console_input_dropped());
+  console_putc('\n');
+}
 
 static void handle_step(const char *arg) {
   uint16_t steps = parse_u16(arg, 1);
   for (uint16_t i = 0; i < steps; ++i) {
-    scheduler_tick();
+    scheduler_sleep(1);
   }
   handle_sched();
 }
@@ -300,16 +832,12 @@ static void handle_ls_path(const char *arg, int current_dir) {
     console_write_line("Brak takiego katalogu");
     return;
   }
-  uint8_t count = vfs_list_count(dir);
-  if (count == 0) {
+  vfs_dir_cursor_t cursor;
+  if (vfs_opendir(dir, &cursor) != 0 || vfs_list_count(dir) == 0) {
     console_write_line("(pusto)");
     return;
   }
-  for (uint8_t i = 0; i < count; ++i) {
-    int node = vfs_list_at(dir, i);
-    if (node < 0) {
-      continue;
-    }
+  for (int node = vfs_readdir(&cursor); node >= 0; node = vfs_readdir(&cursor)) {
     const char *name = vfs_name(node);
     if (name) {
       if (vfs_is_dir(node)) {
@@ -379,7 +907,9 @@ static void handle_command(const char *command, int *current_dir) {
   }
   if (streq(cmd, "help")) {
     console_write_line("help  clear  about  ls  cat  echo  touch  rm  stat  df");
-    console_write_line("pwd  cd  mkdir  rmdir  sched  step");
+    console_write_line("pwd  cd  mkdir  rmdir  sched  step  ps  spin  kill");
+    console_write_line("meminfo  slabinfo  dcache  serial  clock  apic  timers  cpus  locks  work");
+    console_write_line("ipcbench  tlb");
     return;
   }
   if (streq(cmd, "clear")) {
@@ -418,10 +948,70 @@ static void handle_command(const char *command, int *current_dir) {
     handle_df();
     return;
   }
+  if (streq(cmd, "dcache")) {
+    handle_dcache();
+    return;
+  }
+  if (streq(cmd, "meminfo")) {
+    handle_meminfo();
+    return;
+  }
+  if (streq(cmd, "slabinfo")) {
+    handle_slabinfo();
+    return;
+  }
   if (streq(cmd, "sched")) {
     handle_sched();
     return;
   }
+  if (streq(cmd, "ps")) {
+    handle_ps();
+    return;
+  }
+  if (streq(cmd, "spin")) {
+    handle_spin();
+    return;
+  }
+  if (streq(cmd, "kill")) {
+    handle_kill(args);
+    return;
+  }
+  if (streq(cmd, "clock") || streq(cmd, "uptime")) {
+    handle_clock();
+    return;
+  }
+  if (streq(cmd, "apic")) {
+    handle_apic();
+    return;
+  }
+  if (streq(cmd, "cpus")) {
+    handle_cpus();
+    return;
+  }
+  if (streq(cmd, "work")) {
+    handle_work();
+    return;
+  }
+  if (streq(cmd, "ipcbench")) {
+    handle_ipcbench();
+    return;
+  }
+  if (streq(cmd, "tlb")) {
+    handle_tlb();
+    return;
+  }
+  if (streq(cmd, "locks")) {
+    handle_locks(args);
+    return;
+  }
+  if (streq(cmd, "timers")) {
+    handle_timers();
+    return;
+  }
+  if (streq(cmd, "serial")) {
+    handle_serial();
+    return;
+  }
   if (streq(cmd, "step")) {
     handle_step(args);
     return;
@@ -445,15 +1035,22 @@ static void handle_command(const char *command, int *current_dir) {
   console_write_line("Nieznana komenda");
 }
 
-void kernel_main(void) {
+void kernel_main(uint32_t boot_magic, uint64_t boot_info_addr) {
   console_init(0x1F);
+  serial_init();
   console_write_line("2026-OS kernel booted");
 
-  kernel_init();
+  static boot_info_t boot_info;
+  if (multiboot2_parse(boot_magic, boot_info_addr, &boot_info) != 0) {
+    console_write_line("Brak mapy pamieci od bootloadera");
+  }
+  kernel_init(&boot_info);
   keyboard_init();
 
-  scheduler_add_task(task_a);
-  scheduler_add_task(task_b);
+  scheduler_add_task("a", task_a, 0);
+  scheduler_add_task("b", task_b, 0);
+  uint64_t first_report = (timer_ticks() / TICK_REPORT_PERIOD + 1) * TICK_REPORT_PERIOD;
+  timer_add_periodic(first_report, TICK_REPORT_PERIOD, report_tick, 0);
 
   console_write_line("Init: ok");
 
@@ -462,7 +1059,11 @@ void kernel_main(void) {
   uint8_t len = 0;
   console_prompt();
   for (;;) {
-    char c = keyboard_getchar();
+    char c = console_getchar();
+    if (c == KEY_PAGE_UP || c == KEY_PAGE_DOWN) {
+      console_scroll(c == KEY_PAGE_UP ? SCROLL_PAGE : -SCROLL_PAGE);
+      continue;
+    }
     if (c == '\n') {
       command[len] = '\0';
       console_putc('\n');
@@ -1,4 +1,1138 @@
 #include "kernel/mm.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
 
-void mm_init(void) {
+/* mm_init runs on the boot page tables, which map only the first 1 GiB; frames above it are not managed. */
+#define MM_DIRECT_MAP_LIMIT 0x40000000ull
+#define MM_LOW_MEMORY_LIMIT 0x100000ull
+#define MM_FRAME_NONE 0xFFFFFFFFu
+
+#define MM_FRAME_RESERVED 0
+#define MM_FRAME_FREE 1
+#define MM_FRAME_ALLOCATED 2
+
+#define MM_RESERVED_MAX 4
+
+#define PTE_PRESENT 0x001ull
+#define PTE_WRITE 0x002ull
+#define PTE_USER 0x004ull
+#define PTE_PWT 0x008ull
+#define PTE_PCD 0x010ull
+#define PTE_HUGE 0x080ull
+#define PTE_GLOBAL 0x100ull
+#define PTE_NX 0x8000000000000000ull
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ull
+
+/* Levels count up from the page table (0) to the PML4 (3); a leaf at level n maps MM_LEVEL_SIZE(n) bytes. */
+#define MM_TABLE_ENTRIES 512
+#define MM_LEVEL_SIZE(level) (1ull << (MM_PAGE_SHIFT + 9 * (level)))
+#define MM_LEVEL_INDEX(virt, level) ((uint32_t)(((virt) >> (MM_PAGE_SHIFT + 9 * (level))) & 0x1FF))
+
+#define EFER_MSR 0xC0000080
+#define EFER_NXE 0x800ull
+#define CR0_WP 0x10000ull
+#define CR4_PGE 0x80ull
+#define CR4_PCIDE 0x20000ull
+/* Set in a CR3 write to keep the TLB entries tagged with the new PCID. */
+#define CR3_NOFLUSH 0x8000000000000000ull
+#define CPUID_PGE (1u << 13)
+#define CPUID_PCID (1u << 17)
+#define CPUID_INVPCID (1u << 10)
+#define CPUID_EXT_NX (1u << 20)
+#define CPUID_EXT_GBPAGES (1u << 26)
+#define INVPCID_CONTEXT 1
+#define INVPCID_ALL 2
+
+/* PCID 0 is the kernel space's; the others go to spaces as they are created. */
+#define MM_PCID_COUNT 4096
+
+/* One descriptor per physical frame; only the head frame of a block is meaningful. */
+typedef struct {
+  uint32_t next;
+  uint32_t prev;
+  uint8_t order;
+  uint8_t state;
+  uint16_t reserved;
+} mm_frame_t;
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+} mm_range_t;
+
+/* Page-aligned section boundaries from linker.ld. */
+extern char _kernel_start[];
+extern char _text_start[];
+extern char _text_end[];
+extern char _rodata_end[];
+extern char _kernel_end[];
+
+/* Guards the free lists and counters once the allocator is up; mm_init runs alone. */
+static spinlock_t mm_lock = SPINLOCK_INIT("mm");
+/* Guards page table edits; taken before mm_lock, which new tables come from. */
+static spinlock_t map_lock = SPINLOCK_INIT("mm-map");
+static mm_frame_t *mm_frames = 0;
+static uint32_t mm_frame_count = 0;
+static uint32_t mm_free_heads[MM_MAX_ORDER + 1];
+static uint32_t mm_free_mask = 0;
+static uint32_t mm_free_blocks[MM_MAX_ORDER + 1];
+static uint32_t mm_used_blocks[MM_MAX_ORDER + 1];
+static uint64_t mm_managed = 0;
+static uint64_t mm_free_count = 0;
+
+static mm_range_t mm_reserved[MM_RESERVED_MAX];
+static uint8_t mm_reserved_count = 0;
+
+static mm_space_t mm_kernel;
+/* PTE_NX once EFER.NXE is on; the bit is reserved (and faults) before that. */
+static uint64_t mm_nx = 0;
+/* PTE_GLOBAL for kernel-half leaves once CR4.PGE is on, so they survive address-space switches. */
+static uint64_t mm_global = 0;
+static uint8_t mm_gbpages = 0;
+static uint8_t mm_pcid = 0;
+static uint8_t mm_invpcid = 0;
+static uint64_t mm_pcid_used[MM_PCID_COUNT / 64];
+/* The space each CPU runs on; only that CPU writes its slot. */
+static mm_space_t *mm_current[SMP_MAX_CPUS];
+
+typedef struct {
+  uint64_t flushes;
+  uint64_t full;
+  uint64_t pages;
+  uint64_t shootdowns;
+  uint64_t ipis;
+  uint64_t switches;
+  uint64_t kept;
+} __attribute__((aligned(64))) mm_tlb_cpu_t;
+
+/* Written only by their own CPU with interrupts off, summed by mm_tlb_stats(). */
+static mm_tlb_cpu_t mm_tlb_cpu[SMP_MAX_CPUS];
+static uint64_t mm_direct_bytes = 0;
+static uint64_t mm_direct_page = 0;
+static uint32_t mm_kernel_pages = 0;
+
+static uint64_t mm_align_up(uint64_t value, uint64_t align) {
+  return (value + align - 1) & ~(align - 1);
+}
+
+static uint64_t mm_align_down(uint64_t value, uint64_t align) {
+  return value & ~(align - 1);
+}
+
+static void mm_list_push(uint32_t pfn, uint8_t order) {
+  mm_frame_t *frame = &mm_frames[pfn];
+  uint32_t head = mm_free_heads[order];
+  frame->next = head;
+  frame->prev = MM_FRAME_NONE;
+  frame->order = order;
+  frame->state = MM_FRAME_FREE;
+  if (head != MM_FRAME_NONE) {
+    mm_frames[head].prev = pfn;
+  }
+  mm_free_heads[order] = pfn;
+  mm_free_mask |= 1u << order;
+  mm_free_blocks[order]++;
+}
+
+static void mm_list_remove(uint32_t pfn, uint8_t order) {
+  mm_frame_t *frame = &mm_frames[pfn];
+  if (frame->prev != MM_FRAME_NONE) {
+    mm_frames[frame->prev].next = frame->next;
+  } else {
+    mm_free_heads[order] = frame->next;
+  }
+  if (frame->next != MM_FRAME_NONE) {
+    mm_frames[frame->next].prev = frame->prev;
+  }
+  frame->next = MM_FRAME_NONE;
+  frame->prev = MM_FRAME_NONE;
+  frame->state = MM_FRAME_RESERVED;
+  if (mm_free_heads[order] == MM_FRAME_NONE) {
+    mm_free_mask &= ~(1u << order);
+  }
+  mm_free_blocks[order]--;
+}
+
+/* Inserts a free block and merges it with its buddy as long as the buddy is free too. */
+static void mm_free_block(uint32_t pfn, uint8_t order) {
+  mm_frames[pfn].state = MM_FRAME_RESERVED;
+  while (order < MM_MAX_ORDER) {
+    uint32_t buddy = pfn ^ (1u << order);
+    if (buddy >= mm_frame_count || mm_frames[buddy].state != MM_FRAME_FREE ||
+        mm_frames[buddy].order != order) {
+      break;
+    }
+    mm_list_remove(buddy, order);
+    if (buddy < pfn) {
+      pfn = buddy;
+    }
+    order++;
+  }
+  mm_list_push(pfn, order);
+}
+
+static void mm_add_free_range(uint64_t start, uint64_t end) {
+  uint32_t pfn = (uint32_t)(start >> MM_PAGE_SHIFT);
+  uint32_t last = (uint32_t)(end >> MM_PAGE_SHIFT);
+  while (pfn < last) {
+    uint8_t order = 0;
+    while (order < MM_MAX_ORDER && (pfn & ((2u << order) - 1)) == 0 &&
+           pfn + (2u << order) <= last) {
+      order++;
+    }
+    mm_free_block(pfn, order);
+    mm_managed += 1ull << order;
+    mm_free_count += 1ull << order;
+    pfn += 1u << order;
+  }
+}
+
+/* Adds [start, end) to the allocator minus every reserved range it overlaps. */
+static void mm_add_region(uint64_t start, uint64_t end, uint8_t first_reserved) {
+  for (uint8_t i = first_reserved; i < mm_reserved_count; ++i) {
+    const mm_range_t *r = &mm_reserved[i];
+    if (r->end <= start || r->start >= end) {
+      continue;
+    }
+    if (r->start > start) {
+      mm_add_region(start, r->start, (uint8_t)(i + 1));
+    }
+    if (r->end < end) {
+      mm_add_region(r->end, end, (uint8_t)(i + 1));
+    }
+    return;
+  }
+  start = mm_align_up(start, MM_PAGE_SIZE);
+  end = mm_align_down(end, MM_PAGE_SIZE);
+  if (start < end) {
+    mm_add_free_range(start, end);
+  }
+}
+
+static void mm_reserve(uint64_t start, uint64_t end) {
+  if (start >= end || mm_reserved_count >= MM_RESERVED_MAX) {
+    return;
+  }
+  mm_reserved[mm_reserved_count].start = mm_align_down(start, MM_PAGE_SIZE);
+  mm_reserved[mm_reserved_count].end = mm_align_up(end, MM_PAGE_SIZE);
+  mm_reserved_count++;
+}
+
+static int mm_overlaps_reserved(uint64_t start, uint64_t end) {
+  for (uint8_t i = 0; i < mm_reserved_count; ++i) {
+    if (mm_reserved[i].start < end && mm_reserved[i].end > start) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Finds room for the frame descriptor array in available memory, away from reserved ranges. */
+static uint64_t mm_place_frames(const boot_info_t *boot, uint64_t bytes) {
+  for (uint32_t i = 0; i < boot->memory_count; ++i) {
+    const boot_memory_region_t *region = &boot->memory[i];
+    if (region->type != BOOT_MEMORY_AVAILABLE) {
+      continue;
+    }
+    uint64_t start = mm_align_up(region->base, MM_PAGE_SIZE);
+    uint64_t end = region->base + region->length;
+    if (end > MM_DIRECT_MAP_LIMIT) {
+      end = MM_DIRECT_MAP_LIMIT;
+    }
+    while (start + bytes <= end) {
+      if (!mm_overlaps_reserved(start, start + bytes)) {
+        return start;
+      }
+      uint64_t next = end;
+      for (uint8_t r = 0; r < mm_reserved_count; ++r) {
+        if (mm_reserved[r].start < start + bytes && mm_reserved[r].end > start &&
+            mm_reserved[r].end < next) {
+          next = mm_reserved[r].end;
+        }
+      }
+      start = mm_align_up(next, MM_PAGE_SIZE);
+    }
+  }
+  return 0;
+}
+
+void mm_init(const boot_info_t *boot) {
+  for (uint8_t order = 0; order <= MM_MAX_ORDER; ++order) {
+    mm_free_heads[order] = MM_FRAME_NONE;
+    mm_free_blocks[order] = 0;
+    mm_used_blocks[order] = 0;
+  }
+  mm_free_mask = 0;
+  mm_managed = 0;
+  mm_free_count = 0;
+  mm_frame_count = 0;
+  mm_reserved_count = 0;
+  if (!boot || boot->memory_count == 0) {
+    return;
+  }
+
+  uint64_t top = 0;
+  for (uint32_t i = 0; i < boot->memory_count; ++i) {
+    const boot_memory_region_t *region = &boot->memory[i];
+    uint64_t end = region->base + region->length;
+    if (region->type == BOOT_MEMORY_AVAILABLE && end > top) {
+      top = end;
+    }
+  }
+  if (top > MM_DIRECT_MAP_LIMIT) {
+    top = MM_DIRECT_MAP_LIMIT;
+  }
+  mm_frame_count = (uint32_t)(top >> MM_PAGE_SHIFT);
+
+  mm_reserve(0, MM_LOW_MEMORY_LIMIT);
+  mm_reserve(mm_virt_to_phys(_kernel_start), mm_virt_to_phys(_kernel_end));
+  mm_reserve(boot->info_start, boot->info_end);
+
+  uint64_t frames_bytes = mm_align_up((uint64_t)mm_frame_count * sizeof(mm_frame_t), MM_PAGE_SIZE);
+  uint64_t frames_phys = mm_place_frames(boot, frames_bytes);
+  if (frames_phys == 0) {
+    mm_frame_count = 0;
+    return;
+  }
+  mm_reserve(frames_phys, frames_phys + frames_bytes);
+  mm_frames = (mm_frame_t *)mm_phys_to_virt(frames_phys);
+  for (uint32_t pfn = 0; pfn < mm_frame_count; ++pfn) {
+    mm_frames[pfn].next = MM_FRAME_NONE;
+    mm_frames[pfn].prev = MM_FRAME_NONE;
+    mm_frames[pfn].order = 0;
+    mm_frames[pfn].state = MM_FRAME_RESERVED;
+    mm_frames[pfn].reserved = 0;
+  }
+
+  for (uint32_t i = 0; i < boot->memory_count; ++i) {
+    const boot_memory_region_t *region = &boot->memory[i];
+    if (region->type != BOOT_MEMORY_AVAILABLE) {
+      continue;
+    }
+    uint64_t start = region->base;
+    uint64_t end = region->base + region->length;
+    if (end > top) {
+      end = top;
+    }
+    if (start < end) {
+      mm_add_region(start, end, 0);
+    }
+  }
+}
+
+uint64_t mm_alloc_pages(uint8_t order) {
+  if (order > MM_MAX_ORDER) {
+    return 0;
+  }
+  uint64_t flags = spin_lock_irqsave(&mm_lock);
+  uint32_t candidates = mm_free_mask >> order;
+  if (candidates == 0) {
+    spin_unlock_irqrestore(&mm_lock, flags);
+    return 0;
+  }
+  uint8_t found = (uint8_t)(order + __builtin_ctz(candidates));
+  uint32_t pfn = mm_free_heads[found];
+  mm_list_remove(pfn, found);
+  while (found > order) {
+    found--;
+    mm_list_push(pfn + (1u << found), found);
+  }
+  mm_frames[pfn].order = order;
+  mm_frames[pfn].state = MM_FRAME_ALLOCATED;
+  mm_used_blocks[order]++;
+  mm_free_count -= 1ull << order;
+  spin_unlock_irqrestore(&mm_lock, flags);
+  return (uint64_t)pfn << MM_PAGE_SHIFT;
+}
+
+int mm_free_pages(uint64_t phys, uint8_t order) {
+  if ((phys & (MM_PAGE_SIZE - 1)) != 0 || order > MM_MAX_ORDER) {
+    return -1;
+  }
+  uint64_t pfn = phys >> MM_PAGE_SHIFT;
+  if (pfn >= mm_frame_count) {
+    return -2;
+  }
+  uint64_t flags = spin_lock_irqsave(&mm_lock);
+  mm_frame_t *frame = &mm_frames[pfn];
+  if (frame->state != MM_FRAME_ALLOCATED || frame->order != order) {
+    spin_unlock_irqrestore(&mm_lock, flags);
+    return -3;
+  }
+  mm_used_blocks[order]--;
+  mm_free_count += 1ull << order;
+  mm_free_block((uint32_t)pfn, order);
+  spin_unlock_irqrestore(&mm_lock, flags);
+  return 0;
+}
+
+uint64_t mm_alloc_page(void) {
+  return mm_alloc_pages(0);
+}
+
+int mm_free_page(uint64_t phys) {
+  return mm_free_pages(phys, 0);
+}
+
+uint64_t mm_total_frames(void) {
+  return mm_managed;
+}
+
+uint64_t mm_free_frames(void) {
+  return mm_free_count;
+}
+
+uint32_t mm_order_free_blocks(uint8_t order) {
+  if (order > MM_MAX_ORDER) {
+    return 0;
+  }
+  return mm_free_blocks[order];
+}
+
+uint32_t mm_order_used_blocks(uint8_t order) {
+  if (order > MM_MAX_ORDER) {
+    return 0;
+  }
+  return mm_used_blocks[order];
+}
+
+static uint64_t mm_read_cr3(void) {
+  uint64_t cr3;
+  __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+  return cr3 & PTE_ADDR_MASK;
+}
+
+static uint64_t mm_table_alloc(void) {
+  uint64_t page = mm_alloc_page();
+  if (page) {
+    uint64_t *table = (uint64_t *)mm_phys_to_virt(page);
+    for (uint32_t i = 0; i < MM_TABLE_ENTRIES; ++i) {
+      table[i] = 0;
+    }
+  }
+  return page;
+}
+
+static uint64_t *mm_table(uint64_t entry) {
+  return (uint64_t *)mm_phys_to_virt(entry & PTE_ADDR_MASK);
+}
+
+/* Tables in the user half carry the user bit so that leaf entries alone decide access. */
+static uint64_t mm_table_bits(uint64_t virt) {
+  return PTE_PRESENT | PTE_WRITE | (virt < MM_KERNEL_HALF ? PTE_USER : 0);
+}
+
+static uint64_t mm_leaf_bits(uint32_t flags) {
+  uint64_t bits = PTE_PRESENT;
+  if (flags & MM_MAP_WRITE) {
+    bits |= PTE_WRITE;
+  }
+  if (flags & MM_MAP_USER) {
+    bits |= PTE_USER;
+  }
+  if (flags & MM_MAP_UNCACHED) {
+    bits |= PTE_PWT | PTE_PCD;
+  }
+  if (!(flags & MM_MAP_EXEC)) {
+    bits |= mm_nx;
+  }
+  return bits;
+}
+
+static uint64_t mm_leaf_phys(uint64_t entry, uint32_t level) {
+  return entry & PTE_ADDR_MASK & ~(MM_LEVEL_SIZE(level) - 1);
+}
+
+/*
+ * Walks from the PML4 towards the entry for virt at the given level (0 is
+ * the PT), allocating missing tables when create is set. A large page, or
+ * a missing table when create is off, ends the walk early; *reached is the
+ * level of the entry returned. Returns 0 only when no frame was left for a
+ * new table.
+ */
+static uint64_t *mm_walk(uint64_t pml4, uint64_t virt, uint32_t level, int create, uint32_t *reached) {
+  uint64_t *table = (uint64_t *)mm_phys_to_virt(pml4);
+  for (uint32_t at = 3; at > level; --at) {
+    uint64_t *entry = &table[MM_LEVEL_INDEX(virt, at)];
+    if (!(*entry & PTE_PRESENT)) {
+      if (!create) {
+        *reached = at;
+        return entry;
+      }
+      uint64_t page = mm_table_alloc();
+      if (!page) {
+        return 0;
+      }
+      *entry = page | mm_table_bits(virt);
+    } else if (*entry & PTE_HUGE) {
+      *reached = at;
+      return entry;
+    }
+    table = mm_table(*entry);
+  }
+  *reached = level;
+  return &table[MM_LEVEL_INDEX(virt, level)];
+}
+
+/* Replaces a large page with a table of the next smaller pages mapping the same memory. */
+static int mm_split(uint64_t *entry, uint32_t level, uint64_t virt) {
+  uint64_t page = mm_table_alloc();
+  if (!page) {
+    return -1;
+  }
+  uint64_t *table = (uint64_t *)mm_phys_to_virt(page);
+  uint64_t phys = mm_leaf_phys(*entry, level);
+  uint64_t bits = (*entry & (PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_PWT | PTE_PCD | PTE_GLOBAL | PTE_NX)) |
+                  (level > 1 ? PTE_HUGE : 0);
+  for (uint32_t i = 0; i < MM_TABLE_ENTRIES; ++i) {
+    table[i] = (phys + i * MM_LEVEL_SIZE(level - 1)) | bits;
+  }
+  *entry = page | mm_table_bits(virt);
+  return 0;
+}
+
+/* Largest page size, as a level, that virt and phys are both aligned to and that fits in left bytes. */
+static uint32_t mm_map_level(uint64_t virt, uint64_t phys, uint64_t left) {
+  uint32_t level = mm_gbpages ? 2 : 1;
+  while (level > 0 && (((virt | phys) & (MM_LEVEL_SIZE(level) - 1)) != 0 || left < MM_LEVEL_SIZE(level))) {
+    level--;
+  }
+  return level;
+}
+
+static uint64_t mm_kernel_bits(uint64_t virt) {
+  return virt >= MM_KERNEL_HALF ? mm_global : 0;
+}
+
+/* Records that the page of the given level at addr changed; merges it into the last range when adjacent. */
+static void mm_tlb_batch_add(mm_tlb_batch_t *batch, uint64_t addr, uint32_t level) {
+  uint8_t shift = (uint8_t)(MM_PAGE_SHIFT + 9 * level);
+  uint64_t end = addr + MM_LEVEL_SIZE(level);
+  if (addr >= MM_KERNEL_HALF) {
+    batch->global = 1;
+  } else {
+    batch->user = 1;
+  }
+  batch->pages++;
+  if (batch->full) {
+    return;
+  }
+  if (batch->count > 0) {
+    struct mm_tlb_range *last = &batch->ranges[batch->count - 1];
+    if (last->shift == shift && last->end == addr) {
+      last->end = end;
+      batch->full = batch->pages > MM_TLB_FLUSH_CEILING;
+      return;
+    }
+  }
+  if (batch->count == MM_TLB_BATCH_RANGES || batch->pages > MM_TLB_FLUSH_CEILING) {
+    batch->full = 1;
+    return;
+  }
+  batch->ranges[batch->count].start = addr;
+  batch->ranges[batch->count].end = end;
+  batch->ranges[batch->count].shift = shift;
+  batch->count++;
+}
+
+/*
+ * Clears (bits == 0) or rewrites with bits every mapping in the page
+ * aligned range [virt, end), splitting large pages that straddle either
+ * end, and records each changed entry in batch (if any) for a later
+ * flush. Returns -1 if a large page could not be split; the range before
+ * it has been changed by then.
+ */
+static int mm_update_locked(uint64_t pml4, uint64_t virt, uint64_t end, uint64_t bits, mm_tlb_batch_t *batch) {
+  uint64_t addr = virt;
+  while (addr < end) {
+    uint32_t level;
+    uint64_t *entry = mm_walk(pml4, addr, 0, 0, &level);
+    uint64_t base = mm_align_down(addr, MM_LEVEL_SIZE(level));
+    uint64_t last = base + MM_LEVEL_SIZE(level) - 1;
+    uint64_t next = last + 1 > base ? last + 1 : end;
+    if (!(*entry & PTE_PRESENT)) {
+      addr = next;
+      continue;
+    }
+    if (base < virt || last > end - 1) {
+      if (mm_split(entry, level, addr) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    *entry = bits ? mm_leaf_phys(*entry, level) | bits | mm_kernel_bits(base) | (level > 0 ? PTE_HUGE : 0) : 0;
+    if (batch) {
+      mm_tlb_batch_add(batch, base, level);
+    }
+    addr = next;
+  }
+  return 0;
+}
+
+/*
+ * Maps [virt, virt + size) to phys with the largest pages alignment allows.
+ * Smaller pages already mapped inside the range are left alone and mapped
+ * around; overlapping an existing mapping fails. On failure nothing new is
+ * left mapped.
+ */
+static int mm_map_locked(uint64_t pml4, uint64_t virt, uint64_t phys, uint64_t size, uint64_t bits) {
+  uint64_t offset = 0;
+  while (offset < size) {
+    uint32_t level = mm_map_level(virt + offset, phys + offset, size - offset);
+    uint32_t reached;
+    uint64_t *entry = mm_walk(pml4, virt + offset, level, 1, &reached);
+    while (entry && reached == level && level > 0 && (*entry & PTE_PRESENT) && !(*entry & PTE_HUGE)) {
+      level--;
+      entry = mm_walk(pml4, virt + offset, level, 1, &reached);
+    }
+    if (!entry || reached != level || (*entry & PTE_PRESENT)) {
+      mm_update_locked(pml4, virt, virt + offset, 0, 0);
+      return -1;
+    }
+    *entry = (phys + offset) | bits | mm_kernel_bits(virt + offset) | (level > 0 ? PTE_HUGE : 0);
+    offset += MM_LEVEL_SIZE(level);
+  }
+  return 0;
+}
+
+static uint64_t mm_read_cr4(void) {
+  uint64_t cr4;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static void mm_write_cr4(uint64_t cr4) {
+  __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static void mm_reload_cr3(void) {
+  uint64_t cr3;
+  __asm__ volatile("mov %%cr3, %0\n\tmov %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
+static void mm_invpcid_flush(uint64_t type, uint64_t pcid) {
+  struct {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc = {pcid, 0};
+  __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+/* Drops every TLB entry on this CPU, global ones and those of other PCIDs included. */
+static void mm_flush_all(void) {
+  if (mm_invpcid) {
+    mm_invpcid_flush(INVPCID_ALL, 0);
+  } else if (mm_global) {
+    uint64_t cr4 = mm_read_cr4();
+    mm_write_cr4(cr4 & ~CR4_PGE);
+    mm_write_cr4(cr4);
+  } else {
+    mm_reload_cr3();
+  }
+}
+
+/* Drops the non-global entries of the space this CPU runs on. */
+static void mm_flush_space(const mm_space_t *space) {
+  if (mm_invpcid) {
+    mm_invpcid_flush(INVPCID_CONTEXT, space->pcid);
+  } else {
+    mm_reload_cr3();
+  }
+}
+
+/*
+ * Applies a batch to this CPU's TLB, with interrupts off. User-half
+ * entries only matter if the CPU runs on the batch's space; otherwise the
+ * stale bit set by mm_tlb_batch_flush() makes the next switch to the
+ * space drop them.
+ */
+static void mm_tlb_flush_local(const mm_tlb_batch_t *batch) {
+  uint32_t cpu = smp_cpu_index();
+  int live = mm_current[cpu] == batch->space;
+  if (live && batch->user) {
+    __atomic_and_fetch(&batch->space->stale, ~(1u << cpu), __ATOMIC_SEQ_CST);
+  }
+  if (!live && !batch->global) {
+    return;
+  }
+  mm_tlb_cpu_t *stats = &mm_tlb_cpu[cpu];
+  stats->flushes++;
+  if (batch->full) {
+    stats->full++;
+    if (batch->global) {
+      mm_flush_all();
+    } else {
+      mm_flush_space(batch->space);
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < batch->count; ++i) {
+    const struct mm_tlb_range *range = &batch->ranges[i];
+    if (range->start < MM_KERNEL_HALF && !live) {
+      continue;
+    }
+    /* One invlpg anywhere in a large page drops all of it; end may have wrapped to 0 at the top. */
+    for (uint64_t addr = range->start; addr != range->end; addr += 1ull << range->shift) {
+      __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+      stats->pages++;
+    }
+  }
+}
+
+static void mm_tlb_flush_remote(void *arg) {
+  mm_tlb_flush_local((const mm_tlb_batch_t *)arg);
+}
+
+void mm_tlb_batch_init(mm_tlb_batch_t *batch, mm_space_t *space) {
+  batch->space = space;
+  batch->count = 0;
+  batch->pages = 0;
+  batch->full = 0;
+  batch->user = 0;
+  batch->global = 0;
+}
+
+/*
+ * Applies the batch on every CPU whose TLB may hold its entries and waits
+ * for them: kernel-half changes go to every CPU, user-half ones only to
+ * the CPUs running on the space, all with one shootdown round (see
+ * smp_tlb_shootdown()). Leaves the batch empty for reuse. Must not be
+ * called with a spinlock held.
+ */
+void mm_tlb_batch_flush(mm_tlb_batch_t *batch) {
+  if (batch->pages == 0) {
+    return;
+  }
+  uint64_t irq = interrupts_save();
+  if (batch->user) {
+    __atomic_or_fetch(&batch->space->stale, ~0u, __ATOMIC_SEQ_CST);
+  }
+  mm_tlb_flush_local(batch);
+  uint32_t targets = batch->global ? ~0u : __atomic_load_n(&batch->space->active, __ATOMIC_SEQ_CST);
+  uint32_t ipis = smp_tlb_shootdown(targets, mm_tlb_flush_remote, batch);
+  if (ipis) {
+    mm_tlb_cpu_t *stats = &mm_tlb_cpu[smp_cpu_index()];
+    stats->shootdowns++;
+    stats->ipis += ipis;
+  }
+  interrupts_restore(irq);
+  mm_tlb_batch_init(batch, batch->space);
+}
+
+void mm_tlb_stats(mm_tlb_stats_t *out) {
+  out->flushes = 0;
+  out->full = 0;
+  out->pages = 0;
+  out->shootdowns = 0;
+  out->ipis = 0;
+  out->switches = 0;
+  out->kept = 0;
+  for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+    const mm_tlb_cpu_t *cpu = &mm_tlb_cpu[i];
+    out->flushes += cpu->flushes;
+    out->full += cpu->full;
+    out->pages += cpu->pages;
+    out->shootdowns += cpu->shootdowns;
+    out->ipis += cpu->ipis;
+    out->switches += cpu->switches;
+    out->kept += cpu->kept;
+  }
+}
+
+/* Turns on the CR4 features the kernel page tables were built for, on the calling CPU. */
+static void mm_cpu_features(void) {
+  uint64_t cr4 = mm_read_cr4();
+  if (mm_global) {
+    cr4 |= CR4_PGE;
+  }
+  if (mm_pcid) {
+    cr4 |= CR4_PCIDE;
+  }
+  mm_write_cr4(cr4);
+}
+
+/* Sorts ranges by start and merges overlapping or touching ones; returns the new count. */
+static uint32_t mm_merge_ranges(mm_range_t *ranges, uint32_t count) {
+  for (uint32_t i = 1; i < count; ++i) {
+    mm_range_t range = ranges[i];
+    uint32_t j = i;
+    while (j > 0 && ranges[j - 1].start > range.start) {
+      ranges[j] = ranges[j - 1];
+      j--;
+    }
+    ranges[j] = range;
+  }
+  uint32_t merged = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (merged > 0 && ranges[i].start <= ranges[merged - 1].end) {
+      if (ranges[i].end > ranges[merged - 1].end) {
+        ranges[merged - 1].end = ranges[i].end;
+      }
+      continue;
+    }
+    ranges[merged++] = ranges[i];
+  }
+  return merged;
+}
+
+/*
+ * Maps the first 1 MiB (BIOS data, EBDA, VGA text memory, the RSDP search
+ * area) and every RAM, ACPI and NVS region at MM_DIRECT_BASE. Holes between
+ * them stay unmapped, so device registers are never reached through a
+ * write-back mapping; mm_map_mmio() maps them uncached on demand. Without
+ * a memory map the first MM_DIRECT_MAP_LIMIT bytes are mapped, as on the
+ * boot tables.
+ */
+static int mm_map_direct(uint64_t pml4, const boot_info_t *boot) {
+  mm_range_t ranges[BOOT_MEMORY_MAX + 1];
+  uint32_t count = 0;
+  ranges[count].start = 0;
+  ranges[count].end = boot && boot->memory_count ? MM_LOW_MEMORY_LIMIT : MM_DIRECT_MAP_LIMIT;
+  count++;
+  for (uint32_t i = 0; boot && i < boot->memory_count && i < BOOT_MEMORY_MAX; ++i) {
+    const boot_memory_region_t *region = &boot->memory[i];
+    if (region->length == 0 ||
+        (region->type != BOOT_MEMORY_AVAILABLE && region->type != BOOT_MEMORY_ACPI &&
+         region->type != BOOT_MEMORY_NVS)) {
+      continue;
+    }
+    ranges[count].start = mm_align_down(region->base, MM_PAGE_SIZE);
+    ranges[count].end = mm_align_up(region->base + region->length, MM_PAGE_SIZE);
+    count++;
+  }
+  count = mm_merge_ranges(ranges, count);
+  mm_direct_bytes = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint64_t size = ranges[i].end - ranges[i].start;
+    if (mm_map_locked(pml4, MM_DIRECT_BASE + ranges[i].start, ranges[i].start, size,
+                      PTE_PRESENT | PTE_WRITE | mm_nx) != 0) {
+      return -1;
+    }
+    mm_direct_bytes += size;
+  }
+  return 0;
+}
+
+/*
+ * Fills a fresh PML4 with the kernel half: the direct map and the kernel
+ * image. The direct-map alias of text and rodata is made read-only and not
+ * executable too, so the image cannot be patched or run from there.
+ */
+static int mm_vm_build(uint64_t pml4, const boot_info_t *boot) {
+  /* Every kernel-half PDPT exists up front, so a new space copies the upper PML4 half once and sees later kernel mappings. */
+  uint64_t *root = (uint64_t *)mm_phys_to_virt(pml4);
+  for (uint32_t i = MM_TABLE_ENTRIES / 2; i < MM_TABLE_ENTRIES; ++i) {
+    uint64_t page = mm_table_alloc();
+    if (!page) {
+      return -1;
+    }
+    root[i] = page | PTE_PRESENT | PTE_WRITE;
+  }
+
+  uint64_t image = (uint64_t)_kernel_start;
+  uint64_t text = (uint64_t)_text_start;
+  uint64_t rodata = (uint64_t)_text_end;
+  uint64_t data = (uint64_t)_rodata_end;
+  uint64_t end = (uint64_t)_kernel_end;
+  if (mm_map_direct(pml4, boot) != 0 ||
+      mm_update_locked(pml4, MM_DIRECT_BASE + (text - MM_KERNEL_BASE), MM_DIRECT_BASE + (data - MM_KERNEL_BASE),
+                       PTE_PRESENT | mm_nx, 0) != 0 ||
+      mm_map_locked(pml4, image, image - MM_KERNEL_BASE, text - image, PTE_PRESENT | mm_nx) != 0 ||
+      mm_map_locked(pml4, text, text - MM_KERNEL_BASE, rodata - text, PTE_PRESENT) != 0 ||
+      mm_map_locked(pml4, rodata, rodata - MM_KERNEL_BASE, data - rodata, PTE_PRESENT | mm_nx) != 0 ||
+      mm_map_locked(pml4, data, data - MM_KERNEL_BASE, end - data, PTE_PRESENT | PTE_WRITE | mm_nx) != 0) {
+    return -1;
+  }
+  mm_kernel_pages = (uint32_t)((end - image) >> MM_PAGE_SHIFT);
+  return 0;
+}
+
+/*
+ * Builds the kernel page tables and switches to them: RAM and firmware
+ * memory at MM_DIRECT_BASE with 1 GiB pages where the CPU has them (2 MiB
+ * otherwise), and the kernel image at MM_KERNEL_BASE with 4 KiB pages so
+ * text is read-only, rodata read-only and not executable, and data and bss
+ * not executable. Turns on EFER.NXE and CR0.WP so the kernel is held to
+ * these protections too. The boot identity map is gone afterwards. If page
+ * tables cannot be allocated the kernel stays on the boot tables.
+ *
+ * Kernel-half leaves are global when the CPU has CR4.PGE, and spaces get
+ * PCIDs when it also has them; without global kernel entries, a kernel
+ * unmap could not reach the copies cached under other PCIDs.
+ */
+void mm_vm_init(const boot_info_t *boot) {
+  mm_kernel.pml4 = mm_read_cr3();
+  mm_kernel.active = ~0u;
+  for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+    mm_current[i] = &mm_kernel;
+  }
+  mm_pcid_used[0] = 1;
+
+  cpuid_regs_t regs;
+  cpuid(0, 0, &regs);
+  uint32_t max_leaf = regs.eax;
+  cpuid(1, 0, &regs);
+  uint8_t pge = (regs.edx & CPUID_PGE) != 0;
+  uint8_t pcid = (regs.ecx & CPUID_PCID) != 0;
+  if (max_leaf >= 7) {
+    cpuid(7, 0, &regs);
+    mm_invpcid = (regs.ebx & CPUID_INVPCID) != 0;
+  }
+  cpuid(0x80000000, 0, &regs);
+  if (regs.eax >= 0x80000001) {
+    cpuid(0x80000001, 0, &regs);
+    if (regs.edx & CPUID_EXT_NX) {
+      wrmsr(EFER_MSR, rdmsr(EFER_MSR) | EFER_NXE);
+      mm_nx = PTE_NX;
+    }
+    mm_gbpages = (regs.edx & CPUID_EXT_GBPAGES) != 0;
+  }
+
+  mm_direct_page = MM_LEVEL_SIZE(mm_gbpages ? 2 : 1);
+
+  mm_global = pge ? PTE_GLOBAL : 0;
+  uint64_t pml4 = mm_table_alloc();
+  if (!pml4 || mm_vm_build(pml4, boot) != 0) {
+    mm_global = 0;
+    return;
+  }
+  mm_kernel.pml4 = pml4;
+  mm_pcid = pge && pcid;
+
+  uint64_t cr0;
+  __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+  __asm__ volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_WP) : "memory");
+  __asm__ volatile("mov %0, %%cr3" : : "r"(pml4) : "memory");
+  mm_cpu_features();
+}
+
+/* Runs on each AP before it relies on the kernel page tables beyond its trampoline. */
+void mm_vm_init_ap(void) {
+  mm_cpu_features();
+}
+
+void mm_vm_info(mm_vm_info_t *out) {
+  out->direct_bytes = mm_direct_bytes;
+  out->direct_page = mm_direct_page;
+  out->kernel_pages = mm_kernel_pages;
+  out->nx = mm_nx != 0;
+  out->gbpages = mm_gbpages;
+  out->global = mm_global != 0;
+  out->pcid = mm_pcid;
+  out->invpcid = mm_invpcid;
+}
+
+mm_space_t *mm_kernel_space(void) {
+  return &mm_kernel;
+}
+
+/* First free PCID, marked used; 0 if all are taken. Called with map_lock held. */
+static uint16_t mm_pcid_alloc(void) {
+  for (uint32_t word = 0; word < MM_PCID_COUNT / 64; ++word) {
+    if (mm_pcid_used[word] != ~0ull) {
+      uint32_t bit = (uint32_t)__builtin_ctzll(~mm_pcid_used[word]);
+      mm_pcid_used[word] |= 1ull << bit;
+      return (uint16_t)(word * 64 + bit);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Creates an empty user half on top of the shared kernel half, with its
+ * own PCID when the CPU has them. Returns 0, or -1 without a free frame or
+ * PCID.
+ */
+int mm_space_init(mm_space_t *space) {
+  uint64_t pml4 = mm_table_alloc();
+  if (!pml4) {
+    return -1;
+  }
+  uint16_t pcid = 0;
+  if (mm_pcid) {
+    uint64_t irq = spin_lock_irqsave(&map_lock);
+    pcid = mm_pcid_alloc();
+    spin_unlock_irqrestore(&map_lock, irq);
+    if (!pcid) {
+      mm_free_page(pml4);
+      return -1;
+    }
+  }
+  uint64_t *dst = (uint64_t *)mm_phys_to_virt(pml4);
+  const uint64_t *src = (const uint64_t *)mm_phys_to_virt(mm_kernel.pml4);
+  for (uint32_t i = MM_TABLE_ENTRIES / 2; i < MM_TABLE_ENTRIES; ++i) {
+    dst[i] = src[i];
+  }
+  space->pml4 = pml4;
+  space->pcid = pcid;
+  space->active = 0;
+  /* A recycled PCID may still tag entries of the space that had it. */
+  space->stale = ~0u;
+  return 0;
+}
+static void mm_free_tables(uint64_t table_phys, uint32_t level) {
+  uint64_t *table = (uint64_t *)mm_phys_to_virt(table_phys);
+  for (uint32_t i = 0; level > 0 && i < MM_TABLE_ENTRIES; ++i) {
+    if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_HUGE)) {
+      mm_free_tables(table[i] & PTE_ADDR_MASK, level - 1);
+    }
+  }
+  mm_free_page(table_phys);
+}
+
+/*
+ * Frees the page tables of the user half; the frames mapped there belong
+ * to whoever mapped them. The space must not be loaded on any CPU.
+ */
+void mm_space_destroy(mm_space_t *space) {
+  if (!space->pml4 || space == &mm_kernel) {
+    return;
+  }
+  uint64_t *root = (uint64_t *)mm_phys_to_virt(space->pml4);
+  for (uint32_t i = 0; i < MM_TABLE_ENTRIES / 2; ++i) {
+    if (root[i] & PTE_PRESENT) {
+      mm_free_tables(root[i] & PTE_ADDR_MASK, 2);
+    }
+  }
+  mm_free_page(space->pml4);
+  space->pml4 = 0;
+  if (space->pcid) {
+    uint64_t irq = spin_lock_irqsave(&map_lock);
+    mm_pcid_used[space->pcid / 64] &= ~(1ull << (space->pcid % 64));
+    spin_unlock_irqrestore(&map_lock, irq);
+  }
+}
+
+/*
+ * Loads space on the calling CPU. With PCIDs the entries it left in this
+ * CPU's TLB last time are kept, unless the space changed in the meantime.
+ * A CPU joins active before it reads stale, and mm_tlb_batch_flush() sets
+ * stale before it reads active, so a change either reaches the CPU by IPI
+ * or is dropped here.
+ */
+void mm_space_switch(mm_space_t *space) {
+  uint64_t irq = interrupts_save();
+  uint32_t cpu = smp_cpu_index();
+  uint32_t bit = 1u << cpu;
+  mm_space_t *prev = mm_current[cpu];
+  if (prev != space) {
+    __atomic_or_fetch(&space->active, bit, __ATOMIC_SEQ_CST);
+    uint32_t stale = __atomic_fetch_and(&space->stale, ~bit, __ATOMIC_SEQ_CST);
+    uint64_t cr3 = space->pml4;
+    if (mm_pcid) {
+      cr3 |= space->pcid;
+      if (!(stale & bit)) {
+        cr3 |= CR3_NOFLUSH;
+        mm_tlb_cpu[cpu].kept++;
+      }
+    }
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    mm_current[cpu] = space;
+    __atomic_and_fetch(&prev->active, ~bit, __ATOMIC_SEQ_CST);
+    mm_tlb_cpu[cpu].switches++;
+  }
+  interrupts_restore(irq);
+}
+
+/*
+ * Maps size bytes of physical memory at virt with the given MM_MAP_*
+ * flags, using 1 GiB and 2 MiB pages wherever both addresses are aligned
+ * for them. Both addresses must be page aligned and the range must not be
+ * mapped yet. Returns 0, or -1 (with nothing left mapped) on a misaligned
+ * or overlapping request or when a page table could not be allocated.
+ */
+int mm_space_map(mm_space_t *space, uint64_t virt, uint64_t phys, uint64_t size, uint32_t flags) {
+  if ((virt | phys) & (MM_PAGE_SIZE - 1)) {
+    return -1;
+  }
+  uint64_t irq = spin_lock_irqsave(&map_lock);
+  int rc = mm_map_locked(space->pml4, virt, phys, mm_align_up(size, MM_PAGE_SIZE), mm_leaf_bits(flags));
+  spin_unlock_irqrestore(&map_lock, irq);
+  return rc;
+}
+
+/*
+ * Removes every mapping in [virt, virt + size) of the batch's space and
+ * only records the TLB entries to drop; the frames behind the range may
+ * be reused once mm_tlb_batch_flush() has run. Page tables stay
+ * allocated. Returns -1 if a large page straddling the range could not be
+ * split, which leaves the rest of the range mapped.
+ */
+int mm_space_unmap_deferred(mm_tlb_batch_t *batch, uint64_t virt, uint64_t size) {
+  uint64_t start = mm_align_down(virt, MM_PAGE_SIZE);
+  uint64_t end = mm_align_up(virt + size, MM_PAGE_SIZE);
+  uint64_t irq = spin_lock_irqsave(&map_lock);
+  int rc = mm_update_locked(batch->space->pml4, start, end, 0, batch);
+  spin_unlock_irqrestore(&map_lock, irq);
+  return rc;
+}
+
+/*
+ * mm_space_unmap_deferred() followed by its flush: when this returns no
+ * CPU's TLB maps the range any more. Must not be called with a spinlock
+ * held (see smp_tlb_shootdown()).
+ */
+int mm_space_unmap(mm_space_t *space, uint64_t virt, uint64_t size) {
+  mm_tlb_batch_t batch;
+  mm_tlb_batch_init(&batch, space);
+  int rc = mm_space_unmap_deferred(&batch, virt, size);
+  mm_tlb_batch_flush(&batch);
+  return rc;
+}
+
+/*
+ * Changes the protection of whatever is mapped in [virt, virt + size) to
+ * the given MM_MAP_* flags, splitting large pages at the edges, and waits
+ * until no CPU's TLB holds the old rights. Unmapped pages stay unmapped.
+ * Returns 0, or -1 if a large page could not be split. Same locking rule
+ * as mm_space_unmap().
+ */
+int mm_space_protect(mm_space_t *space, uint64_t virt, uint64_t size, uint32_t flags) {
+  uint64_t start = mm_align_down(virt, MM_PAGE_SIZE);
+  uint64_t end = mm_align_up(virt + size, MM_PAGE_SIZE);
+  mm_tlb_batch_t batch;
+  mm_tlb_batch_init(&batch, space);
+  uint64_t irq = spin_lock_irqsave(&map_lock);
+  int rc = mm_update_locked(space->pml4, start, end, mm_leaf_bits(flags), &batch);
+  spin_unlock_irqrestore(&map_lock, irq);
+  mm_tlb_batch_flush(&batch);
+  return rc;
+}
+
+/*
+ * Maps device registers (or firmware tables) into the direct map with
+ * 4 KiB uncached pages where the direct map does not cover them yet, and
+ * returns their direct-map address. Only RAM, ACPI and NVS regions and the
+ * first 1 MiB are covered from the start; they keep their write-back
+ * mapping. Returns 0 if a page table could not be allocated.
+ */
+void *mm_map_mmio(uint64_t phys, uint64_t size) {
+  uint64_t start = mm_align_down(phys, MM_PAGE_SIZE);
+  uint64_t end = mm_align_up(phys + size, MM_PAGE_SIZE);
+  uint64_t flags = spin_lock_irqsave(&map_lock);
+  for (uint64_t addr = start; addr < end; addr += MM_PAGE_SIZE) {
+    uint32_t level;
+    uint64_t *entry = mm_walk(mm_kernel.pml4, MM_DIRECT_BASE + addr, 0, 1, &level);
+    if (!entry) {
+      spin_unlock_irqrestore(&map_lock, flags);
+      return 0;
+    }
+    if (level == 0 && !(*entry & PTE_PRESENT)) {
+      *entry = addr | mm_leaf_bits(MM_MAP_WRITE | MM_MAP_UNCACHED) | mm_global;
+    }
+  }
+  spin_unlock_irqrestore(&map_lock, flags);
+  return mm_phys_to_virt(phys);
+}
+
+/* mm_space_map() in the kernel space. */
+int mm_map(uint64_t virt, uint64_t phys, uint64_t size, uint32_t flags) {
+  return mm_space_map(&mm_kernel, virt, phys, size, flags);
+}
+
+/* mm_space_unmap() in the kernel space. */
+void mm_unmap(uint64_t virt, uint64_t size) {
+  mm_space_unmap(&mm_kernel, virt, size);
 }
@@ -0,0 +1,82 @@
+#include "kernel/bootinfo.h"
+#include "kernel/mm.h"
+
+#define MB2_BOOTLOADER_MAGIC 0x36d76289
+#define MB2_TAG_END 0
+#define MB2_TAG_MMAP 6
+#define MB2_TAG_ACPI_OLD 14
+#define MB2_TAG_ACPI_NEW 15
+
+typedef struct {
+  uint32_t total_size;
+  uint32_t reserved;
+} __attribute__((packed)) mb2_info_header_t;
+
+typedef struct {
+  uint32_t type;
+  uint32_t size;
+} __attribute__((packed)) mb2_tag_t;
+
+typedef struct {
+  uint32_t type;
+  uint32_t size;
+  uint32_t entry_size;
+  uint32_t entry_version;
+} __attribute__((packed)) mb2_tag_mmap_t;
+
+typedef struct {
+  uint64_t base;
+  uint64_t length;
+  uint32_t type;
+  uint32_t reserved;
+} __attribute__((packed)) mb2_mmap_entry_t;
+
+static void mb2_parse_mmap(const mb2_tag_mmap_t *tag, boot_info_t *out) {
+  if (tag->entry_size < sizeof(mb2_mmap_entry_t)) {
+    return;
+  }
+  const uint8_t *entry = (const uint8_t *)tag + sizeof(mb2_tag_mmap_t);
+  const uint8_t *end = (const uint8_t *)tag + tag->size;
+  while (entry + tag->entry_size <= end && out->memory_count < BOOT_MEMORY_MAX) {
+    const mb2_mmap_entry_t *e = (const mb2_mmap_entry_t *)entry;
+    boot_memory_region_t *region = &out->memory[out->memory_count++];
+    region->base = e->base;
+    region->length = e->length;
+    region->type = (e->type >= BOOT_MEMORY_AVAILABLE && e->type <= BOOT_MEMORY_BAD)
+                       ? e->type
+                       : BOOT_MEMORY_RESERVED;
+    entry += tag->entry_size;
+  }
+}
+
+int multiboot2_parse(uint32_t magic, uint64_t info_addr, boot_info_t *out) {
+  out->memory_count = 0;
+  out->info_start = 0;
+  out->info_end = 0;
+  out->rsdp = 0;
+  if (magic != MB2_BOOTLOADER_MAGIC || info_addr == 0 || (info_addr & 7) != 0) {
+    return -1;
+  }
+  const uint8_t *info = (const uint8_t *)mm_phys_to_virt(info_addr);
+  const mb2_info_header_t *header = (const mb2_info_header_t *)info;
+  out->info_start = info_addr;
+  out->info_end = info_addr + header->total_size;
+
+  const uint8_t *cursor = info + sizeof(mb2_info_header_t);
+  const uint8_t *end = info + header->total_size;
+  while (cursor + sizeof(mb2_tag_t) <= end) {
+    const mb2_tag_t *tag = (const mb2_tag_t *)cursor;
+    if (tag->type == MB2_TAG_END || tag->size < sizeof(mb2_tag_t)) {
+      break;
+    }
+    if (tag->type == MB2_TAG_MMAP) {
+      mb2_parse_mmap((const mb2_tag_mmap_t *)tag, out);
+    } else if (tag->type == MB2_TAG_ACPI_NEW ||
+               (tag->type == MB2_TAG_ACPI_OLD && out->rsdp == 0)) {
+      /* The tag carries a copy of the RSDP; prefer the ACPI 2.0 one (XSDT). */
+      out->rsdp = info_addr + (uint64_t)(cursor - info) + sizeof(mb2_tag_t);
+    }
+    cursor += (tag->size + 7) & ~7u;
+  }
+  return out->memory_count > 0 ? 0 : -2;
+}
@@ -1,42 +1,1096 @@
 #include "kernel/scheduler.h"
+#include "kernel/apic.h"
+#include "kernel/heap.h"
+#include "kernel/interrupts.h"
+#include "kernel/mm.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer.h"
+#include "kernel/timer_wheel.h"
+#include "kernel/workqueue.h"
 
-#define MAX_TASKS 4
+#define TASK_STACK_ORDER 2
+#define TASK_STACK_SIZE (MM_PAGE_SIZE << TASK_STACK_ORDER)
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+#define RFLAGS_RESERVED 0x2
 
-static task_fn_t tasks[MAX_TASKS];
-static uint8_t task_count = 0;
-static uint8_t current_task = 0;
+/* A task may drift this many levels above (boost) or below (decay) its base priority. */
+#define SCHED_BOOST_MAX 4
+#define SCHED_DECAY_MAX 8
+/* Every SCHED_AGING_TICKS all tasks fall back to their base priority, so decayed ones cannot starve. */
+#define SCHED_AGING_TICKS 100
+#define SCHED_IDLE_WINDOW 100
+/* Every CPU's idle thread shows up under this id; none of them can be killed. */
+#define SCHED_IDLE_ID 1
+
+typedef enum {
+  TASK_READY = 0,
+  TASK_RUNNING,
+  TASK_BLOCKED,
+  TASK_DEAD
+} task_state_t;
+
+/*
+ * A kernel thread. While it is not running, rsp points at the
+ * interrupt_frame_t it was suspended with; resuming it means handing that
+ * pointer back to the interrupt stub. next/prev link it into the run queue
+ * of its current priority on CPU cpu (or the zombie list); all_next/all_prev
+ * keep every live task on one list for ps and kill.
+ *
+ * on_cpu stays set from the moment a CPU picks the task until that CPU has
+ * left the task's stack, so no other CPU resumes it early. blocking marks
+ * the way from scheduler_block() to the switch that parks the task, and a
+ * wakeup arriving in between is remembered in wake_pending. handoff names
+ * the task scheduler_handoff() wants to run next. A pinned task always runs
+ * on cpu and is never stolen. A system task is a kernel service thread
+ * other code keeps a pointer to, so scheduler_kill() refuses it.
+ */
+struct task {
+  uint64_t rsp;
+  uint64_t stack;
+  uint32_t id;
+  const char *name;
+  task_fn_t entry;
+  void *arg;
+  uint8_t state;
+  uint8_t priority;
+  uint8_t base_priority;
+  uint8_t slice;
+  uint8_t killed;
+  uint8_t blocking;
+  uint8_t wake_pending;
+  volatile uint8_t on_cpu;
+  uint8_t pinned;
+  uint8_t system;
+  uint32_t cpu;
+  uint64_t ticks;
+  struct task *handoff;
+  struct task *next;
+  struct task *prev;
+  struct task *all_next;
+  struct task *all_prev;
+};
+
+/*
+ * One per CPU. Level 0 is the highest priority; bit n of ready_mask is set
+ * while run_head[n] is non-empty. The idle thread is never queued: a CPU
+ * runs it when its queues are empty. prev is the task this CPU has just
+ * switched away from, released by scheduler_finish_switch().
+ */
+typedef struct {
+  task_t *run_head[SCHED_PRIORITIES];
+  task_t *run_tail[SCHED_PRIORITIES];
+  uint32_t ready_mask;
+  uint32_t nr_ready;
+  task_t *current;
+  task_t *idle;
+  task_t *prev;
+  /* Last timer tick this CPU has accounted for; with NO_HZ several ticks can pass at once. */
+  uint64_t last_tick;
+  uint64_t switches;
+  uint64_t steals;
+  uint64_t handoffs;
+  uint64_t idle_wakeups;
+  uint8_t online;
+} runqueue_t;
+
+_Static_assert(SCHED_PRIORITIES <= 32, "ready mask holds one bit per priority level");
+_Static_assert(SMP_MAX_CPUS <= 32, "idle mask holds one bit per CPU");
+
+/*
+ * sched_lock guards every field below and every CPU's run queues. The
+ * queues are per CPU so each CPU picks from its own and only touches the
+ * others when it has nothing to do (stealing) or hands a woken task over.
+ */
+static spinlock_t sched_lock = SPINLOCK_INIT("sched");
+static runqueue_t runqueues[SMP_MAX_CPUS];
+/* Bit n is set while CPU n runs its idle thread. */
+static uint32_t idle_mask = 0;
+
+static kmem_cache_t *task_cache = 0;
+static task_t *all_tasks = 0;
+static task_t *zombies = 0;
+static uint32_t task_count = 0;
+static uint32_t next_id = 0;
+static uint64_t last_aging = 0;
+/* Aging walks every task, so the tick only flags it and a kworker does the walk. */
+static volatile uint8_t aging_due = 0;
+static work_t aging_work;
+static uint64_t idle_window_start = 0;
+static uint64_t idle_window_ticks = 0;
+static uint64_t idle_window_wakeups = 0;
+static uint8_t idle_percent = 0;
+static uint32_t idle_wakeup_rate = 0;
+
+static runqueue_t *this_rq(void) {
+  return &runqueues[smp_cpu_index()];
+}
+
+static uint32_t rq_index(const runqueue_t *rq) {
+  return (uint32_t)(rq - runqueues);
+}
+
+static uint8_t slice_for(uint8_t priority) {
+  /* Higher levels get shorter slices: 1 tick at the top, 4 at the bottom. */
+  return (uint8_t)(1 + priority / 8);
+}
+
+static void run_enqueue(runqueue_t *rq, task_t *task) {
+  uint8_t level = task->priority;
+  task->state = TASK_READY;
+  task->cpu = rq_index(rq);
+  task->next = 0;
+  task->prev = rq->run_tail[level];
+  if (rq->run_tail[level]) {
+    rq->run_tail[level]->next = task;
+  } else {
+    rq->run_head[level] = task;
+  }
+  rq->run_tail[level] = task;
+  rq->ready_mask |= 1u << level;
+  rq->nr_ready++;
+}
+
+static void run_remove(task_t *task) {
+  runqueue_t *rq = &runqueues[task->cpu];
+  uint8_t level = task->priority;
+  if (task->prev) {
+    task->prev->next = task->next;
+  } else {
+    rq->run_head[level] = task->next;
+  }
+  if (task->next) {
+    task->next->prev = task->prev;
+  } else {
+    rq->run_tail[level] = task->prev;
+  }
+  task->next = 0;
+  task->prev = 0;
+  if (!rq->run_head[level]) {
+    rq->ready_mask &= ~(1u << level);
+  }
+  rq->nr_ready--;
+}
+
+static task_t *run_pop_highest(runqueue_t *rq) {
+  if (!rq->ready_mask) {
+    return 0;
+  }
+  uint32_t level;
+  __asm__("bsf %1, %0" : "=r"(level) : "rm"(rq->ready_mask));
+  task_t *task = rq->run_head[level];
+  run_remove(task);
+  return task;
+}
+
+static uint8_t highest_ready(const runqueue_t *rq) {
+  if (!rq->ready_mask) {
+    return SCHED_PRIORITIES;
+  }
+  uint32_t level;
+  __asm__("bsf %1, %0" : "=r"(level) : "rm"(rq->ready_mask));
+  return (uint8_t)level;
+}
+
+static void all_link(task_t *task) {
+  task->all_prev = 0;
+  task->all_next = all_tasks;
+  if (all_tasks) {
+    all_tasks->all_prev = task;
+  }
+  all_tasks = task;
+  task_count++;
+}
+
+static void all_unlink(task_t *task) {
+  if (task->all_prev) {
+    task->all_prev->all_next = task->all_next;
+  } else {
+    all_tasks = task->all_next;
+  }
+  if (task->all_next) {
+    task->all_next->all_prev = task->all_prev;
+  }
+  task->all_next = 0;
+  task->all_prev = 0;
+  task_count--;
+}
+
+/* Moves a task that is no longer running onto the zombie list; scheduler_reap() frees it later. */
+static void task_bury(task_t *task) {
+  task->state = TASK_DEAD;
+  all_unlink(task);
+  task->next = zombies;
+  zombies = task;
+}
+
+static void task_boost(task_t *task) {
+  if (task->priority > 0 && task->priority + SCHED_BOOST_MAX > task->base_priority) {
+    task->priority--;
+  }
+}
+
+static void task_decay(task_t *task) {
+  if (task->priority + 1 < SCHED_PRIORITY_IDLE && task->priority < task->base_priority + SCHED_DECAY_MAX) {
+    task->priority++;
+  }
+}
+
+static void sched_age(void) {
+  for (task_t *task = all_tasks; task; task = task->all_next) {
+    if (task->priority == task->base_priority) {
+      continue;
+    }
+    if (task->state == TASK_READY) {
+      runqueue_t *rq = &runqueues[task->cpu];
+      run_remove(task);
+      task->priority = task->base_priority;
+      run_enqueue(rq, task);
+    } else {
+      task->priority = task->base_priority;
+    }
+  }
+}
+
+static void sched_age_work(void *arg) {
+  (void)arg;
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  sched_age();
+  spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+static uint64_t sched_idle_total(void) {
+  uint64_t total = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    if (runqueues[cpu].online) {
+      total += runqueues[cpu].idle->ticks;
+    }
+  }
+  return total;
+}
+
+static uint64_t sched_wakeups_total(void) {
+  uint64_t total = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    total += runqueues[cpu].idle_wakeups;
+  }
+  return total;
+}
+
+static uint32_t sched_online(void) {
+  uint32_t count = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    count += runqueues[cpu].online;
+  }
+  return count;
+}
+
+/* Closes an idle-statistics window once at least SCHED_IDLE_WINDOW ticks have passed; idle time is averaged over all CPUs. */
+static void sched_account_idle(uint64_t now) {
+  uint64_t span = now - idle_window_start;
+  if (span < SCHED_IDLE_WINDOW) {
+    return;
+  }
+  uint64_t idle_total = sched_idle_total();
+  uint64_t wakeups_total = sched_wakeups_total();
+  uint64_t idle = idle_total - idle_window_ticks;
+  uint64_t capacity = span * sched_online();
+  idle_percent = (uint8_t)(idle >= capacity ? 100 : idle * 100 / capacity);
+  idle_wakeup_rate = (uint32_t)((wakeups_total - idle_window_wakeups) * SCHED_IDLE_WINDOW / span);
+  idle_window_start = now;
+  idle_window_ticks = idle_total;
+  idle_window_wakeups = wakeups_total;
+}
+
+/* Charges the ticks since this CPU's last call to its running task and runs the tick-driven housekeeping. */
+static uint64_t sched_advance(runqueue_t *rq) {
+  uint64_t now = timer_ticks();
+  if (now <= rq->last_tick) {
+    return 0;
+  }
+  uint64_t elapsed = now - rq->last_tick;
+  rq->last_tick = now;
+  rq->current->ticks += elapsed;
+  sched_account_idle(now);
+  if (now - last_aging >= SCHED_AGING_TICKS) {
+    last_aging = now;
+    aging_due = 1;
+  }
+  return elapsed;
+}
+
+/*
+ * Where a task that becomes ready should run: its last CPU if that one is
+ * idle or the task is pinned, otherwise any idle CPU, otherwise its last
+ * CPU anyway.
+ */
+static uint32_t sched_select_cpu(const task_t *task) {
+  if (task->pinned) {
+    return task->cpu;
+  }
+  const runqueue_t *home = &runqueues[task->cpu];
+  if (home->online && home->current == home->idle && !home->nr_ready) {
+    return task->cpu;
+  }
+  uint32_t idle = idle_mask;
+  while (idle) {
+    uint32_t cpu = (uint32_t)__builtin_ctz(idle);
+    idle &= idle - 1;
+    if (runqueues[cpu].online && !runqueues[cpu].nr_ready) {
+      return cpu;
+    }
+  }
+  return home->online ? task->cpu : smp_cpu_index();
+}
+
+/* Interrupts another CPU if the task just queued there should run before what it is running now. */
+static void sched_kick(uint32_t cpu, uint8_t priority) {
+  if (cpu == smp_cpu_index()) {
+    return;
+  }
+  const runqueue_t *rq = &runqueues[cpu];
+  if (rq->current == rq->idle || priority < rq->current->priority) {
+    smp_send_reschedule(cpu);
+  }
+}
+
+static void sched_make_ready(task_t *task) {
+  uint32_t cpu = sched_select_cpu(task);
+  run_enqueue(&runqueues[cpu], task);
+  sched_kick(cpu, task->priority);
+}
+
+static void sched_wake_locked(task_t *task) {
+  if (task->state == TASK_BLOCKED) {
+    sched_make_ready(task);
+  } else if (task->state != TASK_DEAD) {
+    task->wake_pending = 1;
+  }
+}
+
+/* The highest-priority queued task of rq that may move to another CPU, or 0. */
+static task_t *run_find_movable(const runqueue_t *rq) {
+  uint32_t mask = rq->ready_mask;
+  while (mask) {
+    uint32_t level = (uint32_t)__builtin_ctz(mask);
+    mask &= mask - 1;
+    for (task_t *task = rq->run_head[level]; task; task = task->next) {
+      if (!task->pinned) {
+        return task;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Pulls the best movable task of the busiest other CPU onto rq. Returns 1 if one was moved. */
+static int sched_steal(runqueue_t *rq) {
+  runqueue_t *busiest = 0;
+  task_t *victim = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    runqueue_t *other = &runqueues[cpu];
+    if (other == rq || !other->online || !other->nr_ready) {
+      continue;
+    }
+    if (busiest && other->nr_ready <= busiest->nr_ready) {
+      continue;
+    }
+    task_t *task = run_find_movable(other);
+    if (task) {
+      busiest = other;
+      victim = task;
+    }
+  }
+  if (!victim) {
+    return 0;
+  }
+  run_remove(victim);
+  run_enqueue(rq, victim);
+  rq->steals++;
+  return 1;
+}
+
+static void task_trampoline(task_t *task) {
+  task->entry(task->arg);
+  scheduler_exit();
+}
+
+/*
+ * Runs when this CPU has nothing else to do. It first tries to take work
+ * from a busier CPU; failing that, hlt parks the CPU until the next
+ * interrupt after letting the timer skip every tick up to the first
+ * timer-wheel deadline (NO_HZ). sti takes effect after the following
+ * instruction, so no interrupt can slip in between it and hlt.
+ */
+static void idle_loop(void *arg) {
+  (void)arg;
+  for (;;) {
+    interrupts_disable();
+    spin_lock(&sched_lock);
+    runqueue_t *rq = this_rq();
+    int work = rq->nr_ready || sched_steal(rq);
+    if (!work) {
+      rq->idle_wakeups++;
+    }
+    spin_unlock(&sched_lock);
+    if (work) {
+      scheduler_yield();
+      continue;
+    }
+    timer_idle_enter(timer_wheel_next());
+    /* Sleeping in hlt does not count as time with interrupts off. */
+    interrupts_off_end();
+    __asm__ volatile("sti\n\thlt" : : : "memory");
+  }
+}
+
+/*
+ * Puts the current task back on this CPU's run queue (unless it blocked,
+ * died or was killed) and resumes direct if given, otherwise the first task
+ * of the highest non-empty level, or the idle thread. Called with
+ * sched_lock held; the caller has already saved rsp and adjusted the
+ * priority of the outgoing task. direct must be blocked and not killed.
+ */
+static uint64_t sched_switch_to(runqueue_t *rq, task_t *direct) {
+  task_t *prev = rq->current;
+  if (prev == rq->idle) {
+    /* The tick may have been stopped: restart it and charge the skipped ticks to idle. */
+    timer_idle_exit();
+    sched_advance(rq);
+  }
+  if (prev->state == TASK_RUNNING) {
+    if (prev == rq->idle) {
+      prev->state = TASK_READY;
+    } else if (prev->killed) {
+      task_bury(prev);
+    } else {
+      if (!prev->slice) {
+        prev->slice = slice_for(prev->priority);
+      }
+      run_enqueue(rq, prev);
+    }
+  }
+  task_t *next = direct ? direct : run_pop_highest(rq);
+  while (next && next->killed) {
+    /* Killed while blocked: it is off the CPU, so it can be buried as soon as it is woken. */
+    task_bury(next);
+    next = run_pop_highest(rq);
+  }
+  if (!next) {
+    next = rq->idle;
+  }
+  if (next != prev) {
+    /* A task woken onto this queue may still be on its way off another CPU. */
+    while (next->on_cpu) {
+      cpu_relax();
+    }
+    next->on_cpu = 1;
+    rq->prev = prev;
+    rq->switches++;
+  }
+  next->state = TASK_RUNNING;
+  next->cpu = rq_index(rq);
+  if (!next->slice) {
+    next->slice = slice_for(next->priority);
+  }
+  if (next == rq->idle) {
+    idle_mask |= 1u << rq_index(rq);
+  } else {
+    idle_mask &= ~(1u << rq_index(rq));
+  }
+  rq->current = next;
+  return next->rsp;
+}
+
+static uint64_t sched_switch(runqueue_t *rq) {
+  return sched_switch_to(rq, 0);
+}
+
+/* Called by the interrupt stubs once they run on the new task's stack; from here on the old task may run elsewhere. */
+void scheduler_finish_switch(void) {
+  runqueue_t *rq = this_rq();
+  task_t *prev = rq->prev;
+  if (prev) {
+    rq->prev = 0;
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+  }
+}
+
+static task_t *task_create(const char *name, task_fn_t task, void *arg, uint8_t priority) {
+  task_t *slot = (task_t *)kmem_cache_alloc(task_cache);
+  if (!slot) {
+    return 0;
+  }
+  uint64_t stack = mm_alloc_pages(TASK_STACK_ORDER);
+  if (!stack) {
+    kmem_cache_free(task_cache, slot);
+    return 0;
+  }
+  uint64_t top = (uint64_t)mm_phys_to_virt(stack) + TASK_STACK_SIZE;
+  interrupt_frame_t *frame = (interrupt_frame_t *)(top - sizeof(interrupt_frame_t));
+  uint64_t *words = (uint64_t *)frame;
+  for (uint32_t i = 0; i < sizeof(interrupt_frame_t) / sizeof(uint64_t); ++i) {
+    words[i] = 0;
+  }
+  frame->rip = (uint64_t)task_trampoline;
+  frame->cs = KERNEL_CODE_SELECTOR;
+  frame->rflags = RFLAGS_RESERVED | RFLAGS_IF;
+  frame->rsp = top - 8;
+  frame->ss = KERNEL_DATA_SELECTOR;
+  frame->rdi = (uint64_t)slot;
+
+  slot->rsp = (uint64_t)frame;
+  slot->stack = stack;
+  slot->name = name;
+  slot->entry = task;
+  slot->arg = arg;
+  slot->state = TASK_READY;
+  slot->base_priority = priority;
+  slot->priority = priority;
+  slot->slice = slice_for(priority);
+  slot->killed = 0;
+  slot->blocking = 0;
+  slot->wake_pending = 0;
+  slot->on_cpu = 0;
+  slot->pinned = 0;
+  slot->system = 0;
+  slot->ticks = 0;
+  slot->handoff = 0;
+  slot->next = 0;
+  slot->prev = 0;
+
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  slot->cpu = smp_cpu_index();
+  slot->id = next_id++;
+  all_link(slot);
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return slot;
+}
+
+/* Fills in an idle thread that adopts the context already running on a CPU (kernel_main or an AP's start-up stack). */
+static void idle_adopt(task_t *idle, uint32_t cpu) {
+  idle->rsp = 0;
+  idle->stack = 0;
+  idle->id = SCHED_IDLE_ID;
+  idle->name = "idle";
+  idle->entry = idle_loop;
+  idle->arg = 0;
+  idle->state = TASK_RUNNING;
+  idle->base_priority = SCHED_PRIORITY_IDLE;
+  idle->priority = SCHED_PRIORITY_IDLE;
+  idle->slice = slice_for(SCHED_PRIORITY_IDLE);
+  idle->killed = 0;
+  idle->blocking = 0;
+  idle->wake_pending = 0;
+  idle->on_cpu = 1;
+  idle->pinned = 1;
+  idle->system = 1;
+  idle->cpu = cpu;
+  idle->ticks = 0;
+  idle->handoff = 0;
+  idle->next = 0;
+  idle->prev = 0;
+}
+
+static void runqueue_reset(runqueue_t *rq) {
+  for (uint32_t i = 0; i < SCHED_PRIORITIES; ++i) {
+    rq->run_head[i] = 0;
+    rq->run_tail[i] = 0;
+  }
+  rq->ready_mask = 0;
+  rq->nr_ready = 0;
+  rq->current = 0;
+  rq->idle = 0;
+  rq->prev = 0;
+  rq->last_tick = 0;
+  rq->switches = 0;
+  rq->steals = 0;
+  rq->handoffs = 0;
+  rq->idle_wakeups = 0;
+  rq->online = 0;
+}
 
 void scheduler_init(void) {
-  for (uint8_t i = 0; i < MAX_TASKS; ++i) {
-    tasks[i] = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    runqueue_reset(&runqueues[cpu]);
   }
+  idle_mask = 0;
+  all_tasks = 0;
+  zombies = 0;
   task_count = 0;
-  current_task = 0;
+  next_id = 0;
+  last_aging = 0;
+  aging_due = 0;
+  work_init(&aging_work, sched_age_work, 0);
+  idle_window_start = 0;
+  idle_window_ticks = 0;
+  idle_window_wakeups = 0;
+  idle_wakeup_rate = 0;
+  idle_percent = 0;
+  task_cache = kmem_cache_create("task", sizeof(task_t));
+
+  /*
+   * The boot thread (kernel_main, later the shell loop) becomes task 0; its
+   * context is saved on the first switch. As the shell it sleeps on the
+   * keyboard most of the time, so it runs above ordinary tasks.
+   */
+  task_t *boot = (task_t *)kmem_cache_alloc(task_cache);
+  boot->rsp = 0;
+  boot->stack = 0;
+  boot->id = next_id++;
+  boot->name = "shell";
+  boot->entry = 0;
+  boot->arg = 0;
+  boot->state = TASK_RUNNING;
+  boot->base_priority = SCHED_PRIORITY_HIGH;
+  boot->priority = SCHED_PRIORITY_HIGH;
+  boot->slice = slice_for(boot->priority);
+  boot->killed = 0;
+  boot->blocking = 0;
+  boot->wake_pending = 0;
+  boot->on_cpu = 1;
+  boot->pinned = 0;
+  boot->system = 1;
+  boot->cpu = 0;
+  boot->ticks = 0;
+  boot->handoff = 0;
+  boot->next = 0;
+  boot->prev = 0;
+  all_link(boot);
+
+  runqueue_t *rq = &runqueues[0];
+  rq->current = boot;
+  rq->online = 1;
+  rq->idle = task_create("idle", idle_loop, 0, SCHED_PRIORITY_IDLE);
+  next_id = SCHED_IDLE_ID + 1;
 }
 
-int scheduler_add_task(task_fn_t task) {
-  if (!task || task_count >= MAX_TASKS) {
+/* Runs on the bootstrap processor before an AP is started: allocates its idle thread and resets its queues. */
+int scheduler_prepare_cpu(uint32_t cpu) {
+  if (cpu == 0 || cpu >= SMP_MAX_CPUS) {
+    return -1;
+  }
+  task_t *idle = (task_t *)kmem_cache_alloc(task_cache);
+  if (!idle) {
     return -1;
   }
-  tasks[task_count++] = task;
-  return (int)(task_count - 1);
+  idle_adopt(idle, cpu);
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  runqueue_t *rq = &runqueues[cpu];
+  runqueue_reset(rq);
+  rq->idle = idle;
+  rq->current = idle;
+  all_link(idle);
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return 0;
 }
 
-void scheduler_tick(void) {
-  if (task_count == 0) {
+/* Final step of AP start-up: the start-up stack becomes this CPU's idle thread, which takes work from then on. */
+void scheduler_start_cpu(void) {
+  spin_lock(&sched_lock);
+  runqueue_t *rq = this_rq();
+  rq->last_tick = timer_ticks();
+  rq->online = 1;
+  idle_mask |= 1u << rq_index(rq);
+  spin_unlock(&sched_lock);
+  idle_loop(0);
+  for (;;) {
+  }
+}
+
+/* Nonzero once cpu has run scheduler_start_cpu() and takes tasks. */
+int scheduler_cpu_online(uint32_t cpu) {
+  return cpu < SMP_MAX_CPUS && __atomic_load_n(&runqueues[cpu].online, __ATOMIC_ACQUIRE);
+}
+
+/* Creates a task and queues it; cpu == SMP_MAX_CPUS leaves it free to move between CPUs. */
+static int sched_spawn(const char *name, task_fn_t task, void *arg, uint8_t priority, uint32_t cpu,
+                       uint8_t system) {
+  if (!task || priority >= SCHED_PRIORITY_IDLE) {
+    return -1;
+  }
+  if (cpu < SMP_MAX_CPUS && !runqueues[cpu].online) {
+    return -3;
+  }
+  scheduler_reap();
+  task_t *created = task_create(name, task, arg, priority);
+  if (!created) {
+    return -2;
+  }
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  int id = (int)created->id;
+  if (cpu < SMP_MAX_CPUS) {
+    created->cpu = cpu;
+    created->pinned = 1;
+  }
+  created->system = system;
+  sched_make_ready(created);
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return id;
+}
+
+int scheduler_spawn(const char *name, task_fn_t task, void *arg, uint8_t priority) {
+  return sched_spawn(name, task, arg, priority, SMP_MAX_CPUS, 0);
+}
+
+/* Like scheduler_spawn(), but the task stays on cpu for its whole life. Returns -3 if cpu is not online. */
+int scheduler_spawn_on(const char *name, task_fn_t task, void *arg, uint8_t priority,
+                       uint32_t cpu) {
+  if (cpu >= SMP_MAX_CPUS) {
+    return -3;
+  }
+  return sched_spawn(name, task, arg, priority, cpu, 0);
+}
+
+/*
+ * Starts a kernel service thread at SCHED_PRIORITY_KERNEL, pinned to cpu
+ * unless it is SMP_MAX_CPUS. scheduler_kill() refuses it, since interrupt
+ * handlers keep waking it through a saved pointer.
+ */
+int scheduler_spawn_system(const char *name, task_fn_t task, void *arg, uint32_t cpu) {
+  if (cpu > SMP_MAX_CPUS) {
+    return -3;
+  }
+  return sched_spawn(name, task, arg, SCHED_PRIORITY_KERNEL, cpu, 1);
+}
+
+int scheduler_add_task(const char *name, task_fn_t task, void *arg) {
+  return scheduler_spawn(name, task, arg, SCHED_PRIORITY_DEFAULT);
+}
+
+/* Frees the stacks of dead tasks. Runs in task context and waits until no CPU is still on a stack it frees. */
+void scheduler_reap(void) {
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  task_t *list = zombies;
+  zombies = 0;
+  spin_unlock_irqrestore(&sched_lock, flags);
+  while (list) {
+    task_t *next = list->next;
+    while (__atomic_load_n(&list->on_cpu, __ATOMIC_ACQUIRE)) {
+      cpu_relax();
+    }
+    if (list->stack) {
+      mm_free_pages(list->stack, TASK_STACK_ORDER);
+    }
+    kmem_cache_free(task_cache, list);
+    list = next;
+  }
+}
+
+void scheduler_exit(void) {
+  interrupts_disable();
+  spin_lock(&sched_lock);
+  task_bury(this_rq()->current);
+  spin_unlock(&sched_lock);
+  for (;;) {
+    scheduler_yield();
+  }
+}
+
+/*
+ * Returns 0 on success, -1 if no such task exists and -2 for the boot
+ * thread, the idle threads and system threads, which cannot be killed. A task running on
+ * another CPU is flagged and that CPU is interrupted to bury it.
+ */
+int scheduler_kill(uint32_t id) {
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  task_t *task = all_tasks;
+  while (task && task->id != id) {
+    task = task->all_next;
+  }
+  if (!task) {
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return -1;
+  }
+  if (!task->stack || task->base_priority == SCHED_PRIORITY_IDLE || task->system) {
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return -2;
+  }
+  if (task == this_rq()->current) {
+    spin_unlock(&sched_lock);
+    scheduler_exit();
+  }
+  if (task->state == TASK_BLOCKED || task->state == TASK_RUNNING) {
+    /* Whoever blocked it may still hold a pointer; it is buried once woken or switched out. */
+    task->killed = 1;
+    if (task->state == TASK_RUNNING) {
+      smp_send_reschedule(task->cpu);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return 0;
+  }
+  run_remove(task);
+  task_bury(task);
+  spin_unlock_irqrestore(&sched_lock, flags);
+  scheduler_reap();
+  return 0;
+}
+
+/*
+ * Timer path: charges the elapsed ticks to the running task and preempts
+ * it once its slice is used up or a higher level becomes ready. A CPU with
+ * queued work also nudges an idle CPU, which then steals some of it.
+ */
+uint64_t scheduler_tick(uint64_t rsp) {
+  spin_lock(&sched_lock);
+  runqueue_t *rq = this_rq();
+  task_t *current = rq->current;
+  current->rsp = rsp;
+  uint64_t elapsed = sched_advance(rq);
+  uint64_t next = rsp;
+  int switched = 0;
+  if (current->killed) {
+    switched = 1;
+  } else if (current->slice && elapsed) {
+    if (elapsed < current->slice) {
+      current->slice = (uint8_t)(current->slice - elapsed);
+    } else {
+      current->slice = 0;
+      task_decay(current);
+      switched = 1;
+    }
+  }
+  if (switched || highest_ready(rq) < current->priority) {
+    next = sched_switch(rq);
+  }
+  uint32_t others = idle_mask & ~(1u << rq_index(rq));
+  if (rq->nr_ready && others) {
+    smp_send_reschedule((uint32_t)__builtin_ctz(others));
+  }
+  spin_unlock(&sched_lock);
+  if (aging_due && __atomic_exchange_n(&aging_due, 0, __ATOMIC_ACQ_REL)) {
+    work_queue(&aging_work);
+  }
+  return next;
+}
+
+/* Called on the way out of a device IRQ or IPI: switches right away if a higher-priority task became ready here. */
+uint64_t scheduler_preempt(uint64_t rsp) {
+  spin_lock(&sched_lock);
+  runqueue_t *rq = this_rq();
+  uint64_t next = rsp;
+  if (rq->current->killed || highest_ready(rq) < rq->current->priority) {
+    rq->current->rsp = rsp;
+    next = sched_switch(rq);
+  }
+  spin_unlock(&sched_lock);
+  return next;
+}
+
+/* Reschedule IPI: another CPU queued work here or killed the running task. */
+uint64_t scheduler_ipi_handler(uint64_t rsp) {
+  apic_eoi();
+  spin_lock(&sched_lock);
+  runqueue_t *rq = this_rq();
+  if (rq->current == rq->idle && !rq->nr_ready) {
+    sched_steal(rq);
+  }
+  spin_unlock(&sched_lock);
+  return scheduler_preempt(rsp);
+}
+
+/* Yield path (also used to block): giving up the CPU before the slice runs out earns a boost. */
+uint64_t scheduler_yield_handler(uint64_t rsp) {
+  spin_lock(&sched_lock);
+  runqueue_t *rq = this_rq();
+  task_t *current = rq->current;
+  current->rsp = rsp;
+  task_t *target = current->handoff;
+  current->handoff = 0;
+  if (current->blocking) {
+    current->blocking = 0;
+    if (current->wake_pending) {
+      current->wake_pending = 0;
+    } else {
+      current->state = TASK_BLOCKED;
+    }
+  }
+  if (current->state != TASK_DEAD && current != rq->idle) {
+    if (current->slice) {
+      task_boost(current);
+    }
+    current->slice = 0;
+  }
+  task_t *direct = 0;
+  if (target) {
+    if (target->state == TASK_BLOCKED && !target->killed &&
+        (!target->pinned || target->cpu == rq_index(rq))) {
+      direct = target;
+      rq->handoffs++;
+    } else {
+      sched_wake_locked(target);
+    }
+  }
+  uint64_t next = sched_switch_to(rq, direct);
+  spin_unlock(&sched_lock);
+  return next;
+}
+
+void scheduler_yield(void) {
+  __asm__ volatile("int %0" : : "i"(YIELD_VECTOR) : "memory");
+}
+
+task_t *scheduler_self(void) {
+  uint64_t flags = interrupts_save();
+  task_t *task = this_rq()->current;
+  interrupts_restore(flags);
+  return task;
+}
+
+/*
+ * Takes the current task off the CPU until scheduler_wake(). Callers disable
+ * interrupts, check their wait condition, publish scheduler_self() to the
+ * waker and only then block. A wakeup that lands before the task is parked
+ * makes this return at once, and wakeups can be spurious, so callers
+ * re-check their condition in a loop.
+ */
+void scheduler_block(void) {
+  uint64_t flags = interrupts_save();
+  this_rq()->current->blocking = 1;
+  scheduler_yield();
+  interrupts_restore(flags);
+}
+
+void scheduler_wake(task_t *task) {
+  if (!task) {
     return;
   }
-  current_task = (uint8_t)((current_task + 1) % task_count);
-  task_fn_t task = tasks[current_task];
-  if (task) {
-    task();
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  sched_wake_locked(task);
+  spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/*
+ * Blocks the caller like scheduler_block() and wakes to. If to is parked
+ * and may run here, this CPU switches straight to it, skipping the run
+ * queues and any other CPU, and to inherits the rest of the caller's turn;
+ * otherwise it is woken the ordinary way.
+ */
+void scheduler_handoff(task_t *to) {
+  uint64_t flags = interrupts_save();
+  task_t *self = this_rq()->current;
+  self->blocking = 1;
+  self->handoff = to != self ? to : 0;
+  scheduler_yield();
+  interrupts_restore(flags);
+}
+
+static void sleep_expired(void *arg) {
+  scheduler_wake((task_t *)arg);
+}
+
+/* Blocks on a one-shot timer; if the timer pool is exhausted it falls back to yielding until the deadline. */
+void scheduler_sleep(uint64_t ticks) {
+  uint64_t deadline = timer_ticks() + (ticks ? ticks : 1);
+  uint64_t flags = interrupts_save();
+  task_t *self = this_rq()->current;
+  timer_id_t timer = timer_add(deadline, sleep_expired, self);
+  while (timer_ticks() < deadline) {
+    if (timer) {
+      scheduler_block();
+    } else {
+      scheduler_yield();
+    }
+  }
+  if (timer) {
+    timer_cancel(timer);
   }
+  interrupts_restore(flags);
 }
 
-uint8_t scheduler_count(void) {
+uint32_t scheduler_count(void) {
   return task_count;
 }
 
-uint8_t scheduler_current(void) {
-  return current_task;
+uint32_t scheduler_current(void) {
+  return scheduler_self()->id;
+}
+
+uint64_t scheduler_switches(void) {
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  uint64_t total = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    total += runqueues[cpu].switches;
+  }
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return total;
+}
+
+uint64_t scheduler_idle_ticks(void) {
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  uint64_t total = sched_idle_total();
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return total;
+}
+
+/* Share of the last SCHED_IDLE_WINDOW ticks the CPUs spent in their idle threads, averaged over all of them. */
+uint8_t scheduler_idle_percent(void) {
+  return idle_percent;
+}
+
+/* Times the idle threads halted during the last window, summed over CPUs and scaled to SCHED_IDLE_WINDOW ticks (one second at 100 Hz). */
+uint32_t scheduler_idle_wakeups(void) {
+  return idle_wakeup_rate;
+}
+
+int scheduler_task_info(uint32_t index, scheduler_task_info_t *out) {
+  if (!out) {
+    return -1;
+  }
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  task_t *task = all_tasks;
+  while (task && index > 0) {
+    task = task->all_next;
+    index--;
+  }
+  if (!task) {
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return -1;
+  }
+  out->id = task->id;
+  out->name = task->name;
+  out->state = task->state;
+  out->priority = task->priority;
+  out->base_priority = task->base_priority;
+  out->cpu = task->cpu;
+  out->ticks = task->ticks;
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return 0;
+}
+
+int scheduler_cpu_info(uint32_t cpu, scheduler_cpu_info_t *out) {
+  if (!out || cpu >= SMP_MAX_CPUS) {
+    return -1;
+  }
+  uint64_t flags = spin_lock_irqsave(&sched_lock);
+  const runqueue_t *rq = &runqueues[cpu];
+  if (!rq->online) {
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return -1;
+  }
+  out->current_id = rq->current->id;
+  out->current_name = rq->current->name;
+  out->ready = rq->nr_ready;
+  out->switches = rq->switches;
+  out->steals = rq->steals;
+  out->handoffs = rq->handoffs;
+  out->idle_ticks = rq->idle->ticks;
+  spin_unlock_irqrestore(&sched_lock, flags);
+  return 0;
+}
+
+const char *scheduler_state_name(uint8_t state) {
+  switch (state) {
+    case TASK_READY:
+      return "ready";
+    case TASK_RUNNING:
+      return "running";
+    case TASK_BLOCKED:
+      return "blocked";
+    case TASK_DEAD:
+      return "dead";
+    default:
+      return "?";
+  }
 }
@@ -0,0 +1,200 @@
+#include "kernel/serial.h"
+#include "kernel/console.h"
+#include "kernel/interrupts.h"
+#include "kernel/io.h"
+#include "kernel/scheduler.h"
+#include "kernel/spinlock.h"
+
+#define COM1 0x3F8
+#define UART_DATA 0
+#define UART_IER 1
+#define UART_DIVISOR_LOW 0
+#define UART_DIVISOR_HIGH 1
+#define UART_IIR 2
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define IER_RX 0x01
+#define IER_TX_EMPTY 0x02
+#define IIR_NONE 0x01
+#define IIR_ID_MASK 0x0E
+#define IIR_MODEM 0x00
+#define IIR_TX_EMPTY 0x02
+#define IIR_RX 0x04
+#define IIR_LINE 0x06
+#define IIR_RX_TIMEOUT 0x0C
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+/* Enable and clear both FIFOs, interrupt once 14 bytes are received. */
+#define FCR_ENABLE 0xC7
+/* DTR, RTS and OUT2; OUT2 gates the UART interrupt line on PC hardware. */
+#define MCR_NORMAL 0x0B
+#define MCR_LOOPBACK 0x1E
+#define LSR_DATA 0x01
+#define LSR_TX_EMPTY 0x20
+
+#define UART_FIFO_SIZE 16
+#define SERIAL_BAUD_DIVISOR 1
+#define SERIAL_TX_SIZE 4096
+#define SERIAL_TX_MASK (SERIAL_TX_SIZE - 1)
+
+/*
+ * Output is queued in tx and drained by the transmit-empty interrupt, 16
+ * bytes (one FIFO) at a time, so writers never wait for the line. When the
+ * ring is full new bytes are dropped and counted instead. serial_lock
+ * covers the ring and the UART registers; it nests inside console_lock and
+ * outside the console input lock.
+ */
+static spinlock_t serial_lock = SPINLOCK_INIT("serial");
+static char tx[SERIAL_TX_SIZE];
+static uint32_t tx_head = 0;
+static uint32_t tx_tail = 0;
+static uint8_t tx_armed = 0;
+static uint8_t present = 0;
+static uint8_t ier = 0;
+static uint64_t tx_bytes = 0;
+static uint64_t rx_bytes = 0;
+static uint64_t dropped = 0;
+
+static void uart_out(uint8_t reg, uint8_t value) {
+  outb((uint16_t)(COM1 + reg), value);
+}
+
+static uint8_t uart_in(uint8_t reg) {
+  return inb((uint16_t)(COM1 + reg));
+}
+
+static void tx_fill_fifo(void) {
+  if (!(uart_in(UART_LSR) & LSR_TX_EMPTY)) {
+    return;
+  }
+  for (uint32_t i = 0; i < UART_FIFO_SIZE && tx_tail != tx_head; ++i) {
+    uart_out(UART_DATA, (uint8_t)tx[tx_tail & SERIAL_TX_MASK]);
+    tx_tail++;
+    tx_bytes++;
+  }
+  if (tx_tail == tx_head) {
+    ier &= (uint8_t)~IER_TX_EMPTY;
+    uart_out(UART_IER, ier);
+    tx_armed = 0;
+  }
+}
+
+static void tx_push(char c) {
+  if (tx_head - tx_tail == SERIAL_TX_SIZE) {
+    dropped++;
+    return;
+  }
+  tx[tx_head & SERIAL_TX_MASK] = c;
+  tx_head++;
+}
+
+/* Terminals send CR for Enter and DEL for Backspace; the shell expects '\n' and '\b'. */
+static void rx_drain(void) {
+  while (uart_in(UART_LSR) & LSR_DATA) {
+    char c = (char)uart_in(UART_DATA);
+    rx_bytes++;
+    if (c == '\r') {
+      c = '\n';
+    } else if (c == 0x7F) {
+      c = '\b';
+    }
+    console_input_push(c);
+  }
+}
+
+int serial_init(void) {
+  present = 0;
+  uart_out(UART_IER, 0);
+  uart_out(UART_LCR, LCR_DLAB);
+  uart_out(UART_DIVISOR_LOW, SERIAL_BAUD_DIVISOR & 0xFF);
+  uart_out(UART_DIVISOR_HIGH, (SERIAL_BAUD_DIVISOR >> 8) & 0xFF);
+  uart_out(UART_LCR, LCR_8N1);
+  uart_out(UART_FCR, FCR_ENABLE);
+
+  /* A byte sent in loopback mode must come back, otherwise there is no UART. */
+  uart_out(UART_MCR, MCR_LOOPBACK);
+  uart_out(UART_DATA, 0xAE);
+  if (uart_in(UART_DATA) != 0xAE) {
+    return -1;
+  }
+  uart_out(UART_MCR, MCR_NORMAL);
+  present = 1;
+  tx_head = 0;
+  tx_tail = 0;
+  tx_armed = 0;
+  ier = IER_RX;
+  uart_out(UART_IER, ier);
+  return console_add_sink(serial_write);
+}
+
+/* Console sink: queues the bytes, translating newlines for the terminal, and never waits for the UART. */
+void serial_write(const char *text, uint32_t length) {
+  if (!present) {
+    return;
+  }
+  uint64_t flags = spin_lock_irqsave(&serial_lock);
+  for (uint32_t i = 0; i < length; ++i) {
+    char c = text[i];
+    if (c == '\n') {
+      tx_push('\r');
+    } else if (c == '\b') {
+      /* Erase the character on the terminal too. */
+      tx_push('\b');
+      tx_push(' ');
+    }
+    tx_push(c);
+  }
+  if (!tx_armed && tx_tail != tx_head) {
+    /* Enabling the interrupt while the transmitter is idle raises it at once. */
+    tx_armed = 1;
+    ier |= IER_TX_EMPTY;
+    uart_out(UART_IER, ier);
+  }
+  spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+uint64_t irq4_handler(uint64_t rsp) {
+  spin_lock(&serial_lock);
+  for (;;) {
+    uint8_t iir = uart_in(UART_IIR);
+    if (iir & IIR_NONE) {
+      break;
+    }
+    switch (iir & IIR_ID_MASK) {
+      case IIR_RX:
+      case IIR_RX_TIMEOUT:
+        rx_drain();
+        break;
+      case IIR_TX_EMPTY:
+        tx_fill_fifo();
+        break;
+      case IIR_LINE:
+        (void)uart_in(UART_LSR);
+        break;
+      case IIR_MODEM:
+        (void)uart_in(UART_MSR);
+        break;
+      default:
+        break;
+    }
+  }
+  spin_unlock(&serial_lock);
+  interrupts_eoi(4);
+  return scheduler_preempt(rsp);
+}
+
+void serial_stats(serial_stats_t *out) {
+  if (!out) {
+    return;
+  }
+  uint64_t flags = spin_lock_irqsave(&serial_lock);
+  out->present = present;
+  out->tx_bytes = tx_bytes;
+  out->rx_bytes = rx_bytes;
+  out->dropped = dropped;
+  spin_unlock_irqrestore(&serial_lock, flags);
+}
@@ -0,0 +1,292 @@
+#include "kernel/smp.h"
+#include "kernel/acpi.h"
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/mm.h"
+#include "kernel/scheduler.h"
+#include "kernel/timer.h"
+
+/* The SIPI vector is a page number, so the trampoline must sit on a page boundary below 1 MiB. */
+#define TRAMPOLINE_BASE 0x8000
+#define SMP_STACK_ORDER 2
+#define SMP_STACK_SIZE (MM_PAGE_SIZE << SMP_STACK_ORDER)
+#define IA32_GS_BASE_MSR 0xC0000101
+#define EFER_MSR 0xC0000080
+#define EFER_LME 0x100ull
+#define EFER_NXE 0x800ull
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TSS 0x18
+#define GDT_TSS_AVAILABLE 0x89ull
+/* Delays of the INIT-SIPI-SIPI sequence from the MP specification, and how long an AP gets to check in. */
+#define SMP_INIT_DELAY_US 10000
+#define SMP_SIPI_DELAY_US 200
+#define SMP_ONLINE_TIMEOUT_US 100000
+
+struct gdt_ptr {
+  uint16_t limit;
+  uint64_t base;
+} __attribute__((packed));
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint8_t smp_trampoline_cr3[];
+extern uint8_t smp_trampoline_efer[];
+extern uint8_t smp_trampoline_stack[];
+extern uint8_t smp_trampoline_cpu[];
+extern uint8_t smp_trampoline_entry[];
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count = 1;
+/*
+ * TLB shootdowns, one slot per sending CPU since a sender waits for its
+ * round to finish: the flush to run and the CPUs that have yet to run it.
+ * A target clears its bit only after its flush, so a round is complete
+ * once pending is 0.
+ */
+typedef struct {
+  void (*flush)(void *);
+  void *arg;
+  uint32_t pending;
+} __attribute__((aligned(64))) tlb_shootdown_t;
+
+static tlb_shootdown_t tlb_shootdowns[SMP_MAX_CPUS];
+
+/* Address of a trampoline variable inside the low-memory copy. */
+static uint64_t *trampoline_slot(uint8_t *symbol) {
+  return (uint64_t *)mm_phys_to_virt(TRAMPOLINE_BASE + (uint64_t)(symbol - smp_trampoline_start));
+}
+
+static void delay_us(uint64_t us) {
+  uint64_t start = timer_ns();
+  while (timer_ns() - start < us * 1000) {
+    cpu_relax();
+  }
+}
+
+/* Flat kernel code and data segments plus this CPU's TSS, which takes two GDT slots in long mode. */
+static void cpu_setup(cpu_t *cpu, uint32_t index, uint32_t apic, uint64_t stack) {
+  cpu->self = cpu;
+  cpu->index = index;
+  cpu->apic_id = apic;
+  cpu->online = 0;
+  cpu->stack = stack;
+  cpu->irqoff_since = 0;
+  cpu->irqoff_max = 0;
+
+  uint8_t *tss = (uint8_t *)&cpu->tss;
+  for (uint32_t i = 0; i < sizeof(tss_t); ++i) {
+    tss[i] = 0;
+  }
+  if (stack) {
+    cpu->tss.rsp[0] = (uint64_t)mm_phys_to_virt(stack) + SMP_STACK_SIZE;
+  }
+  cpu->tss.iomap_base = sizeof(tss_t);
+
+  uint64_t base = (uint64_t)&cpu->tss;
+  uint64_t limit = sizeof(tss_t) - 1;
+  cpu->gdt[0] = 0;
+  cpu->gdt[1] = 0x00209A0000000000ull;
+  cpu->gdt[2] = 0x0000920000000000ull;
+  cpu->gdt[3] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) | (GDT_TSS_AVAILABLE << 40) |
+                (((limit >> 16) & 0xF) << 48) | (((base >> 24) & 0xFF) << 56);
+  cpu->gdt[4] = base >> 32;
+}
+
+/*
+ * Switches the calling CPU to its own GDT and TSS and points GS at its
+ * per-CPU area. Loading a segment register clears the GS base, so the MSR
+ * is written last.
+ */
+static void cpu_load(cpu_t *cpu) {
+  struct gdt_ptr desc;
+  desc.limit = (uint16_t)(sizeof(cpu->gdt) - 1);
+  desc.base = (uint64_t)cpu->gdt;
+  __asm__ volatile(
+      "lgdt %0\n\t"
+      "pushq %1\n\t"
+      "leaq 1f(%%rip), %%rax\n\t"
+      "pushq %%rax\n\t"
+      "lretq\n"
+      "1:\n\t"
+      "mov %2, %%ax\n\t"
+      "mov %%ax, %%ds\n\t"
+      "mov %%ax, %%es\n\t"
+      "mov %%ax, %%ss\n\t"
+      "xor %%eax, %%eax\n\t"
+      "mov %%ax, %%fs\n\t"
+      "mov %%ax, %%gs\n\t"
+      "mov %3, %%ax\n\t"
+      "ltr %%ax"
+      :
+      : "m"(desc), "i"(GDT_KERNEL_CODE), "i"(GDT_KERNEL_DATA), "i"(GDT_TSS)
+      : "rax", "memory");
+  wrmsr(IA32_GS_BASE_MSR, (uint64_t)cpu);
+}
+
+/* Runs first on the bootstrap processor, before anything reads per-CPU data. */
+void smp_early_init(void) {
+  cpu_count = 1;
+  cpu_setup(&cpus[0], 0, 0, 0);
+  cpu_load(&cpus[0]);
+}
+
+/* First C code on an application processor; interrupts are still off. */
+static void smp_ap_main(cpu_t *cpu) {
+  cpu_load(cpu);
+  mm_vm_init_ap();
+  interrupts_init_ap();
+  apic_init_ap();
+  timer_init_ap();
+  __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+  scheduler_start_cpu();
+}
+
+static int smp_start_ap(uint32_t index, uint32_t apic, uint64_t cr3) {
+  uint64_t stack = mm_alloc_pages(SMP_STACK_ORDER);
+  if (!stack) {
+    return -1;
+  }
+  cpu_t *cpu = &cpus[index];
+  cpu_setup(cpu, index, apic, stack);
+  if (scheduler_prepare_cpu(index) != 0) {
+    mm_free_pages(stack, SMP_STACK_ORDER);
+    return -1;
+  }
+  *trampoline_slot(smp_trampoline_cr3) = cr3;
+  *trampoline_slot(smp_trampoline_stack) = (uint64_t)mm_phys_to_virt(stack) + SMP_STACK_SIZE;
+  *trampoline_slot(smp_trampoline_cpu) = (uint64_t)cpu;
+  *trampoline_slot(smp_trampoline_entry) = (uint64_t)smp_ap_main;
+
+  apic_send_init(apic);
+  delay_us(SMP_INIT_DELAY_US);
+  apic_send_startup(apic, TRAMPOLINE_BASE >> MM_PAGE_SHIFT);
+  delay_us(SMP_SIPI_DELAY_US);
+  if (!cpu->online) {
+    apic_send_startup(apic, TRAMPOLINE_BASE >> MM_PAGE_SHIFT);
+  }
+  /* cpu->online comes before the run queue; spawning pinned tasks needs both. */
+  uint64_t start = timer_ns();
+  while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) || !scheduler_cpu_online(index)) {
+    if (timer_ns() - start > SMP_ONLINE_TIMEOUT_US * 1000) {
+      return -1;
+    }
+    cpu_relax();
+  }
+  return 0;
+}
+
+/*
+ * Starts every enabled processor from the MADT with INIT-SIPI-SIPI, one at
+ * a time since they share the trampoline. APs need the LAPIC for IPIs and
+ * their own tick, so without the APIC timer the kernel stays uniprocessor.
+ */
+void smp_init(void) {
+  cpus[0].apic_id = apic_id();
+  cpus[0].online = 1;
+  const acpi_info_t *acpi = acpi_info();
+  if (!acpi->present || acpi->cpu_count < 2 || !timer_nohz()) {
+    return;
+  }
+  uint8_t *copy = (uint8_t *)mm_phys_to_virt(TRAMPOLINE_BASE);
+  for (uint64_t i = 0; i < (uint64_t)(smp_trampoline_end - smp_trampoline_start); ++i) {
+    copy[i] = smp_trampoline_start[i];
+  }
+  if (mm_map(TRAMPOLINE_BASE, TRAMPOLINE_BASE, MM_PAGE_SIZE, MM_MAP_EXEC) != 0) {
+    return;
+  }
+  *trampoline_slot(smp_trampoline_efer) = EFER_LME | (rdmsr(EFER_MSR) & EFER_NXE);
+  uint64_t cr3;
+  __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+  for (uint32_t i = 0; i < acpi->cpu_count && cpu_count < SMP_MAX_CPUS; ++i) {
+    uint32_t apic = acpi->cpu_apic_ids[i];
+    if (apic == cpus[0].apic_id) {
+      continue;
+    }
+    if (smp_start_ap(cpu_count, apic, cr3) != 0) {
+      /* A late AP would read the next one's trampoline variables; stop here. */
+      break;
+    }
+    cpu_count++;
+  }
+  mm_unmap(TRAMPOLINE_BASE, MM_PAGE_SIZE);
+}
+
+uint32_t smp_cpu_count(void) {
+  return cpu_count;
+}
+
+cpu_t *smp_cpu(uint32_t index) {
+  return index < cpu_count ? &cpus[index] : 0;
+}
+
+void smp_send_reschedule(uint32_t index) {
+  if (index < cpu_count) {
+    apic_send_ipi(cpus[index].apic_id, RESCHEDULE_VECTOR);
+  }
+}
+
+/* Runs every flush other CPUs have asked this one for. */
+static void tlb_flush_serve(uint32_t index) {
+  uint32_t bit = 1u << index;
+  for (uint32_t i = 0; i < cpu_count; ++i) {
+    tlb_shootdown_t *round = &tlb_shootdowns[i];
+    if (__atomic_load_n(&round->pending, __ATOMIC_ACQUIRE) & bit) {
+      round->flush(round->arg);
+      __atomic_and_fetch(&round->pending, ~bit, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+/*
+ * Runs flush(arg) on every other online CPU in mask, from the TLB flush
+ * IPI, and waits until all of them are done; for after page table entries
+ * have been changed. Each target gets one IPI per round however much the
+ * flush covers, and when the round goes to every other CPU in the system
+ * it is a single broadcast. Returns the number of IPIs sent. The caller
+ * must not hold a spinlock: another CPU may be spinning on it with
+ * interrupts off and never take the IPI. Two CPUs shooting down at once
+ * serve each other's rounds while they wait.
+ */
+uint32_t smp_tlb_shootdown(uint32_t mask, void (*flush)(void *), void *arg) {
+  if (cpu_count < 2) {
+    return 0;
+  }
+  uint64_t flags = interrupts_save();
+  uint32_t self = smp_cpu_index();
+  uint32_t others = ((1u << cpu_count) - 1) & ~(1u << self);
+  mask &= others;
+  if (!mask) {
+    interrupts_restore(flags);
+    return 0;
+  }
+  tlb_shootdown_t *round = &tlb_shootdowns[self];
+  round->flush = flush;
+  round->arg = arg;
+  __atomic_store_n(&round->pending, mask, __ATOMIC_RELEASE);
+  uint32_t ipis = 0;
+  if (mask == others && cpu_count == acpi_info()->cpu_count) {
+    apic_send_ipi_others(TLB_FLUSH_VECTOR);
+    ipis = 1;
+  } else {
+    for (uint32_t i = 0; i < cpu_count; ++i) {
+      if (mask & (1u << i)) {
+        apic_send_ipi(cpus[i].apic_id, TLB_FLUSH_VECTOR);
+        ipis++;
+      }
+    }
+  }
+  while (__atomic_load_n(&round->pending, __ATOMIC_ACQUIRE)) {
+    tlb_flush_serve(self);
+    cpu_relax();
+  }
+  interrupts_restore(flags);
+  return ipis;
+}
+
+uint64_t smp_tlb_flush_handler(uint64_t rsp) {
+  apic_eoi();
+  tlb_flush_serve(smp_cpu_index());
+  return rsp;
+}
@@ -1,35 +1,298 @@
 #include "kernel/timer.h"
-#include "kernel/console.h"
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
 #include "kernel/interrupts.h"
 #include "kernel/io.h"
 #include "kernel/scheduler.h"
+#include "kernel/smp.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer_wheel.h"
 
 #define PIT_COMMAND 0x43
 #define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
 #define PIT_BASE_FREQUENCY 1193182
+/* Port 0x61: bit 0 gates channel 2, bit 1 drives the speaker, bit 5 reads channel 2's output. */
+#define PIT_GATE_PORT 0x61
+#define PIT_GATE 0x01
+#define PIT_SPEAKER 0x02
+#define PIT_OUT2 0x20
+/* Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count). */
+#define PIT_CHANNEL2_ONESHOT 0xB0
+
+#define CALIBRATION_MS 10
+/* PIT ticks in one calibration round; the round lasts this / PIT_BASE_FREQUENCY, a little under CALIBRATION_MS. */
+#define CALIBRATION_COUNT ((uint16_t)(PIT_BASE_FREQUENCY * CALIBRATION_MS / 1000))
+/* Longest stretch the idle thread may stop the tick for, even with nothing armed. */
+#define TIMER_IDLE_MAX_TICKS 1000
+#define CALIBRATION_ROUNDS 5
+/* A round still waiting after this many cycles (250 ms at 10 GHz) means channel 2's gate does not work. */
+#define CALIBRATION_TIMEOUT_CYCLES 2500000000ull
+#define NS_PER_SEC 1000000000ull
+#define CPUID_FEATURE_TSC (1u << 4)
+#define CPUID_INVARIANT_TSC (1u << 8)
 
 static volatile uint64_t ticks = 0;
+static uint32_t tick_hz = 100;
+static uint64_t tick_period_ns = NS_PER_SEC / 100;
+/*
+ * With the LAPIC timer every tick is a one-shot deadline on a fixed grid:
+ * tick n falls at tsc_base + n * tick_period_cycles. The tick count is
+ * recomputed from the TSC rather than incremented, so when the idle thread
+ * skips ticks (NO_HZ) the count catches up on the next interrupt. Every CPU
+ * runs its own LAPIC timer on the same grid (the TSCs are assumed to be in
+ * sync) and whichever gets there first moves the shared count forward.
+ */
+static uint8_t tick_oneshot = 0;
+static uint8_t nohz_active[SMP_MAX_CPUS];
+static uint64_t tick_period_cycles = 0;
+
+/*
+ * ns = (cycles * tsc_mult) >> 32, with tsc_mult = 2^32 * 1e9 / tsc_hz
+ * precomputed, so reading the clock is rdtsc, a subtraction and one
+ * multiply, and is safe in interrupt context. Without a TSC the clock falls
+ * back to tick resolution.
+ */
+static uint64_t tsc_base = 0;
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_mult = 0;
+static uint8_t tsc_invariant = 0;
+/*
+ * TSC at the first and the latest PIT tick, for measuring drift between the
+ * two clocks. drift_lock keeps a reader on another CPU from seeing the tick
+ * count and its TSC stamp from different ticks.
+ */
+static spinlock_t drift_lock = SPINLOCK_INIT("timer-drift");
+static uint64_t tsc_first_tick = 0;
+static uint64_t first_tick = 0;
+static uint64_t tsc_last_tick = 0;
+static uint64_t last_tick = 0;
+
+static uint8_t tsc_detect(void) {
+  cpuid_regs_t regs;
+  cpuid(1, 0, &regs);
+  if (!(regs.edx & CPUID_FEATURE_TSC)) {
+    return 0;
+  }
+  cpuid(0x80000000, 0, &regs);
+  if (regs.eax >= 0x80000007) {
+    cpuid(0x80000007, 0, &regs);
+    tsc_invariant = (regs.edx & CPUID_INVARIANT_TSC) ? 1 : 0;
+  }
+  return 1;
+}
+
+/* Counts TSC cycles across one CALIBRATION_COUNT one-shot of PIT channel 2; 0 if OUT2 never rises. */
+static uint64_t tsc_measure(void) {
+  uint16_t count = CALIBRATION_COUNT;
+  uint8_t gate = inb(PIT_GATE_PORT);
+  outb(PIT_GATE_PORT, (uint8_t)((gate & ~PIT_SPEAKER) & ~PIT_GATE));
+  outb(PIT_COMMAND, PIT_CHANNEL2_ONESHOT);
+  outb(PIT_CHANNEL2, (uint8_t)(count & 0xFF));
+  outb(PIT_CHANNEL2, (uint8_t)(count >> 8));
+  outb(PIT_GATE_PORT, (uint8_t)(((gate & ~PIT_SPEAKER) | PIT_GATE)));
+  uint64_t start = rdtsc();
+  while (!(inb(PIT_GATE_PORT) & PIT_OUT2)) {
+    if (rdtsc() - start > CALIBRATION_TIMEOUT_CYCLES) {
+      outb(PIT_GATE_PORT, gate);
+      return 0;
+    }
+    cpu_relax();
+  }
+  uint64_t end = rdtsc();
+  outb(PIT_GATE_PORT, gate);
+  return end - start;
+}
+
+/* SMIs and emulator hiccups only ever make a round longer, so the shortest one is kept. */
+static void tsc_calibrate(void) {
+  if (!tsc_detect()) {
+    return;
+  }
+  uint64_t best = 0;
+  for (uint32_t i = 0; i < CALIBRATION_ROUNDS; ++i) {
+    uint64_t cycles = tsc_measure();
+    if (!cycles) {
+      /* No usable PIT gate: tsc_hz stays 0 and the clock falls back to tick resolution. */
+      return;
+    }
+    if (!best || cycles < best) {
+      best = cycles;
+    }
+  }
+  if (!best) {
+    return;
+  }
+  tsc_hz = best * PIT_BASE_FREQUENCY / CALIBRATION_COUNT;
+  /* 1e9 << 32 still fits in 64 bits. */
+  tsc_mult = (NS_PER_SEC << 32) / tsc_hz;
+}
 
 void timer_init(uint32_t frequency) {
   if (frequency == 0) {
     frequency = 100;
   }
+  tsc_calibrate();
+  tick_hz = frequency;
+  tsc_base = tsc_hz ? rdtsc() : 0;
+  ticks = 0;
+  tick_oneshot = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    nohz_active[cpu] = 0;
+  }
+  first_tick = 0;
+  if (apic_timer_init(IRQ_VECTOR_BASE, tsc_hz) == 0) {
+    tick_oneshot = 1;
+    tick_period_cycles = tsc_hz / frequency;
+    tick_period_ns = timer_cycles_to_ns(tick_period_cycles);
+    apic_timer_arm(tsc_base + tick_period_cycles);
+    return;
+  }
   uint32_t divisor = PIT_BASE_FREQUENCY / frequency;
+  /* The real tick period is divisor / PIT_BASE_FREQUENCY, not exactly 1 / frequency. */
+  tick_period_ns = (uint64_t)divisor * NS_PER_SEC / PIT_BASE_FREQUENCY;
   outb(PIT_COMMAND, 0x36);
   outb(PIT_CHANNEL0, (uint8_t)(divisor & 0xFF));
   outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));
-  ticks = 0;
+  apic_route_irq(0, IRQ_VECTOR_BASE);
 }
 
 uint64_t timer_ticks(void) {
   return ticks;
 }
 
-void irq0_handler(void) {
-  ticks++;
-  scheduler_tick();
-  if ((ticks % 100) == 0) {
-    console_write_line("tick");
+uint64_t timer_cycles(void) {
+  return tsc_hz ? rdtsc() - tsc_base : 0;
+}
+
+uint64_t timer_ns(void) {
+  if (!tsc_hz) {
+    return ticks * tick_period_ns;
+  }
+  return (uint64_t)(((unsigned __int128)timer_cycles() * tsc_mult) >> 32);
+}
+
+uint64_t timer_cycles_to_ns(uint64_t cycles) {
+  return tsc_hz ? (uint64_t)(((unsigned __int128)cycles * tsc_mult) >> 32) : 0;
+}
+
+const char *timer_source(void) {
+  if (!tick_oneshot) {
+    return "pit";
+  }
+  return apic_timer_mode() == APIC_TIMER_TSC_DEADLINE ? "apic-tsc-deadline" : "apic-oneshot";
+}
+
+uint64_t timer_tsc_hz(void) {
+  return tsc_hz;
+}
+
+int timer_tsc_invariant(void) {
+  return tsc_invariant;
+}
+
+/*
+ * How far the TSC clock has run ahead of (positive) or behind the PIT tick
+ * since the first tick, in ppm. Both ends are sampled on tick edges, so the
+ * result carries no phase error from boot. Returns -1 without a TSC or in
+ * one-shot APIC mode, where ticks are counted off the TSC itself and there
+ * is no independent clock to compare with.
+ */
+int timer_drift_ppm(int64_t *ppm) {
+  if (!tsc_hz || tick_oneshot) {
+    return -1;
+  }
+  uint64_t flags = spin_lock_irqsave(&drift_lock);
+  uint64_t elapsed_ticks = first_tick ? last_tick - first_tick : 0;
+  uint64_t cycles = tsc_last_tick - tsc_first_tick;
+  spin_unlock_irqrestore(&drift_lock, flags);
+  *ppm = 0;
+  if (!elapsed_ticks) {
+    return 0;
+  }
+  uint64_t tick_ns = elapsed_ticks * tick_period_ns;
+  int64_t delta = (int64_t)(timer_cycles_to_ns(cycles) - tick_ns);
+  *ppm = delta * 1000000 / (int64_t)tick_ns;
+  return 0;
+}
+
+static uint64_t tick_catch_up(void) {
+  uint64_t now = (rdtsc() - tsc_base) / tick_period_cycles;
+  uint64_t seen = ticks;
+  while (now > seen) {
+    if (__atomic_compare_exchange_n(&ticks, &seen, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return now;
+    }
+  }
+  return seen;
+}
+
+static void tick_arm(uint64_t tick) {
+  apic_timer_arm(tsc_base + tick * tick_period_cycles);
+}
+
+/*
+ * Called by the idle thread with interrupts off, right before hlt. With a
+ * one-shot timer the periodic tick is stopped and the timer is armed for
+ * next_tick, the first tick the timer wheel is waiting for, but never more
+ * than TIMER_IDLE_MAX_TICKS ahead. Returns 1 if the tick was stopped.
+ */
+int timer_idle_enter(uint64_t next_tick) {
+  if (!tick_oneshot) {
+    return 0;
+  }
+  uint64_t now = tick_catch_up();
+  if (next_tick > now + TIMER_IDLE_MAX_TICKS) {
+    next_tick = now + TIMER_IDLE_MAX_TICKS;
+  }
+  if (next_tick <= now + 1) {
+    return 0;
+  }
+  nohz_active[smp_cpu_index()] = 1;
+  tick_arm(next_tick);
+  return 1;
+}
+
+/* Called when the CPU leaves idle for a real task: brings the count up to date and restarts the periodic tick. */
+void timer_idle_exit(void) {
+  uint32_t cpu = smp_cpu_index();
+  if (!nohz_active[cpu]) {
+    return;
+  }
+  nohz_active[cpu] = 0;
+  tick_arm(tick_catch_up() + 1);
+}
+
+int timer_nohz(void) {
+  return tick_oneshot;
+}
+
+/* Starts the tick on an application processor, on the grid the bootstrap processor set up. */
+void timer_init_ap(void) {
+  if (tick_oneshot && apic_timer_init_ap(IRQ_VECTOR_BASE) == 0) {
+    tick_arm(tick_catch_up() + 1);
+  }
+}
+
+uint64_t irq0_handler(uint64_t rsp) {
+  if (tick_oneshot) {
+    /* Always re-arm the next tick; the idle thread pushes it out again if nothing needs it. */
+    tick_arm(tick_catch_up() + 1);
+  } else {
+    ticks++;
+  }
+  /* Drift is measured against the bootstrap processor's PIT tick only. */
+  if (tsc_hz && !tick_oneshot && smp_cpu_index() == 0) {
+    spin_lock(&drift_lock);
+    tsc_last_tick = rdtsc();
+    last_tick = ticks;
+    if (!first_tick) {
+      first_tick = ticks;
+      tsc_first_tick = tsc_last_tick;
+    }
+    spin_unlock(&drift_lock);
   }
-  pic_send_eoi(0);
+  timer_wheel_poll(ticks);
+  interrupts_eoi(0);
+  return scheduler_tick(rsp);
 }
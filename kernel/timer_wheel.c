@@ -0,0 +1,369 @@
+#include "kernel/timer_wheel.h"
+#include "kernel/interrupts.h"
+#include "kernel/scheduler.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer.h"
+
+/* Four levels of 64 slots cover 2^24 ticks (about 46 hours at 100 Hz); later deadlines wait in the last level. */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ull << (WHEEL_LEVELS * WHEEL_BITS))
+/* Pseudo-level of the list of expired timers waiting for the timer thread. */
+#define WHEEL_EXPIRED WHEEL_LEVELS
+#define TIMER_MAX 256
+
+typedef enum {
+  TIMER_FREE = 0,
+  TIMER_PENDING,
+  TIMER_RUNNING,
+  TIMER_CANCELLED
+} timer_state_t;
+
+/*
+ * Timers live in a fixed pool so a handle can be checked without touching
+ * freed memory: it carries the slot index and a generation that changes
+ * every time the slot is freed, which makes stale handles harmless.
+ */
+typedef struct timer_entry {
+  uint64_t expires;
+  uint64_t period;
+  timer_fn_t fn;
+  void *arg;
+  struct timer_entry *next;
+  struct timer_entry *prev;
+  uint16_t generation;
+  uint8_t state;
+  uint8_t level;
+  uint8_t slot;
+} timer_entry_t;
+
+/*
+ * Level n slot i holds timers whose deadline, shifted right by 6n bits,
+ * ends in i and which are less than 64^(n+1) ticks away. When the level
+ * below wraps around, the matching slot is emptied and its timers are
+ * re-inserted one level lower (cascading). Bit i of slot_mask[n] is set
+ * while slot i is non-empty, so the next deadline is a few bit scans away.
+ * wheel_clock is the next tick the wheel has to process. wheel_lock guards
+ * all of it; next_expiry is also read without it, as a hint.
+ */
+static spinlock_t wheel_lock = SPINLOCK_INIT("timer-wheel");
+static timer_entry_t pool[TIMER_MAX];
+static timer_entry_t *free_list = 0;
+static timer_entry_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t slot_mask[WHEEL_LEVELS];
+static timer_entry_t *expired = 0;
+static uint64_t wheel_clock = 0;
+static volatile uint64_t next_expiry = UINT64_MAX;
+static task_t *timer_task = 0;
+static uint32_t pending_count = 0;
+static uint64_t fired_count = 0;
+static uint64_t cascade_count = 0;
+
+static timer_entry_t **list_head(uint8_t level, uint8_t slot) {
+  return level == WHEEL_EXPIRED ? &expired : &slots[level][slot];
+}
+
+static void list_push(timer_entry_t *entry, uint8_t level, uint8_t slot) {
+  timer_entry_t **head = list_head(level, slot);
+  entry->level = level;
+  entry->slot = slot;
+  entry->prev = 0;
+  entry->next = *head;
+  if (*head) {
+    (*head)->prev = entry;
+  }
+  *head = entry;
+  if (level != WHEEL_EXPIRED) {
+    slot_mask[level] |= 1ull << slot;
+  }
+}
+
+static void list_remove(timer_entry_t *entry) {
+  timer_entry_t **head = list_head(entry->level, entry->slot);
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    *head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  }
+  entry->next = 0;
+  entry->prev = 0;
+  if (entry->level != WHEEL_EXPIRED && !*head) {
+    slot_mask[entry->level] &= ~(1ull << entry->slot);
+  }
+}
+
+/* Files a timer into the slot its distance from wheel_clock selects; overdue ones go into the current slot. */
+static void wheel_insert(timer_entry_t *entry) {
+  uint64_t expires = entry->expires < wheel_clock ? wheel_clock : entry->expires;
+  uint64_t delta = expires - wheel_clock;
+  if (delta >= WHEEL_SPAN) {
+    expires = wheel_clock + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+  uint8_t level = 0;
+  while (delta >> ((level + 1) * WHEEL_BITS)) {
+    level++;
+  }
+  list_push(entry, level, (uint8_t)((expires >> (level * WHEEL_BITS)) & WHEEL_MASK));
+  if (expires < next_expiry) {
+    next_expiry = expires;
+  }
+}
+
+static void wheel_cascade(uint8_t level, uint8_t slot) {
+  timer_entry_t *entry = slots[level][slot];
+  slots[level][slot] = 0;
+  slot_mask[level] &= ~(1ull << slot);
+  while (entry) {
+    timer_entry_t *next = entry->next;
+    wheel_insert(entry);
+    cascade_count++;
+    entry = next;
+  }
+}
+
+/* Processes tick wheel_clock: cascades the upper levels that wrap here, then moves the due slot to the expired list. */
+static void wheel_step(void) {
+  uint64_t tick = wheel_clock;
+  uint8_t index = (uint8_t)(tick & WHEEL_MASK);
+  for (uint8_t level = 1; level < WHEEL_LEVELS && index == 0; ++level) {
+    index = (uint8_t)((tick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+    wheel_cascade(level, index);
+  }
+  uint8_t slot = (uint8_t)(tick & WHEEL_MASK);
+  while (slots[0][slot]) {
+    timer_entry_t *entry = slots[0][slot];
+    list_remove(entry);
+    list_push(entry, WHEEL_EXPIRED, 0);
+  }
+  wheel_clock++;
+}
+
+/* Brings the wheel up to tick now; stretches without level-0 timers are skipped up to the next cascade point. */
+static void wheel_run(uint64_t now) {
+  while (wheel_clock <= now) {
+    if (!slot_mask[0] && (wheel_clock & WHEEL_MASK)) {
+      uint64_t boundary = (wheel_clock | WHEEL_MASK) + 1;
+      wheel_clock = boundary <= now ? boundary : now + 1;
+      continue;
+    }
+    wheel_step();
+  }
+}
+
+static uint64_t rotate_right(uint64_t mask, uint32_t count) {
+  count &= 63;
+  return count ? (mask >> count) | (mask << (64 - count)) : mask;
+}
+
+/*
+ * Earliest tick anything in the wheel needs attention. Level 0 yields exact
+ * deadlines; an upper level yields the tick its first occupied slot is
+ * cascaded, which is never later than the deadlines inside it.
+ */
+static uint64_t wheel_next_expiry(void) {
+  if (expired) {
+    return wheel_clock;
+  }
+  uint64_t best = UINT64_MAX;
+  if (slot_mask[0]) {
+    uint64_t rotated = rotate_right(slot_mask[0], (uint32_t)(wheel_clock & WHEEL_MASK));
+    best = wheel_clock + (uint64_t)__builtin_ctzll(rotated);
+  }
+  for (uint8_t level = 1; level < WHEEL_LEVELS; ++level) {
+    if (!slot_mask[level]) {
+      continue;
+    }
+    uint32_t shift = level * WHEEL_BITS;
+    uint64_t start = wheel_clock >> shift;
+    if (wheel_clock & ((1ull << shift) - 1)) {
+      start++;
+    }
+    uint64_t rotated = rotate_right(slot_mask[level], (uint32_t)(start & WHEEL_MASK));
+    uint64_t when = (start + (uint64_t)__builtin_ctzll(rotated)) << shift;
+    if (when < best) {
+      best = when;
+    }
+  }
+  return best;
+}
+
+static void entry_free(timer_entry_t *entry) {
+  entry->state = TIMER_FREE;
+  entry->generation++;
+  entry->fn = 0;
+  entry->arg = 0;
+  entry->next = free_list;
+  free_list = entry;
+  pending_count--;
+}
+
+static timer_id_t entry_id(timer_entry_t *entry) {
+  return ((timer_id_t)entry->generation << 16) | (timer_id_t)(entry - pool + 1);
+}
+
+static timer_entry_t *entry_lookup(timer_id_t id) {
+  uint32_t index = id & 0xFFFF;
+  if (index == 0 || index > TIMER_MAX) {
+    return 0;
+  }
+  timer_entry_t *entry = &pool[index - 1];
+  if (entry->state == TIMER_FREE || entry->generation != (uint16_t)(id >> 16)) {
+    return 0;
+  }
+  return entry;
+}
+
+/* Schedules the next run of a periodic timer, skipping periods that were missed while callbacks ran late. */
+static void entry_rearm(timer_entry_t *entry, uint64_t now) {
+  entry->expires += entry->period;
+  if (entry->expires <= now) {
+    entry->expires += ((now - entry->expires) / entry->period + 1) * entry->period;
+  }
+  entry->state = TIMER_PENDING;
+  wheel_insert(entry);
+}
+
+/*
+ * Expired callbacks run here, in a kernel thread with interrupts enabled,
+ * instead of in the timer interrupt; the interrupt only wakes this thread
+ * once the tick count reaches next_expiry. Callbacks may add and cancel
+ * timers, including their own, but must not block: later timers wait on them.
+ */
+static void timer_thread(void *arg) {
+  (void)arg;
+  timer_task = scheduler_self();
+  for (;;) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    wheel_run(timer_ticks());
+    while (expired) {
+      timer_entry_t *entry = expired;
+      list_remove(entry);
+      entry->state = TIMER_RUNNING;
+      fired_count++;
+      timer_fn_t fn = entry->fn;
+      void *fn_arg = entry->arg;
+      spin_unlock_irqrestore(&wheel_lock, flags);
+      fn(fn_arg);
+      flags = spin_lock_irqsave(&wheel_lock);
+      if (entry->state == TIMER_RUNNING && entry->period) {
+        entry_rearm(entry, timer_ticks());
+      } else {
+        entry_free(entry);
+      }
+    }
+    next_expiry = wheel_next_expiry();
+    int done = next_expiry > timer_ticks();
+    spin_unlock(&wheel_lock);
+    if (done) {
+      scheduler_block();
+    }
+    interrupts_restore(flags);
+  }
+}
+
+void timer_wheel_init(void) {
+  free_list = 0;
+  for (uint32_t i = TIMER_MAX; i-- > 0;) {
+    pool[i].state = TIMER_FREE;
+    pool[i].generation = 0;
+    pool[i].next = free_list;
+    free_list = &pool[i];
+  }
+  for (uint32_t level = 0; level < WHEEL_LEVELS; ++level) {
+    for (uint32_t slot = 0; slot < WHEEL_SLOTS; ++slot) {
+      slots[level][slot] = 0;
+    }
+    slot_mask[level] = 0;
+  }
+  expired = 0;
+  wheel_clock = timer_ticks();
+  next_expiry = UINT64_MAX;
+  pending_count = 0;
+  fired_count = 0;
+  cascade_count = 0;
+  timer_task = 0;
+  scheduler_spawn_system("timer", timer_thread, 0, SMP_MAX_CPUS);
+}
+
+/*
+ * Arms a timer that calls callback(arg) from the timer thread once the tick
+ * count reaches deadline (an absolute tick); a period other than 0 re-arms
+ * it every period ticks until it is cancelled. Returns 0 when the pool is
+ * exhausted or the callback is missing.
+ */
+timer_id_t timer_add_periodic(uint64_t deadline, uint64_t period, timer_fn_t callback, void *arg) {
+  if (!callback) {
+    return 0;
+  }
+  uint64_t flags = spin_lock_irqsave(&wheel_lock);
+  timer_entry_t *entry = free_list;
+  if (!entry) {
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return 0;
+  }
+  free_list = entry->next;
+  entry->expires = deadline;
+  entry->period = period;
+  entry->fn = callback;
+  entry->arg = arg;
+  entry->state = TIMER_PENDING;
+  pending_count++;
+  wheel_insert(entry);
+  timer_id_t id = entry_id(entry);
+  spin_unlock_irqrestore(&wheel_lock, flags);
+  return id;
+}
+
+timer_id_t timer_add(uint64_t deadline, timer_fn_t callback, void *arg) {
+  return timer_add_periodic(deadline, 0, callback, arg);
+}
+
+/*
+ * Returns 0 if the timer will not fire again and -1 for a handle that has
+ * already fired or been cancelled. A callback that is running right now
+ * finishes, but a periodic timer is not re-armed afterwards.
+ */
+int timer_cancel(timer_id_t id) {
+  uint64_t flags = spin_lock_irqsave(&wheel_lock);
+  timer_entry_t *entry = entry_lookup(id);
+  if (!entry || entry->state == TIMER_CANCELLED) {
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return -1;
+  }
+  if (entry->state == TIMER_RUNNING) {
+    entry->state = TIMER_CANCELLED;
+  } else {
+    list_remove(entry);
+    entry_free(entry);
+  }
+  spin_unlock_irqrestore(&wheel_lock, flags);
+  return 0;
+}
+
+/* First tick the wheel needs the CPU for; the idle thread programs the NO_HZ wakeup from it. */
+uint64_t timer_wheel_next(void) {
+  return next_expiry;
+}
+
+/* Called from the timer interrupt: wakes the timer thread once the earliest deadline is due. */
+void timer_wheel_poll(uint64_t now) {
+  if (now >= next_expiry && timer_task) {
+    scheduler_wake(timer_task);
+  }
+}
+
+void timer_wheel_stats(timer_wheel_stats_t *out) {
+  uint64_t flags = spin_lock_irqsave(&wheel_lock);
+  out->pending = pending_count;
+  out->capacity = TIMER_MAX;
+  out->fired = fired_count;
+  out->cascaded = cascade_count;
+  out->next_expiry = next_expiry;
+  spin_unlock_irqrestore(&wheel_lock, flags);
+}
@@ -1,28 +1,148 @@
 #include "kernel/vfs.h"
+#include "kernel/heap.h"
+#include "kernel/mm.h"
+#include "kernel/rwlock.h"
+#include "kernel/spinlock.h"
 
-#define VFS_MAX_NODES 32
+#define VFS_MAX_NODES (1u << 22)
+#define VFS_CHUNK_SHIFT 6
+#define VFS_CHUNK_NODES (1u << VFS_CHUNK_SHIFT)
+#define VFS_CHUNKS_MIN 8
 #define VFS_NAME_MAX 16
-#define VFS_DATA_MAX 128
+#define VFS_EXTENT_SIZE MM_PAGE_SIZE
+#define VFS_EXTENTS_MIN 4
+#define VFS_DIR_BUCKETS_MIN 8
+#define VFS_REHASH_STEP 4
+#define VFS_DCACHE_SIZE 256
+#define VFS_DCACHE_PATH_MAX 48
+#define VFS_OPEN_MAX 64
 
 typedef enum {
   VFS_NODE_DIR = 1,
   VFS_NODE_FILE = 2
 } vfs_node_type_t;
 
+typedef enum {
+  VFS_DCACHE_RESOLVE = 1,
+  VFS_DCACHE_PARENT = 2
+} vfs_dcache_kind_t;
+
+/*
+ * Memoized (start_dir, path) lookups. A failed lookup is kept as a negative
+ * entry (result < 0). Removals bump vfs_dcache_gen and drop every entry, since
+ * node indices get reused; creations only bump vfs_dcache_neg_gen, because a
+ * new name can turn a miss into a hit but never changes a successful lookup.
+ */
+typedef struct {
+  uint32_t gen;
+  uint32_t neg_gen;
+  uint32_t hash;
+  int32_t start_dir;
+  int32_t result;
+  uint8_t kind;
+  char path[VFS_DCACHE_PATH_MAX];
+  char name[VFS_NAME_MAX];
+} vfs_dcache_entry_t;
+
+/*
+ * Per-directory state: a name index whose chains are linked through
+ * vfs_node_t.hash_next, and the list of children in creation order linked
+ * through vfs_node_t.next_sibling/prev_sibling. Growing the index allocates
+ * a second table and migrates a few buckets per insert or removal, so no
+ * single operation pays for rehashing the whole directory. Lookups only
+ * read both tables, which lets them run under the shared side of vfs_lock.
+ */
+typedef struct {
+  int32_t *buckets[2];
+  uint32_t mask[2];
+  uint32_t rehash_index;
+  uint32_t count;
+  int32_t first_child;
+  int32_t last_child;
+} vfs_dir_t;
+
+/* File contents: page-sized extents allocated on demand, indexed by offset / VFS_EXTENT_SIZE. */
 typedef struct {
+  char **extents;
+  uint32_t extent_count;
+  uint32_t extent_capacity;
+} vfs_file_t;
+
+/* Metadata only; contents and directory state live behind the pointer. */
+typedef struct __attribute__((aligned(64))) {
   char name[VFS_NAME_MAX];
-  char data[VFS_DATA_MAX];
-  uint16_t size;
-  int16_t parent;
+  uint32_t name_hash;
+  uint32_t size;
+  int32_t parent;
+  int32_t hash_next;
+  int32_t next_sibling;
+  int32_t prev_sibling;
   uint8_t used;
   uint8_t type;
+  uint16_t open_count;
+  union {
+    vfs_dir_t *dir;
+    vfs_file_t *file;
+  };
 } vfs_node_t;
 
-static vfs_node_t vfs_nodes[VFS_MAX_NODES];
+_Static_assert(sizeof(vfs_node_t) == 64, "vfs_node_t should fill one cache line");
+
+_Static_assert(sizeof(vfs_node_t) * VFS_CHUNK_NODES == MM_PAGE_SIZE,
+               "a node chunk should fill exactly one page");
+
+/*
+ * Nodes live in page-sized chunks reached through a growable chunk table, so
+ * node indices stay stable while the table grows. Free nodes are chained
+ * through hash_next.
+ */
+static vfs_node_t **vfs_chunks = 0;
+static uint32_t vfs_chunk_count = 0;
+static uint32_t vfs_chunk_capacity = 0;
+static int32_t vfs_free_head = -1;
+static uint32_t vfs_used_count = 0;
+static uint32_t vfs_file_total = 0;
+static uint32_t vfs_dir_total = 0;
+
+/* Open-file table; a node with open descriptors cannot be removed, so its index stays valid. */
+typedef struct {
+  int32_t node;
+  uint32_t offset;
+  uint32_t flags;
+  int32_t next_free;
+} vfs_open_file_t;
+
+static vfs_open_file_t vfs_open_files[VFS_OPEN_MAX];
+static int32_t vfs_open_free = -1;
+
+static vfs_dcache_entry_t vfs_dcache[VFS_DCACHE_SIZE];
+static uint32_t vfs_dcache_gen = 1;
+static uint32_t vfs_dcache_neg_gen = 1;
+static vfs_dcache_stats_t vfs_dcache_counters;
 static uint8_t vfs_ready = 0;
 
-static uint16_t vfs_strlen(const char *s) {
-  uint16_t len = 0;
+/*
+ * vfs_lock covers the whole tree and the open-file table: lookups and reads
+ * take it shared, anything that changes a node, a directory or a descriptor
+ * takes it exclusive. Public functions lock; the *_locked variants they
+ * wrap expect the caller to hold it. The dcache is filled by lookups, so it
+ * has its own lock, nested inside vfs_lock. Names returned by vfs_name()
+ * stay valid only until the node is removed.
+ */
+static rwlock_t vfs_lock = RWLOCK_INIT("vfs");
+static spinlock_t vfs_dcache_lock = SPINLOCK_INIT("vfs-dcache");
+
+static inline vfs_node_t *vfs_node_at(int index) {
+  return &vfs_chunks[(uint32_t)index >> VFS_CHUNK_SHIFT][(uint32_t)index & (VFS_CHUNK_NODES - 1)];
+}
+
+static inline int vfs_valid(int index) {
+  return index >= 0 && (uint32_t)index < vfs_chunk_count * VFS_CHUNK_NODES &&
+         vfs_node_at(index)->used;
+}
+
+static uint32_t vfs_strlen(const char *s) {
+  uint32_t len = 0;
   while (s && s[len]) {
     len++;
   }
@@ -48,20 +168,380 @@ static int vfs_streq(const char *a, const char *b) {
   return a[i] == b[i];
 }
 
-static int vfs_find_free(void) {
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    if (!vfs_nodes[i].used) {
-      return (int)i;
+static uint32_t vfs_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  while (*name) {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int32_t *vfs_buckets_alloc(uint32_t count) {
+  int32_t *buckets = (int32_t *)kmalloc(count * sizeof(int32_t));
+  if (!buckets) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    buckets[i] = -1;
+  }
+  return buckets;
+}
+
+static vfs_dir_t *vfs_dir_create(void) {
+  vfs_dir_t *dir = (vfs_dir_t *)kmalloc(sizeof(vfs_dir_t));
+  if (!dir) {
+    return 0;
+  }
+  dir->buckets[0] = vfs_buckets_alloc(VFS_DIR_BUCKETS_MIN);
+  if (!dir->buckets[0]) {
+    kfree(dir);
+    return 0;
+  }
+  dir->mask[0] = VFS_DIR_BUCKETS_MIN - 1;
+  dir->buckets[1] = 0;
+  dir->mask[1] = 0;
+  dir->rehash_index = 0;
+  dir->count = 0;
+  dir->first_child = -1;
+  dir->last_child = -1;
+  return dir;
+}
+
+static void vfs_dir_destroy(vfs_dir_t *dir) {
+  if (!dir) {
+    return;
+  }
+  kfree(dir->buckets[0]);
+  kfree(dir->buckets[1]);
+  kfree(dir);
+}
+
+static vfs_dir_t *vfs_dir_of(int index) {
+  if (!vfs_valid(index) ||
+      vfs_node_at(index)->type != VFS_NODE_DIR) {
+    return 0;
+  }
+  return vfs_node_at(index)->dir;
+}
+
+static vfs_file_t *vfs_file_create(void) {
+  vfs_file_t *file = (vfs_file_t *)kmalloc(sizeof(vfs_file_t));
+  if (!file) {
+    return 0;
+  }
+  file->extents = 0;
+  file->extent_count = 0;
+  file->extent_capacity = 0;
+  return file;
+}
+
+static void vfs_file_shrink(vfs_file_t *file, uint32_t extent_count) {
+  while (file->extent_count > extent_count) {
+    char *extent = file->extents[--file->extent_count];
+    mm_free_page(mm_virt_to_phys(extent));
+  }
+}
+
+static void vfs_file_destroy(vfs_file_t *file) {
+  if (!file) {
+    return;
+  }
+  vfs_file_shrink(file, 0);
+  kfree(file->extents);
+  kfree(file);
+}
+
+static int vfs_file_reserve(vfs_file_t *file, uint32_t extent_count) {
+  if (extent_count > file->extent_capacity) {
+    uint32_t capacity = file->extent_capacity ? file->extent_capacity : VFS_EXTENTS_MIN;
+    while (capacity < extent_count) {
+      capacity *= 2;
+    }
+    char **extents = (char **)kmalloc(capacity * sizeof(char *));
+    if (!extents) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < file->extent_count; ++i) {
+      extents[i] = file->extents[i];
     }
+    kfree(file->extents);
+    file->extents = extents;
+    file->extent_capacity = capacity;
   }
-  return -1;
+  while (file->extent_count < extent_count) {
+    uint64_t page = mm_alloc_page();
+    if (!page) {
+      return -1;
+    }
+    file->extents[file->extent_count++] = (char *)mm_phys_to_virt(page);
+  }
+  return 0;
+}
+
+static uint32_t vfs_extents_for(uint32_t size) {
+  return (size + VFS_EXTENT_SIZE - 1) / VFS_EXTENT_SIZE;
+}
+
+static void vfs_file_fill(vfs_file_t *file, uint32_t offset, const char *data, uint32_t len) {
+  while (len > 0) {
+    char *extent = file->extents[offset / VFS_EXTENT_SIZE];
+    uint32_t at = offset % VFS_EXTENT_SIZE;
+    uint32_t chunk = VFS_EXTENT_SIZE - at;
+    if (chunk > len) {
+      chunk = len;
+    }
+    for (uint32_t i = 0; i < chunk; ++i) {
+      extent[at + i] = data ? data[i] : 0;
+    }
+    if (data) {
+      data += chunk;
+    }
+    offset += chunk;
+    len -= chunk;
+  }
+}
+
+static int vfs_file_write(int index, uint32_t offset, const char *data, uint32_t len) {
+  if (len > 0x7FFFFFFFu) {
+    return -1;
+  }
+  vfs_node_t *node = vfs_node_at(index);
+  uint32_t end = offset + len;
+  if (end < offset) {
+    return -1;
+  }
+  if (vfs_file_reserve(node->file, vfs_extents_for(end)) != 0) {
+    return -2;
+  }
+  if (offset > node->size) {
+    vfs_file_fill(node->file, node->size, 0, offset - node->size);
+  }
+  vfs_file_fill(node->file, offset, data, len);
+  if (end > node->size) {
+    node->size = end;
+  }
+  return (int)len;
+}
+
+static void vfs_file_truncate(int index, uint32_t size) {
+  vfs_node_t *node = vfs_node_at(index);
+  if (size >= node->size) {
+    return;
+  }
+  vfs_file_shrink(node->file, vfs_extents_for(size));
+  node->size = size;
+}
+
+static int vfs_file_read(int index, uint32_t offset, char *buf, uint32_t len) {
+  const vfs_node_t *node = vfs_node_at(index);
+  if (offset >= node->size) {
+    return 0;
+  }
+  if (len > node->size - offset) {
+    len = node->size - offset;
+  }
+  uint32_t done = 0;
+  while (done < len) {
+    const char *extent = node->file->extents[(offset + done) / VFS_EXTENT_SIZE];
+    uint32_t at = (offset + done) % VFS_EXTENT_SIZE;
+    uint32_t chunk = VFS_EXTENT_SIZE - at;
+    if (chunk > len - done) {
+      chunk = len - done;
+    }
+    for (uint32_t i = 0; i < chunk; ++i) {
+      buf[done + i] = extent[at + i];
+    }
+    done += chunk;
+  }
+  return (int)len;
+}
+
+static void vfs_dir_rehash_step(vfs_dir_t *dir) {
+  if (!dir->buckets[1]) {
+    return;
+  }
+  for (uint8_t step = 0; step < VFS_REHASH_STEP && dir->rehash_index <= dir->mask[0]; ++step) {
+    int32_t node = dir->buckets[0][dir->rehash_index];
+    while (node >= 0) {
+      int32_t next = vfs_node_at(node)->hash_next;
+      uint32_t slot = vfs_node_at(node)->name_hash & dir->mask[1];
+      vfs_node_at(node)->hash_next = dir->buckets[1][slot];
+      dir->buckets[1][slot] = node;
+      node = next;
+    }
+    dir->buckets[0][dir->rehash_index++] = -1;
+  }
+  if (dir->rehash_index > dir->mask[0]) {
+    kfree(dir->buckets[0]);
+    dir->buckets[0] = dir->buckets[1];
+    dir->mask[0] = dir->mask[1];
+    dir->buckets[1] = 0;
+    dir->mask[1] = 0;
+    dir->rehash_index = 0;
+  }
+}
+
+static void vfs_dir_insert(int parent, int index) {
+  vfs_dir_t *dir = vfs_dir_of(parent);
+  if (!dir) {
+    return;
+  }
+  vfs_dir_rehash_step(dir);
+  if (!dir->buckets[1] && dir->count > dir->mask[0]) {
+    uint32_t size = (dir->mask[0] + 1) * 2;
+    dir->buckets[1] = vfs_buckets_alloc(size);
+    if (dir->buckets[1]) {
+      dir->mask[1] = size - 1;
+      dir->rehash_index = 0;
+    }
+  }
+  uint8_t table = dir->buckets[1] ? 1 : 0;
+  uint32_t slot = vfs_node_at(index)->name_hash & dir->mask[table];
+  vfs_node_at(index)->hash_next = dir->buckets[table][slot];
+  dir->buckets[table][slot] = index;
+  vfs_node_at(index)->prev_sibling = dir->last_child;
+  vfs_node_at(index)->next_sibling = -1;
+  if (dir->last_child >= 0) {
+    vfs_node_at(dir->last_child)->next_sibling = index;
+  } else {
+    dir->first_child = index;
+  }
+  dir->last_child = index;
+  dir->count++;
+}
+
+static void vfs_dir_remove(int parent, int index) {
+  vfs_dir_t *dir = vfs_dir_of(parent);
+  if (!dir) {
+    return;
+  }
+  vfs_dir_rehash_step(dir);
+  int32_t prev = vfs_node_at(index)->prev_sibling;
+  int32_t next = vfs_node_at(index)->next_sibling;
+  if (prev >= 0) {
+    vfs_node_at(prev)->next_sibling = next;
+  } else {
+    dir->first_child = next;
+  }
+  if (next >= 0) {
+    vfs_node_at(next)->prev_sibling = prev;
+  } else {
+    dir->last_child = prev;
+  }
+  vfs_node_at(index)->prev_sibling = -1;
+  vfs_node_at(index)->next_sibling = -1;
+  for (uint8_t table = 0; table < 2; ++table) {
+    if (!dir->buckets[table]) {
+      continue;
+    }
+    int32_t *link = &dir->buckets[table][vfs_node_at(index)->name_hash & dir->mask[table]];
+    while (*link >= 0) {
+      if (*link == index) {
+        *link = vfs_node_at(index)->hash_next;
+        vfs_node_at(index)->hash_next = -1;
+        dir->count--;
+        return;
+      }
+      link = &vfs_node_at(*link)->hash_next;
+    }
+  }
+}
+
+static void vfs_node_reset(vfs_node_t *node) {
+  node->used = 0;
+  node->type = 0;
+  node->size = 0;
+  node->parent = -1;
+  node->name[0] = '\0';
+  node->name_hash = 0;
+  node->hash_next = -1;
+  node->next_sibling = -1;
+  node->prev_sibling = -1;
+  node->open_count = 0;
+  node->dir = 0;
+}
+
+static int vfs_grow(void) {
+  if ((vfs_chunk_count + 1) * VFS_CHUNK_NODES > VFS_MAX_NODES) {
+    return -1;
+  }
+  if (vfs_chunk_count == vfs_chunk_capacity) {
+    uint32_t capacity = vfs_chunk_capacity ? vfs_chunk_capacity * 2 : VFS_CHUNKS_MIN;
+    vfs_node_t **chunks = (vfs_node_t **)kmalloc(capacity * sizeof(vfs_node_t *));
+    if (!chunks) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < vfs_chunk_count; ++i) {
+      chunks[i] = vfs_chunks[i];
+    }
+    kfree(vfs_chunks);
+    vfs_chunks = chunks;
+    vfs_chunk_capacity = capacity;
+  }
+  uint64_t page = mm_alloc_page();
+  if (!page) {
+    return -1;
+  }
+  vfs_node_t *chunk = (vfs_node_t *)mm_phys_to_virt(page);
+  uint32_t base = vfs_chunk_count * VFS_CHUNK_NODES;
+  vfs_chunks[vfs_chunk_count++] = chunk;
+  for (uint32_t i = VFS_CHUNK_NODES; i > 0; --i) {
+    vfs_node_reset(&chunk[i - 1]);
+    chunk[i - 1].hash_next = vfs_free_head;
+    vfs_free_head = (int32_t)(base + i - 1);
+  }
+  return 0;
+}
+
+static int vfs_node_alloc(uint8_t type) {
+  if (vfs_free_head < 0 && vfs_grow() != 0) {
+    return -1;
+  }
+  int index = vfs_free_head;
+  vfs_node_t *node = vfs_node_at(index);
+  vfs_free_head = node->hash_next;
+  vfs_node_reset(node);
+  node->used = 1;
+  node->type = type;
+  vfs_used_count++;
+  if (type == VFS_NODE_DIR) {
+    vfs_dir_total++;
+  } else {
+    vfs_file_total++;
+  }
+  return index;
+}
+
+static void vfs_node_release(int index) {
+  vfs_node_t *node = vfs_node_at(index);
+  if (node->type == VFS_NODE_DIR) {
+    vfs_dir_total--;
+  } else {
+    vfs_file_total--;
+  }
+  vfs_used_count--;
+  vfs_node_reset(node);
+  node->hash_next = vfs_free_head;
+  vfs_free_head = index;
 }
 
 static int vfs_find_child(int parent, const char *name) {
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    if (vfs_nodes[i].used && vfs_nodes[i].parent == parent &&
-        vfs_streq(vfs_nodes[i].name, name)) {
-      return (int)i;
+  vfs_dir_t *dir = vfs_dir_of(parent);
+  if (!dir) {
+    return -1;
+  }
+  uint32_t hash = vfs_hash(name);
+  for (uint8_t table = 0; table < 2; ++table) {
+    if (!dir->buckets[table]) {
+      continue;
+    }
+    int32_t node = dir->buckets[table][hash & dir->mask[table]];
+    while (node >= 0) {
+      if (vfs_node_at(node)->name_hash == hash && vfs_streq(vfs_node_at(node)->name, name)) {
+        return (int)node;
+      }
+      node = vfs_node_at(node)->hash_next;
     }
   }
   return -1;
@@ -84,77 +564,232 @@ static uint8_t vfs_split(const char *path, char *part, uint16_t part_size, uint1
   return 1;
 }
 
+static void vfs_dcache_reset(void) {
+  for (uint32_t i = 0; i < VFS_DCACHE_SIZE; ++i) {
+    vfs_dcache[i].gen = 0;
+  }
+  vfs_dcache_gen = 1;
+  vfs_dcache_neg_gen = 1;
+}
+
+static void vfs_dcache_invalidate(void) {
+  uint64_t flags = spin_lock_irqsave(&vfs_dcache_lock);
+  vfs_dcache_gen++;
+  vfs_dcache_counters.invalidations++;
+  spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+}
+
+static void vfs_dcache_invalidate_negative(void) {
+  uint64_t flags = spin_lock_irqsave(&vfs_dcache_lock);
+  vfs_dcache_neg_gen++;
+  vfs_dcache_counters.invalidations++;
+  spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+}
+
+static void vfs_dcache_count_uncached(void) {
+  uint64_t flags = spin_lock_irqsave(&vfs_dcache_lock);
+  vfs_dcache_counters.uncached++;
+  spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+}
+
+static uint32_t vfs_dcache_hash(const char *path, int start_dir, uint8_t kind) {
+  uint32_t hash = vfs_hash(path);
+  hash ^= (uint32_t)start_dir * 2654435761u;
+  return hash ^ kind;
+}
+
+/* On a hit copies the cached result (and, for parent lookups, the last name) out and returns 1. */
+static int vfs_dcache_lookup(const char *path, int start_dir, uint8_t kind, uint32_t hash,
+                             int *result, char *name, uint16_t name_size) {
+  uint64_t flags = spin_lock_irqsave(&vfs_dcache_lock);
+  vfs_dcache_counters.lookups++;
+  const vfs_dcache_entry_t *entry = &vfs_dcache[hash & (VFS_DCACHE_SIZE - 1)];
+  if (entry->gen != vfs_dcache_gen || entry->hash != hash || entry->kind != kind ||
+      entry->start_dir != start_dir || !vfs_streq(entry->path, path) ||
+      (entry->result < 0 && entry->neg_gen != vfs_dcache_neg_gen)) {
+    vfs_dcache_counters.misses++;
+    spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+    return 0;
+  }
+  if (entry->result < 0) {
+    vfs_dcache_counters.negative_hits++;
+  } else if (name) {
+    vfs_strcpy(name, entry->name, name_size);
+  }
+  vfs_dcache_counters.hits++;
+  *result = entry->result;
+  spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+  return 1;
+}
+
+static void vfs_dcache_store(const char *path, int start_dir, uint8_t kind, uint32_t hash,
+                             int result, const char *name) {
+  uint64_t flags = spin_lock_irqsave(&vfs_dcache_lock);
+  vfs_dcache_entry_t *entry = &vfs_dcache[hash & (VFS_DCACHE_SIZE - 1)];
+  entry->gen = vfs_dcache_gen;
+  entry->neg_gen = vfs_dcache_neg_gen;
+  entry->hash = hash;
+  entry->start_dir = start_dir;
+  entry->result = result;
+  entry->kind = kind;
+  vfs_strcpy(entry->path, path, VFS_DCACHE_PATH_MAX);
+  vfs_strcpy(entry->name, name ? name : "", VFS_NAME_MAX);
+  spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+}
+
 static void vfs_clear_node(int index) {
-  vfs_nodes[index].used = 0;
-  vfs_nodes[index].size = 0;
-  vfs_nodes[index].parent = -1;
-  vfs_nodes[index].type = 0;
-  vfs_nodes[index].name[0] = '\0';
-  vfs_nodes[index].data[0] = '\0';
+  vfs_dcache_invalidate();
+  vfs_node_t *node = vfs_node_at(index);
+  if (node->parent >= 0) {
+    vfs_dir_remove(node->parent, index);
+  }
+  if (node->type == VFS_NODE_DIR) {
+    vfs_dir_destroy(node->dir);
+  } else if (node->type == VFS_NODE_FILE) {
+    vfs_file_destroy(node->file);
+  }
+  vfs_node_release(index);
 }
 
-void vfs_init(void) {
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    vfs_clear_node(i);
-  }
-  vfs_nodes[0].used = 1;
-  vfs_nodes[0].type = VFS_NODE_DIR;
-  vfs_nodes[0].parent = -1;
-  vfs_strcpy(vfs_nodes[0].name, "/", VFS_NAME_MAX);
-  vfs_write_at(0, "readme.txt", "Witaj w 2026-OS!\n");
+/*
+ * Frees every node chunk together with the directory tables and file
+ * extents its nodes own, so re-initialising after a corrupt root does not
+ * leak the tree it drops. The chunk table is kept for reuse.
+ */
+static void vfs_release_all(void) {
+  for (uint32_t c = 0; c < vfs_chunk_count; ++c) {
+    vfs_node_t *chunk = vfs_chunks[c];
+    for (uint32_t i = 0; i < VFS_CHUNK_NODES; ++i) {
+      vfs_node_t *node = &chunk[i];
+      if (!node->used) {
+        continue;
+      }
+      if (node->type == VFS_NODE_DIR) {
+        vfs_dir_destroy(node->dir);
+      } else if (node->type == VFS_NODE_FILE) {
+        vfs_file_destroy(node->file);
+      }
+    }
+    mm_free_page(mm_virt_to_phys(chunk));
+  }
+  vfs_chunk_count = 0;
+}
+
+static int vfs_write_at_locked(int parent, const char *name, const char *data);
+
+static void vfs_init_locked(void) {
+  vfs_dcache_reset();
+  vfs_open_free = -1;
+  for (int fd = VFS_OPEN_MAX - 1; fd >= 0; --fd) {
+    vfs_open_files[fd].node = -1;
+    vfs_open_files[fd].next_free = vfs_open_free;
+    vfs_open_free = fd;
+  }
+  vfs_release_all();
+  vfs_ready = 0;
+  vfs_free_head = -1;
+  vfs_used_count = 0;
+  vfs_file_total = 0;
+  vfs_dir_total = 0;
+  int root = vfs_node_alloc(VFS_NODE_DIR);
+  if (root != 0) {
+    return;
+  }
+  vfs_node_at(root)->parent = -1;
+  vfs_strcpy(vfs_node_at(root)->name, "/", VFS_NAME_MAX);
+  vfs_node_at(root)->name_hash = vfs_hash(vfs_node_at(root)->name);
+  vfs_node_at(root)->dir = vfs_dir_create();
+  vfs_write_at_locked(root, "readme.txt", "Witaj w 2026-OS!\n");
   vfs_ready = 1;
 }
 
-void vfs_sanitize(void) {
+void vfs_init(void) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  vfs_init_locked();
+  write_unlock_irqrestore(&vfs_lock, flags);
+}
+
+static void vfs_sanitize_locked(void) {
   if (!vfs_ready) {
-    vfs_init();
+    vfs_init_locked();
     return;
   }
-  if (!vfs_nodes[0].used || vfs_nodes[0].type != VFS_NODE_DIR ||
-      vfs_nodes[0].parent != -1 || !vfs_streq(vfs_nodes[0].name, "/")) {
-    vfs_init();
+  if (!vfs_valid(0) || vfs_node_at(0)->type != VFS_NODE_DIR ||
+      vfs_node_at(0)->parent != -1 || !vfs_streq(vfs_node_at(0)->name, "/")) {
+    vfs_init_locked();
   }
 }
 
+void vfs_sanitize(void) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  vfs_sanitize_locked();
+  write_unlock_irqrestore(&vfs_lock, flags);
+}
+
 int vfs_root(void) {
   return 0;
 }
 
-int vfs_is_dir(int index) {
-  if (index < 0 || index >= VFS_MAX_NODES || !vfs_nodes[index].used) {
+static int vfs_is_dir_locked(int index) {
+  if (!vfs_valid(index)) {
     return 0;
   }
-  return vfs_nodes[index].type == VFS_NODE_DIR;
+  return vfs_node_at(index)->type == VFS_NODE_DIR;
 }
 
-const char *vfs_name(int index) {
-  if (index < 0 || index >= VFS_MAX_NODES || !vfs_nodes[index].used) {
+int vfs_is_dir(int index) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_is_dir_locked(index);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static const char *vfs_name_locked(int index) {
+  if (!vfs_valid(index)) {
     return 0;
   }
-  return vfs_nodes[index].name;
+  return vfs_node_at(index)->name;
 }
 
-int vfs_parent(int index) {
-  if (index < 0 || index >= VFS_MAX_NODES || !vfs_nodes[index].used) {
+const char *vfs_name(int index) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  const char *result = vfs_name_locked(index);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_parent_locked(int index) {
+  if (!vfs_valid(index)) {
     return -1;
   }
-  return vfs_nodes[index].parent;
+  return vfs_node_at(index)->parent;
 }
 
-int vfs_node_size(int index) {
-  if (index < 0 || index >= VFS_MAX_NODES || !vfs_nodes[index].used) {
+int vfs_parent(int index) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_parent_locked(index);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_node_size_locked(int index) {
+  if (!vfs_valid(index)) {
     return -1;
   }
-  if (vfs_nodes[index].type != VFS_NODE_FILE) {
+  if (vfs_node_at(index)->type != VFS_NODE_FILE) {
     return -1;
   }
-  return vfs_nodes[index].size;
+  return (int)vfs_node_at(index)->size;
 }
 
-int vfs_resolve(const char *path, int start_dir) {
-  if (!path || !path[0]) {
-    return start_dir;
-  }
+int vfs_node_size(int index) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_node_size_locked(index);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_resolve_walk(const char *path, int start_dir) {
   int current = (path[0] == '/') ? vfs_root() : start_dir;
   uint16_t offset = 0;
   char part[VFS_NAME_MAX];
@@ -163,7 +798,7 @@ int vfs_resolve(const char *path, int start_dir) {
       continue;
     }
     if (vfs_streq(part, "..")) {
-      int parent = vfs_parent(current);
+      int parent = vfs_parent_locked(current);
       if (parent >= 0) {
         current = parent;
       }
@@ -178,10 +813,8 @@ int vfs_resolve(const char *path, int start_dir) {
   return current;
 }
 
-int vfs_resolve_parent(const char *path, int start_dir, char *out_name, uint16_t out_size) {
-  if (!path || !path[0]) {
-    return -1;
-  }
+static int vfs_resolve_parent_walk(const char *path, int start_dir, char *out_name,
+                                   uint16_t out_size) {
   int current = (path[0] == '/') ? vfs_root() : start_dir;
   uint16_t offset = 0;
   char part[VFS_NAME_MAX];
@@ -192,7 +825,7 @@ int vfs_resolve_parent(const char *path, int start_dir, char *out_name, uint16_t
       continue;
     }
     if (vfs_streq(part, "..")) {
-      int parent = vfs_parent(current);
+      int parent = vfs_parent_locked(current);
       if (parent >= 0) {
         current = parent;
       }
@@ -201,7 +834,7 @@ int vfs_resolve_parent(const char *path, int start_dir, char *out_name, uint16_t
     vfs_strcpy(last, part, VFS_NAME_MAX);
     if (path[offset] == '/') {
       int next = vfs_find_child(current, part);
-      if (next < 0 || !vfs_is_dir(next)) {
+      if (next < 0 || !vfs_is_dir_locked(next)) {
         return -1;
       }
       current = next;
@@ -214,168 +847,516 @@ int vfs_resolve_parent(const char *path, int start_dir, char *out_name, uint16_t
   return current;
 }
 
-int vfs_mkdir_at(int parent, const char *name) {
+static int vfs_resolve_locked(const char *path, int start_dir) {
+  if (!path || !path[0]) {
+    return start_dir;
+  }
+  if (path[0] == '/') {
+    start_dir = vfs_root();
+  }
+  if (vfs_strlen(path) >= VFS_DCACHE_PATH_MAX) {
+    vfs_dcache_count_uncached();
+    return vfs_resolve_walk(path, start_dir);
+  }
+  uint32_t hash = vfs_dcache_hash(path, start_dir, VFS_DCACHE_RESOLVE);
+  int result;
+  if (vfs_dcache_lookup(path, start_dir, VFS_DCACHE_RESOLVE, hash, &result, 0, 0)) {
+    return result;
+  }
+  result = vfs_resolve_walk(path, start_dir);
+  vfs_dcache_store(path, start_dir, VFS_DCACHE_RESOLVE, hash, result, 0);
+  return result;
+}
+
+int vfs_resolve(const char *path, int start_dir) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_resolve_locked(path, start_dir);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_resolve_parent_locked(const char *path, int start_dir, char *out_name,
+                                     uint16_t out_size) {
+  if (!path || !path[0]) {
+    return -1;
+  }
+  if (path[0] == '/') {
+    start_dir = vfs_root();
+  }
+  if (vfs_strlen(path) >= VFS_DCACHE_PATH_MAX) {
+    vfs_dcache_count_uncached();
+    return vfs_resolve_parent_walk(path, start_dir, out_name, out_size);
+  }
+  uint32_t hash = vfs_dcache_hash(path, start_dir, VFS_DCACHE_PARENT);
+  int result;
+  if (vfs_dcache_lookup(path, start_dir, VFS_DCACHE_PARENT, hash, &result, out_name, out_size)) {
+    return result;
+  }
+  char name[VFS_NAME_MAX];
+  result = vfs_resolve_parent_walk(path, start_dir, name, VFS_NAME_MAX);
+  vfs_dcache_store(path, start_dir, VFS_DCACHE_PARENT, hash, result, result >= 0 ? name : 0);
+  if (result >= 0) {
+    vfs_strcpy(out_name, name, out_size);
+  }
+  return result;
+}
+
+int vfs_resolve_parent(const char *path, int start_dir, char *out_name, uint16_t out_size) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_resolve_parent_locked(path, start_dir, out_name, out_size);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+void vfs_dcache_stats(vfs_dcache_stats_t *out) {
+  if (out) {
+    uint64_t flags = spin_lock_irqsave(&vfs_dcache_lock);
+    *out = vfs_dcache_counters;
+    spin_unlock_irqrestore(&vfs_dcache_lock, flags);
+  }
+}
+
+static int vfs_mkdir_at_locked(int parent, const char *name) {
   if (!name || !name[0]) {
     return -1;
   }
   if (vfs_strlen(name) >= VFS_NAME_MAX) {
     return -2;
   }
-  if (parent < 0 || !vfs_is_dir(parent)) {
+  if (parent < 0 || !vfs_is_dir_locked(parent)) {
     return -3;
   }
   if (vfs_find_child(parent, name) >= 0) {
     return -4;
   }
-  int slot = vfs_find_free();
+  vfs_dir_t *dir = vfs_dir_create();
+  if (!dir) {
+    return -5;
+  }
+  int slot = vfs_node_alloc(VFS_NODE_DIR);
   if (slot < 0) {
+    vfs_dir_destroy(dir);
     return -5;
   }
-  vfs_nodes[slot].used = 1;
-  vfs_nodes[slot].type = VFS_NODE_DIR;
-  vfs_nodes[slot].parent = parent;
-  vfs_strcpy(vfs_nodes[slot].name, name, VFS_NAME_MAX);
-  vfs_nodes[slot].size = 0;
-  vfs_nodes[slot].data[0] = '\0';
+  vfs_node_at(slot)->parent = parent;
+  vfs_strcpy(vfs_node_at(slot)->name, name, VFS_NAME_MAX);
+  vfs_node_at(slot)->name_hash = vfs_hash(vfs_node_at(slot)->name);
+  vfs_node_at(slot)->dir = dir;
+  vfs_dir_insert(parent, slot);
+  vfs_dcache_invalidate_negative();
   return 0;
 }
 
-int vfs_rmdir_at(int parent, const char *name) {
+int vfs_mkdir_at(int parent, const char *name) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_mkdir_at_locked(parent, name);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_rmdir_at_locked(int parent, const char *name) {
   int index = vfs_find_child(parent, name);
   if (index < 0) {
     return -1;
   }
-  if (!vfs_is_dir(index)) {
+  if (!vfs_is_dir_locked(index)) {
     return -2;
   }
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    if (vfs_nodes[i].used && vfs_nodes[i].parent == index) {
-      return -3;
-    }
+  if (vfs_node_at(index)->dir && vfs_node_at(index)->dir->count > 0) {
+    return -3;
   }
   vfs_clear_node(index);
   return 0;
 }
 
-int vfs_write_at(int parent, const char *name, const char *data) {
+int vfs_rmdir_at(int parent, const char *name) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_rmdir_at_locked(parent, name);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+/* Returns the existing or newly created file node, or the vfs_write_at error code. */
+static int vfs_lookup_or_create(int parent, const char *name, uint8_t create) {
   if (!name || !name[0]) {
     return -1;
   }
   if (vfs_strlen(name) >= VFS_NAME_MAX) {
     return -2;
   }
-  if (parent < 0 || !vfs_is_dir(parent)) {
+  if (parent < 0 || !vfs_is_dir_locked(parent)) {
     return -3;
   }
-  uint16_t data_len = vfs_strlen(data);
-  if (data_len >= VFS_DATA_MAX) {
-    return -4;
-  }
   int index = vfs_find_child(parent, name);
+  if (index >= 0) {
+    return vfs_is_dir_locked(index) ? -6 : index;
+  }
+  if (!create) {
+    return -7;
+  }
+  vfs_file_t *file = vfs_file_create();
+  if (!file) {
+    return -5;
+  }
+  index = vfs_node_alloc(VFS_NODE_FILE);
   if (index < 0) {
-    int slot = vfs_find_free();
-    if (slot < 0) {
-      return -5;
-    }
-    index = slot;
-    vfs_nodes[index].used = 1;
-    vfs_nodes[index].type = VFS_NODE_FILE;
-    vfs_nodes[index].parent = parent;
-    vfs_strcpy(vfs_nodes[index].name, name, VFS_NAME_MAX);
-  } else if (vfs_is_dir(index)) {
-    return -6;
-  }
-  vfs_strcpy(vfs_nodes[index].data, data, VFS_DATA_MAX);
-  vfs_nodes[index].size = data_len;
+    vfs_file_destroy(file);
+    return -5;
+  }
+  vfs_node_at(index)->file = file;
+  vfs_node_at(index)->parent = parent;
+  vfs_strcpy(vfs_node_at(index)->name, name, VFS_NAME_MAX);
+  vfs_node_at(index)->name_hash = vfs_hash(vfs_node_at(index)->name);
+  vfs_dir_insert(parent, index);
+  vfs_dcache_invalidate_negative();
+  return index;
+}
+
+static int vfs_write_at_locked(int parent, const char *name, const char *data) {
+  int index = vfs_lookup_or_create(parent, name, 1);
+  if (index < 0) {
+    return index;
+  }
+  uint32_t data_len = vfs_strlen(data);
+  if (vfs_file_write(index, 0, data, data_len) < 0) {
+    return -4;
+  }
+  vfs_file_truncate(index, data_len);
   return 0;
 }
 
-const char *vfs_read_at(int parent, const char *name) {
+int vfs_write_at(int parent, const char *name, const char *data) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_write_at_locked(parent, name, data);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_read_at_locked(int parent, const char *name, uint32_t offset, char *buf,
+                              uint32_t size) {
   int index = vfs_find_child(parent, name);
-  if (index < 0 || vfs_is_dir(index)) {
-    return 0;
+  if (index < 0 || vfs_is_dir_locked(index)) {
+    return -1;
   }
-  return vfs_nodes[index].data;
+  return vfs_file_read(index, offset, buf, size);
 }
 
-int vfs_remove_at(int parent, const char *name) {
+int vfs_read_at(int parent, const char *name, uint32_t offset, char *buf, uint32_t size) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_read_at_locked(parent, name, offset, buf, size);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_remove_at_locked(int parent, const char *name) {
   int index = vfs_find_child(parent, name);
-  if (index < 0 || vfs_is_dir(index)) {
+  if (index < 0 || vfs_is_dir_locked(index)) {
     return -1;
   }
+  if (vfs_node_at(index)->open_count > 0) {
+    return -2;
+  }
   vfs_clear_node(index);
   return 0;
 }
 
-uint8_t vfs_list_count(int parent) {
-  if (parent < 0 || parent >= VFS_MAX_NODES || !vfs_nodes[parent].used ||
-      !vfs_is_dir(parent)) {
+int vfs_remove_at(int parent, const char *name) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_remove_at_locked(parent, name);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static vfs_open_file_t *vfs_fd_get(int fd) {
+  if (fd < 0 || fd >= VFS_OPEN_MAX || vfs_open_files[fd].node < 0) {
     return 0;
   }
-  uint8_t count = 0;
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    if (vfs_nodes[i].used && vfs_nodes[i].parent == parent) {
-      count++;
-    }
+  return &vfs_open_files[fd];
+}
+
+static int vfs_open_locked(const char *path, int start_dir, uint32_t flags) {
+  if (!(flags & (VFS_O_READ | VFS_O_WRITE))) {
+    return -1;
+  }
+  if (vfs_open_free < 0) {
+    return -8;
   }
-  return count;
+  char name[VFS_NAME_MAX];
+  int parent = vfs_resolve_parent_locked(path, start_dir, name, VFS_NAME_MAX);
+  if (parent < 0) {
+    return -3;
+  }
+  int index = vfs_lookup_or_create(parent, name, (flags & VFS_O_CREATE) ? 1 : 0);
+  if (index < 0) {
+    return index;
+  }
+  if ((flags & VFS_O_TRUNC) && (flags & VFS_O_WRITE)) {
+    vfs_file_truncate(index, 0);
+  }
+  int fd = vfs_open_free;
+  vfs_open_file_t *file = &vfs_open_files[fd];
+  vfs_open_free = file->next_free;
+  file->node = index;
+  file->offset = 0;
+  file->flags = flags;
+  file->next_free = -1;
+  vfs_node_at(index)->open_count++;
+  return fd;
 }
 
-int vfs_list_at(int parent, uint8_t index) {
-  if (parent < 0 || parent >= VFS_MAX_NODES || !vfs_nodes[parent].used ||
-      !vfs_is_dir(parent)) {
+int vfs_open(const char *path, int start_dir, uint32_t flags) {
+  uint64_t irq = write_lock_irqsave(&vfs_lock);
+  int result = vfs_open_locked(path, start_dir, flags);
+  write_unlock_irqrestore(&vfs_lock, irq);
+  return result;
+}
+
+static int vfs_close_locked(int fd) {
+  vfs_open_file_t *file = vfs_fd_get(fd);
+  if (!file) {
     return -1;
   }
-  uint8_t seen = 0;
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    if (vfs_nodes[i].used && vfs_nodes[i].parent == parent) {
-      if (seen == index) {
-        return (int)i;
-      }
-      seen++;
-    }
+  vfs_node_at(file->node)->open_count--;
+  file->node = -1;
+  file->next_free = vfs_open_free;
+  vfs_open_free = fd;
+  return 0;
+}
+
+int vfs_close(int fd) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_close_locked(fd);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_pread_locked(int fd, void *buf, uint32_t size, uint32_t offset) {
+  vfs_open_file_t *file = vfs_fd_get(fd);
+  if (!file || !(file->flags & VFS_O_READ)) {
+    return -1;
   }
-  return -1;
+  return vfs_file_read(file->node, offset, (char *)buf, size);
+}
+
+int vfs_pread(int fd, void *buf, uint32_t size, uint32_t offset) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_pread_locked(fd, buf, size, offset);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_pwrite_locked(int fd, const void *buf, uint32_t size, uint32_t offset) {
+  vfs_open_file_t *file = vfs_fd_get(fd);
+  if (!file || !(file->flags & VFS_O_WRITE)) {
+    return -1;
+  }
+  return vfs_file_write(file->node, offset, (const char *)buf, size);
+}
+
+int vfs_pwrite(int fd, const void *buf, uint32_t size, uint32_t offset) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_pwrite_locked(fd, buf, size, offset);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_fread_locked(int fd, void *buf, uint32_t size) {
+  vfs_open_file_t *file = vfs_fd_get(fd);
+  if (!file) {
+    return -1;
+  }
+  int read = vfs_pread_locked(fd, buf, size, file->offset);
+  if (read > 0) {
+    file->offset += (uint32_t)read;
+  }
+  return read;
+}
+
+int vfs_fread(int fd, void *buf, uint32_t size) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_fread_locked(fd, buf, size);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_fwrite_locked(int fd, const void *buf, uint32_t size) {
+  vfs_open_file_t *file = vfs_fd_get(fd);
+  if (!file) {
+    return -1;
+  }
+  if (file->flags & VFS_O_APPEND) {
+    file->offset = vfs_node_at(file->node)->size;
+  }
+  int written = vfs_pwrite_locked(fd, buf, size, file->offset);
+  if (written > 0) {
+    file->offset += (uint32_t)written;
+  }
+  return written;
+}
+
+int vfs_fwrite(int fd, const void *buf, uint32_t size) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int result = vfs_fwrite_locked(fd, buf, size);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int64_t vfs_seek_locked(int fd, int64_t offset, int whence) {
+  vfs_open_file_t *file = vfs_fd_get(fd);
+  if (!file) {
+    return -1;
+  }
+  int64_t base = 0;
+  if (whence == VFS_SEEK_CUR) {
+    base = file->offset;
+  } else if (whence == VFS_SEEK_END) {
+    base = vfs_node_at(file->node)->size;
+  } else if (whence != VFS_SEEK_SET) {
+    return -1;
+  }
+  int64_t target = base + offset;
+  if (target < 0 || target > 0xFFFFFFFFll) {
+    return -1;
+  }
+  file->offset = (uint32_t)target;
+  return target;
+}
+
+int64_t vfs_seek(int fd, int64_t offset, int whence) {
+  uint64_t flags = write_lock_irqsave(&vfs_lock);
+  int64_t result = vfs_seek_locked(fd, offset, whence);
+  write_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static uint32_t vfs_list_count_locked(int parent) {
+  if (!vfs_is_dir_locked(parent) || !vfs_node_at(parent)->dir) {
+    return 0;
+  }
+  return vfs_node_at(parent)->dir->count;
+}
+
+uint32_t vfs_list_count(int parent) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  uint32_t result = vfs_list_count_locked(parent);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_opendir_locked(int dir, vfs_dir_cursor_t *cursor) {
+  if (!cursor) {
+    return -1;
+  }
+  cursor->dir = dir;
+  cursor->next = -1;
+  if (!vfs_is_dir_locked(dir) || !vfs_node_at(dir)->dir) {
+    return -1;
+  }
+  cursor->next = vfs_node_at(dir)->dir->first_child;
+  return 0;
+}
+
+int vfs_opendir(int dir, vfs_dir_cursor_t *cursor) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_opendir_locked(dir, cursor);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_readdir_locked(vfs_dir_cursor_t *cursor) {
+  if (!cursor || cursor->next < 0) {
+    return -1;
+  }
+  int node = cursor->next;
+  if (!vfs_valid(node) || vfs_node_at(node)->parent != cursor->dir) {
+    cursor->next = -1;
+    return -1;
+  }
+  cursor->next = vfs_node_at(node)->next_sibling;
+  return node;
+}
+
+int vfs_readdir(vfs_dir_cursor_t *cursor) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_readdir_locked(cursor);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
+}
+
+static int vfs_list_at_locked(int parent, uint32_t index) {
+  vfs_dir_cursor_t cursor;
+  if (vfs_opendir_locked(parent, &cursor) != 0) {
+    return -1;
+  }
+  int node = vfs_readdir_locked(&cursor);
+  while (node >= 0 && index > 0) {
+    node = vfs_readdir_locked(&cursor);
+    index--;
+  }
+  return node;
+}
+
+int vfs_list_at(int parent, uint32_t index) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_list_at_locked(parent, index);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
 }
 
 int vfs_write(const char *name, const char *data) {
   return vfs_write_at(vfs_root(), name, data);
 }
 
-const char *vfs_read(const char *name) {
-  return vfs_read_at(vfs_root(), name);
+int vfs_read(const char *name, uint32_t offset, char *buf, uint32_t size) {
+  return vfs_read_at(vfs_root(), name, offset, buf, size);
 }
 
 int vfs_remove(const char *name) {
   return vfs_remove_at(vfs_root(), name);
 }
 
-int vfs_size(const char *name) {
+static int vfs_size_locked(const char *name) {
   int index = vfs_find_child(vfs_root(), name);
-  if (index < 0 || vfs_is_dir(index)) {
+  if (index < 0 || vfs_is_dir_locked(index)) {
     return -1;
   }
-  return vfs_nodes[index].size;
+  return (int)vfs_node_at(index)->size;
 }
 
-uint8_t vfs_count(void) {
-  uint8_t count = 0;
-  for (uint8_t i = 0; i < VFS_MAX_NODES; ++i) {
-    if (vfs_nodes[i].used) {
-      count++;
-    }
-  }
-  return count;
+int vfs_size(const char *name) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  int result = vfs_size_locked(name);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
 }
 
-const char *vfs_name_at(uint8_t index) {
-  int node = vfs_list_at(vfs_root(), index);
+uint32_t vfs_count(void) {
+  return vfs_used_count;
+}
+
+uint32_t vfs_file_count(void) {
+  return vfs_file_total;
+}
+
+uint32_t vfs_dir_count(void) {
+  return vfs_dir_total;
+}
+
+static const char *vfs_name_at_locked(uint32_t index) {
+  int node = vfs_list_at_locked(vfs_root(), index);
   if (node < 0) {
     return 0;
   }
-  return vfs_nodes[node].name;
+  return vfs_node_at(node)->name;
+}
+
+const char *vfs_name_at(uint32_t index) {
+  uint64_t flags = read_lock_irqsave(&vfs_lock);
+  const char *result = vfs_name_at_locked(index);
+  read_unlock_irqrestore(&vfs_lock, flags);
+  return result;
 }
 
-uint8_t vfs_capacity(void) {
-  return VFS_MAX_NODES;
+uint32_t vfs_capacity(void) {
+  return vfs_chunk_count * VFS_CHUNK_NODES;
 }
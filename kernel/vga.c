@@ -1,24 +1,30 @@
 #include "kernel/vga.h"
+#include "kernel/io.h"
+#include "kernel/mm.h"
 
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
+#define CRTC_INDEX 0x3D4
+#define CRTC_DATA 0x3D5
+#define CRTC_START_HIGH 0x0C
+#define CRTC_START_LOW 0x0D
+#define CRTC_CURSOR_HIGH 0x0E
+#define CRTC_CURSOR_LOW 0x0F
 
-static volatile uint16_t *const VGA_BUFFER = (uint16_t *)0xB8000;
+static volatile uint16_t *const VGA_BUFFER = (uint16_t *)(MM_DIRECT_BASE + 0xB8000);
 
-static uint16_t vga_entry(char c, uint8_t color) {
-  return (uint16_t)color << 8 | (uint8_t)c;
+static void crtc_write16(uint8_t high_reg, uint8_t low_reg, uint16_t value) {
+  outb(CRTC_INDEX, high_reg);
+  outb(CRTC_DATA, (uint8_t)(value >> 8));
+  outb(CRTC_INDEX, low_reg);
+  outb(CRTC_DATA, (uint8_t)(value & 0xFF));
 }
 
 void vga_putc_at(char c, uint8_t color, uint8_t row, uint8_t col) {
-  VGA_BUFFER[row * VGA_WIDTH + col] = vga_entry(c, color);
-}
-
-char vga_read_at(uint8_t row, uint8_t col) {
-  uint16_t entry = VGA_BUFFER[row * VGA_WIDTH + col];
-  return (char)(entry & 0xFF);
+  VGA_BUFFER[row * VGA_WIDTH + col] = vga_cell(c, color);
 }
 
+/* Resets the display window to the start of text memory and blanks it. */
 void vga_clear(uint8_t color) {
+  vga_set_origin(0);
   for (uint16_t row = 0; row < VGA_HEIGHT; ++row) {
     for (uint16_t col = 0; col < VGA_WIDTH; ++col) {
       vga_putc_at(' ', color, row, col);
@@ -29,6 +35,23 @@ void vga_clear(uint8_t color) {
 void vga_write_at(const char *text, uint8_t color, uint8_t row, uint8_t col) {
   uint16_t index = row * VGA_WIDTH + col;
   while (*text && index < VGA_WIDTH * VGA_HEIGHT) {
-    VGA_BUFFER[index++] = vga_entry(*text++, color);
+    VGA_BUFFER[index++] = vga_cell(*text++, color);
+  }
+}
+
+/* Copies prepared cells into text memory; offset counts cells from 0xB8000. */
+void vga_write_cells(uint16_t offset, const uint16_t *cells, uint16_t count) {
+  volatile uint16_t *dst = VGA_BUFFER + offset;
+  for (uint16_t i = 0; i < count; ++i) {
+    dst[i] = cells[i];
   }
 }
+
+/* Moves the CRTC start address, i.e. which cell appears in the top-left corner. */
+void vga_set_origin(uint16_t offset) {
+  crtc_write16(CRTC_START_HIGH, CRTC_START_LOW, offset);
+}
+
+void vga_set_cursor(uint16_t offset) {
+  crtc_write16(CRTC_CURSOR_HIGH, CRTC_CURSOR_LOW, offset);
+}
@@ -0,0 +1,175 @@
+#include "kernel/workqueue.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/scheduler.h"
+#include "kernel/smp.h"
+
+#define WORKER_NAME_MAX 12
+
+/*
+ * One queue and one kworker thread per CPU. Interrupt handlers queue work
+ * here instead of doing it with interrupts off; the worker runs it at
+ * SCHED_PRIORITY_KERNEL with interrupts on, pinned to its CPU. Producers
+ * push onto head with a compare-and-swap, from any CPU and without a lock;
+ * the worker takes the whole list with one exchange and reverses it, so
+ * items run in the order they were queued.
+ */
+typedef struct {
+  work_t *head;
+  task_t *worker;
+  volatile uint8_t absent;
+  uint64_t queued;
+  uint64_t executed;
+  uint64_t max_delay;
+} __attribute__((aligned(64))) workqueue_t;
+
+static workqueue_t queues[SMP_MAX_CPUS];
+static char worker_names[SMP_MAX_CPUS][WORKER_NAME_MAX];
+
+static void worker_main(void *arg) {
+  workqueue_t *wq = (workqueue_t *)arg;
+  __atomic_store_n(&wq->worker, scheduler_self(), __ATOMIC_RELEASE);
+  for (;;) {
+    work_t *list = __atomic_exchange_n(&wq->head, 0, __ATOMIC_ACQUIRE);
+    if (!list) {
+      /* A push from now on finds the queue empty and wakes us; block() keeps that wakeup. */
+      uint64_t flags = interrupts_save();
+      if (!__atomic_load_n(&wq->head, __ATOMIC_ACQUIRE)) {
+        scheduler_block();
+      }
+      interrupts_restore(flags);
+      continue;
+    }
+    work_t *fifo = 0;
+    while (list) {
+      work_t *next = list->next;
+      list->next = fifo;
+      fifo = list;
+      list = next;
+    }
+    while (fifo) {
+      work_t *work = fifo;
+      fifo = work->next;
+      uint64_t now = rdtsc();
+      if (now > work->queued_at && now - work->queued_at > wq->max_delay) {
+        wq->max_delay = now - work->queued_at;
+      }
+      work_fn_t fn = work->fn;
+      void *fn_arg = work->arg;
+      __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+      fn(fn_arg);
+      wq->executed++;
+    }
+  }
+}
+
+static void worker_name(char *out, uint32_t cpu) {
+  const char *prefix = "kworker/";
+  uint32_t i = 0;
+  while (prefix[i]) {
+    out[i] = prefix[i];
+    i++;
+  }
+  if (cpu >= 10) {
+    out[i++] = (char)('0' + cpu / 10);
+  }
+  out[i++] = (char)('0' + cpu % 10);
+  out[i] = '\0';
+}
+
+/* Pushes work onto wq and returns the previous head, so 0 means the worker may be asleep. */
+static work_t *workqueue_push(workqueue_t *wq, work_t *work) {
+  work_t *head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  do {
+    work->next = head;
+  } while (!__atomic_compare_exchange_n(&wq->head, &head, work, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+  return head;
+}
+
+/*
+ * Starts a worker on every online CPU. Work queued earlier waits and runs as
+ * soon as its worker starts. A CPU whose worker could not be created hands
+ * what it already holds, and everything queued for it later, to CPU 0.
+ */
+void workqueue_init(void) {
+  for (uint32_t cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+    worker_name(worker_names[cpu], cpu);
+    if (scheduler_spawn_system(worker_names[cpu], worker_main, &queues[cpu], cpu) >= 0) {
+      continue;
+    }
+    workqueue_t *wq = &queues[cpu];
+    __atomic_store_n(&wq->absent, 1, __ATOMIC_RELEASE);
+    if (cpu == 0) {
+      continue;
+    }
+    work_t *list = __atomic_exchange_n(&wq->head, 0, __ATOMIC_ACQUIRE);
+    while (list) {
+      work_t *next = list->next;
+      workqueue_push(&queues[0], list);
+      list = next;
+    }
+  }
+  task_t *worker = __atomic_load_n(&queues[0].worker, __ATOMIC_ACQUIRE);
+  if (worker && __atomic_load_n(&queues[0].head, __ATOMIC_ACQUIRE)) {
+    scheduler_wake(worker);
+  }
+}
+
+void work_init(work_t *work, work_fn_t fn, void *arg) {
+  work->next = 0;
+  work->fn = fn;
+  work->arg = arg;
+  work->queued_at = 0;
+  work->pending = 0;
+}
+
+/*
+ * Queues work for cpu's worker, or for CPU 0's if cpu has none. Returns 0,
+ * or -1 if the item is already pending (it will run once either way), cpu
+ * is out of range or no worker will ever run it. Safe from interrupt
+ * handlers, but not while holding the scheduler lock, since waking the
+ * worker takes it.
+ */
+int work_queue_on(uint32_t cpu, work_t *work) {
+  if (!work || !work->fn || cpu >= SMP_MAX_CPUS) {
+    return -1;
+  }
+  workqueue_t *wq = &queues[cpu];
+  if (__atomic_load_n(&wq->absent, __ATOMIC_ACQUIRE)) {
+    wq = &queues[0];
+    if (__atomic_load_n(&wq->absent, __ATOMIC_ACQUIRE)) {
+      return -1;
+    }
+  }
+  if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL)) {
+    return -1;
+  }
+  work->queued_at = rdtsc();
+  work_t *head = workqueue_push(wq, work);
+  __atomic_fetch_add(&wq->queued, 1, __ATOMIC_RELAXED);
+  task_t *worker = __atomic_load_n(&wq->worker, __ATOMIC_ACQUIRE);
+  if (!head && worker) {
+    scheduler_wake(worker);
+  }
+  return 0;
+}
+
+/* Queues work on the calling CPU. */
+int work_queue(work_t *work) {
+  uint64_t flags = interrupts_save();
+  int result = work_queue_on(smp_cpu_index(), work);
+  interrupts_restore(flags);
+  return result;
+}
+
+int workqueue_stats(uint32_t cpu, workqueue_stats_t *out) {
+  if (!out || cpu >= smp_cpu_count()) {
+    return -1;
+  }
+  const workqueue_t *wq = &queues[cpu];
+  out->queued = wq->queued;
+  out->executed = wq->executed;
+  out->max_delay_cycles = wq->max_delay;
+  return 0;
+}